@@ -7,9 +7,8 @@
 // - doMsetInsert
 //	 The following code was adapted from the comp2521 2024T3 avl slides.
 //	 Link: https://cgi.cse.unsw.edu.au/~cs2521/24T3/lectures/Week4Mon-avl.pdf
-//	 It recursively traverses through the current tree and inserts the new item
-//	 with the given amount when it has traversed to the correct position in the 
-//	 tree. It also rebalances the tree.
+//	 It walks down the tree to the correct position of the item, inserts the
+//	 new item with the given amount there and rebalances the path back up.
 // - avlRebalance
 //	 The following code was adapted from the comp2521 2024T3 avl slides.
 //	 Link: https://cgi.cse.unsw.edu.au/~cs2521/24T3/lectures/Week4Mon-avl.pdf
@@ -33,40 +32,128 @@
 // - doMsetDelete
 //	 The following code was adapted from the comp2521 2024T3 avl slides.
 //	 Link: https://cgi.cse.unsw.edu.au/~cs2521/24T3/lectures/Week4Mon-avl.pdf
-//	 It recursively traverses through the tree until we are at the node with the
-//	 item, then deletes it or subtracts the given amount and rebalances the tree.
-// - bstJoin
-//	 The following code was adapted from the comp2521 2024T3 bst slides.
-//	 Link: https://cgi.cse.unsw.edu.au/~cs2521/24T3/lectures/Week3Mon-bst.pdf
-//	 Joins two trees into one tree.
-// - mergeSort
-//	 The following code was adapted from the comp2521 2024T3 divide-and-conquer-
-//	 sorts slides.
-//	 Link: https://cgi.cse.unsw.edu.au/~cs2521/24T3/lectures/Week2Wed-divide-and-conquer-sorts.pdf
-//	 It uses the mergeSort algorithm to sort the given array in descending order.
-// - merge
-//	 The following code was adapted from the comp2521 2024T3 divide-and-conquer-
-//	 sorts slides.
-//	 Link: https://cgi.cse.unsw.edu.au/~cs2521/24T3/lectures/Week2Wed-divide-and-conquer-sorts.pdf
-//	 It uses the mergeSort algorithm to sort the given array.
+//	 It walks down the tree to the node with the item, then deletes it or
+//	 subtracts the given amount and rebalances the path back up.
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include "Mset.h"
 #include "MsetStructs.h"
 
+// Number of nodes in the first and the biggest slabs of a node pool.
+#define POOL_MIN_SLAB 64
+#define POOL_MAX_SLAB 65536
+
+// An upper bound on the height of an AVL tree with fewer than 2^31 nodes
+// (about 1.44 * 31), used to size the path stacks of the tree operations.
+#define MAX_HEIGHT 64
+
+// An upper bound on the number of inner levels of a B+ tree. A level is only
+// added when the root splits, and every split halves a node of 64 keys, so each
+// level needs about 32 times as many elements as the one below to grow.
+#define BTREE_MAX_HEIGHT 16
+
+// Number of elements per leaf and children per inner node that btreeLoad aims
+// for, which leaves room for inserts before the nodes have to be split.
+#define BTREE_FILL (BTREE_KEYS * 3 / 4)
+
+// Number of keys in a block of the lookup index, which fills a cache line.
+#define LOOKUP_BLOCK 16
+
+// Largest number of shards of a sharded multiset, which keeps the arithmetic
+// that maps an element to its shard within a long long.
+#define MAX_SHARDS 1024
+
+// Number of counts of readers of a concurrent multiset. Threads are handed them
+// in turn, so up to this many threads read without sharing a cache line.
+#define SYNC_SLOTS 32
+
+// Smallest total size of two multisets for which the parallel set operations
+// are used, and smallest subproblem that is handed to another thread.
+#define PARALLEL_MIN 65536
+#define PARALLEL_GRAIN 4096
+
+// Number of elements in a block of a saved multiset, and number of bytes that
+// MsetSave gathers before each write.
+#define SAVED_BLOCK 64
+#define SAVE_BUFFER 65536
+
+// Start of every file written by MsetSave, which changes with the format.
+#define SAVED_MAGIC "MSETv1\n"
+
+// Number of bits of a compact node's shape that hold the height of its subtree.
+// The rest hold its size, which limits a compact multiset to COMPACT_MAX_SIZE
+// distinct elements.
+#define COMPACT_HEIGHT_BITS 6
+#define COMPACT_MAX_SIZE ((1 << (32 - COMPACT_HEIGHT_BITS)) - 1)
+
+// Number of nodes, including the empty node, in a new compact multiset.
+#define COMPACT_MIN_NODES 16
+
+// The hooks of the statistics kept when the library is built with MSET_STATS,
+// which compile to nothing otherwise. STATS_START declares a variable holding
+// the time a call started, which STATS_CALL adds to the call's histogram.
+#ifdef MSET_STATS
+#define STATS_ADD(s, field, n) \
+	__atomic_add_fetch(&(s)->stats.field, (n), __ATOMIC_RELAXED)
+#define STATS_START(start) uint64_t start = statsNow()
+#define STATS_CALL(s, call, start) statsCall(s, call, start)
+#define STATS_ROTATION(s, tree) statsRotation(s, tree)
+#define STATS_HEIGHT(s) statsHeight(s)
+#else
+#define STATS_ADD(s, field, n) ((void)(n))
+#define STATS_START(start)
+#define STATS_CALL(s, call, start)
+#define STATS_ROTATION(s, tree)
+#define STATS_HEIGHT(s)
+#endif
+
+/*
+* The representations a multiset can store its elements in.
+*/
+enum msetKind {
+	KIND_AVL,
+	KIND_BTREE,
+	KIND_DENSE,
+	KIND_SHARDED,
+	KIND_SNAPSHOT,
+	KIND_MAPPED,
+	KIND_COMPACT,
+};
 
 // Part 1
 static void printNullError(void);
-static void doMsetFree(struct node *tree);
+static bool readOnly(Mset s);
+static void doMsetFree(Mset s);
 
-static struct node *doMsetInsert(Mset s, struct node *tree, int item,
-int amount);
-static struct node *newNode(int item, int amount);
-static void setCursorList(struct node *tree, Mset s, bool left);
+static void doMsetInsert(Mset s, int item, int amount);
+static struct node *newNode(Mset s, int item, int amount);
+static struct node *poolAlloc(struct nodePool *pool);
+static void freeNode(Mset s, struct node *node);
+static void freePool(struct nodePool *pool);
+static void linkNode(Mset s, struct node *node, struct node *prev,
+struct node *next);
+static void rebalancePath(Mset s, struct node **path[], int depth);
+static void updateNode(struct node *tree);
+static void updateTotals(struct node *tree);
+static int treeSize(struct node *tree);
+static int treeCount(struct node *tree);
 static int recomputeHeight(struct node *tree);
 static int max(struct node *node1, struct node *node2);
 static struct node *avlRebalance(struct node *tree);
@@ -74,26 +161,326 @@ static int balance(struct node *tree);
 static struct node *rotateRight(struct node *tree);
 static struct node *rotateLeft(struct node *tree);
 
-static struct node *doMsetDelete(Mset s, struct node *tree, int item,
-int amount);
-static void updateLink(struct node *tree);
-static struct node *bstJoin(struct node *left, struct node *right);
+static void doMsetInsertMany(Mset s, int item, int amount);
+static void insertItems(Mset s, struct item *batch, int n);
+static void doMsetInsertItems(Mset s, struct item *batch, int n);
+static int collapseBatch(struct item *batch, int n);
+static int compareElems(const void *a, const void *b);
+static void doMsetInsertBatch(Mset s, struct item *batch, int n);
 
-static struct node *bstFind(struct node *tree, int item);
+static void doMsetDeleteMany(Mset s, int item, int amount);
+static void doMsetDelete(Mset s, int item, int amount);
+static int detachNode(Mset s, struct node **path[], int depth,
+struct node **link);
+static void unlinkNode(Mset s, struct node *node);
 
-static void doMsetPrint(struct node *tree, FILE *file, int *size);
+static int doMsetGetCount(Mset s, int item);
+static struct node *bstFind(struct node *tree, int item);
+static void countChanged(Mset s, int item, int oldCount, int newCount);
+static void updateHash(Mset s, int item, int oldCount, int newCount);
+static uint64_t itemHash(int item, int count);
 
 //Part 2
-static void doMsetUnion(Mset setUnion, struct node *t1, struct node *t2);
+static Mset doMsetCombine(Mset s1, Mset s2, int op);
+static Mset doMsetIntersection(Mset s1, Mset s2);
+static void mergeInto(Mset dst, Mset src, int op);
+static void doMsetMergeInto(Mset dst, Mset src, int op);
+static void doMsetMergeList(Mset dst, Mset src, int op);
+static void doMsetMergeChanges(Mset dst, Mset src, int op, bool probe);
+static void doMsetMerge(Mset result, Mset s1, Mset s2, int op);
+static void doMsetIntersectionProbe(Mset result, Mset small, Mset big);
+static int mergeCount(int op, int count1, int count2);
+static void appendNode(Mset result, struct node **tail, int item, int amount);
+static void finishList(Mset result, struct node *head, struct node *tail);
+static struct node *listToTree(struct node **head, int n);
+
+static void loadItems(Mset s, struct item *items, int n);
+
+static bool doMsetIncluded(Mset s1, Mset s2);
+static bool doMsetIncludedWalk(Mset s1, Mset s2);
+static bool doMsetIncludedProbe(Mset s1, Mset s2);
+static bool doMsetEquals(Mset s1, Mset s2);
+
+static int doMsetMostCommon(Mset s, int k, struct item items[]);
+
+static int countIndexMostCommon(Mset s, int k, struct item items[]);
+static void countIndexUpdate(Mset s, int item, int oldCount, int newCount);
+static void countIndexInsert(Mset s, struct node *new);
+static struct node *countIndexRemove(Mset s, int item, int count);
+static int countOrder(int item, int count, struct node *node);
+static void freeTree(struct node *tree);
+static bool moreCommon(struct item item1, struct item item2);
+static void heapSiftUp(struct item heap[], int i);
+static void heapSiftDown(struct item heap[], int i, int n);
+static void heapSort(struct item heap[], int n);
+
+//Order Statistics
+static int doMsetRank(Mset s, int item);
+static struct item doMsetSelect(Mset s, int index);
+static struct item doMsetSelectByCount(Mset s, int position);
+static int doMsetCountRange(Mset s, int lo, int hi);
+static int countBelow(struct node *tree, int item, bool inclusive);
+
+//Cursor Operations
+static void cursorInit(struct cursor *cur, Mset s, struct node **path);
+static struct item cursorGet(MsetCursor cur);
+static bool cursorNext(MsetCursor cur);
+static bool cursorPrev(MsetCursor cur);
+static bool cursorSeek(MsetCursor cur, int item, bool after);
+static struct node *bstLowerBound(struct node *tree, int item, bool after);
+static int cursorNextN(MsetCursor cur, int n, struct item items[]);
+
+//B+ Trees
+static struct btree *btreeNew(void);
+static struct bleaf *btreeNewLeaf(void);
+static struct binner *btreeNewInner(void);
+static void btreeFree(struct btree *tree);
+static void btreeClear(struct btree *tree);
+static void btreeFreeNode(void *node, int height);
+static int btreeSlot(const int keys[], int size, int item, bool inclusive);
+static struct bleaf *btreeDescend(struct btree *tree, int item,
+struct binner *path[], int slots[]);
+static int btreeGetCount(struct btree *tree, int item);
+static void btreeInsert(Mset s, int item, int amount);
+static struct bleaf *btreeSplitLeaf(struct btree *tree, struct bleaf *leaf);
+static struct binner *btreeInsertChild(struct binner *inner, int slot, int key,
+void *child, bool leaves, int *upKey);
+static void btreeTotals(void *node, bool leaves, int *size, int *count);
+static void btreeInsertBatch(Mset s, struct item *batch, int n);
+static void btreeLoad(struct btree *tree, struct item *items, int n);
+static void btreeDelete(Mset s, int item, int amount);
+static void btreeFixLeaf(struct btree *tree, struct bleaf *leaf,
+struct binner *path[], int slots[]);
+static void btreeRemoveChild(struct btree *tree, struct binner *path[],
+int slots[], int depth, int child);
+static void btreeUnlinkLeaf(struct btree *tree, struct bleaf *leaf);
+static int btreeRank(struct btree *tree, int item);
+static struct item btreeSelect(struct btree *tree, int index);
+static struct item btreeSelectByCount(struct btree *tree, int position);
+static int btreeCountBelow(struct btree *tree, int item, bool inclusive);
+static bool btreeCursorNext(MsetCursor cur);
+static bool btreeCursorPrev(MsetCursor cur);
+static bool btreeCursorSeek(MsetCursor cur, int item, bool after);
+static int btreeCursorNextN(MsetCursor cur, int n, struct item items[]);
+
+//Lookup Index
+static struct lookupIndex *lookupNew(void);
+static void lookupFree(struct lookupIndex *index);
+static bool lookupReady(Mset s);
+static void lookupBuild(Mset s);
+static void lookupFill(struct lookupIndex *index, int k, struct cursor *cur,
+bool *more);
+static inline int lookupGetCount(struct lookupIndex *index, int item,
+int (*blockRank)(const int block[], int item));
+static void chooseLookupSearch(void);
+#if defined(__x86_64__)
+static int lookupSearchAvx2(struct lookupIndex *index, int item);
+static int blockRankAvx2(const int block[], int item);
+static int lookupSearchSse2(struct lookupIndex *index, int item);
+static int blockRankSse2(const int block[], int item);
+#else
+static int lookupSearchScalar(struct lookupIndex *index, int item);
+static int blockRankScalar(const int block[], int item);
+#endif
+
+//Dense Multisets
+static struct dense *denseNew(int lo, int hi);
+static void denseFree(struct dense *dense);
+static int denseRange(struct dense *dense);
+static bool denseContains(struct dense *dense, int item);
+static bool denseMatch(Mset s1, Mset s2);
+static void denseInsert(Mset s, int item, int amount);
+static void denseDelete(Mset s, int item, int amount);
+static void denseToTree(Mset s);
+static void denseMerge(Mset result, Mset s1, Mset s2, int op);
+static int denseNextSlot(struct dense *dense, int from);
+static int densePrevSlot(struct dense *dense, int from);
+static long long denseSlotOf(struct dense *dense, int item, bool after);
+static int denseRank(struct dense *dense, int item);
+static struct item denseSelect(struct dense *dense, int index);
+static struct item denseSelectByCount(struct dense *dense, int position);
+static int denseCountBelow(struct dense *dense, int item, bool inclusive);
+static bool denseCursorNext(MsetCursor cur);
+static bool denseCursorPrev(MsetCursor cur);
+static bool denseCursorSeek(MsetCursor cur, int item, bool after);
+static int denseCursorNextN(MsetCursor cur, int n, struct item items[]);
+
+//Concurrency
+static struct msetSync *syncNew(void);
+static void syncFree(struct msetSync *sync);
+static int *threadReaders(Mset s);
+static void writeLock(Mset s);
+static void syncPublish(Mset s);
+static void writeUnlock(Mset s);
+static void readLock(Mset s);
+static void readUnlock(Mset s);
+static void readLockPair(Mset s1, Mset s2);
+static void readUnlockPair(Mset s1, Mset s2);
+static bool syncCursorMove(MsetCursor cur, bool forward);
+static void syncCursorRecover(MsetCursor cur, bool forward);
+static struct item syncCursorGet(MsetCursor cur);
+static bool syncCursorSeek(MsetCursor cur, int item, bool after);
+
+//Sharded Multisets
+static Mset shardsNew(int n, int lo, int hi);
+static void shardsFree(struct shards *shards);
+static int shardIndex(struct shards *shards, int item);
+static Mset shardFor(Mset s, int item);
+static int shardsTotal(Mset s, bool total);
+static void shardsInsertItems(Mset s, struct item *batch, int n);
+static bool shardsMatch(Mset s1, Mset s2);
+static Mset shardsFlatten(Mset s);
+static Mset shardsSetOp(Mset s1, Mset s2, Mset (*op)(Mset, Mset));
+static bool shardsTest(Mset s1, Mset s2, bool (*test)(Mset, Mset));
+static Mset shardsSnapshot(Mset s);
+static void shardsMergeInto(Mset dst, Mset src, int op);
+static int shardsRank(Mset s, int item);
+static struct item shardsSelect(Mset s, int index, bool byCount);
+static int shardsCountRange(Mset s, int lo, int hi);
+static bool shardsCursorNext(MsetCursor cur);
+static bool shardsCursorPrev(MsetCursor cur);
+static bool shardsCursorSeek(MsetCursor cur, int item, bool after);
+
+//Write Combining
+static struct combiner *combinerNew(int threshold, bool flushOnRead);
+static void combinerFree(struct combiner *combiner);
+static struct combineBuffer *combineBufferFor(Mset s);
+static void combineInsert(Mset s, int item, int amount);
+static void combineFlushBuffer(Mset s, struct combineBuffer *buffer);
+static void combineBeforeRead(Mset s);
+
+//Parallel Set Operations
+static bool spawnTask(pthread_t *thread, void *(*run)(void *), void *arg);
+static void joinTask(pthread_t thread);
+static bool joinApplies(Mset s1, Mset s2);
+static void joinMergeSets(Mset result, Mset s1, Mset s2, int op);
+static struct node *poolReserve(struct nodePool *pool, int n);
+static void *joinCopyTask(void *arg);
+static struct node *joinCopy(struct node *tree, struct node *block);
+static void *joinMergeTask(void *arg);
+static struct node *joinMerge(struct node *tree1, struct node *tree2, int op,
+bool pooled);
+static void joinDiscard(struct node *node, bool pooled);
+static void joinDiscardTree(struct node *tree, bool pooled);
+static int joinHeight(struct node *tree);
+static struct node *joinSplit(struct node *tree, int item, struct node **left,
+struct node **right);
+static struct node *join(struct node *left, struct node *pivot,
+struct node *right);
+static struct node *joinRight(struct node *left, struct node *pivot,
+struct node *right);
+static struct node *joinLeft(struct node *left, struct node *pivot,
+struct node *right);
+static struct node *joinPair(struct node *left, struct node *right);
+static struct node *joinSplitLast(struct node *tree, struct node **rest);
+static void *joinFinishTask(void *arg);
+static bool joinIncludedSets(Mset s1, Mset s2);
+static void *joinIncludedTask(void *arg);
+
+//Snapshots
+static Mset doMsetSnapshot(Mset s);
+static struct node *ownLink(Mset s, struct node **link);
+static struct node *ownCopy(Mset s, struct node **link);
+static void ownRotated(Mset s, struct node *tree);
+static void ownTree(Mset s, struct node **link);
+static void nodeRetain(struct node *node);
+static void nodeRelease(struct nodePool *pool, struct node *node);
+static void poolRelease(struct nodePool *pool);
 
-static void doMsetIntersection(Mset setIntersection, struct node *t1, 
-struct node *t2);
+//Saved Multisets
+static bool doMsetSave(Mset s, int fd);
+static void saveBytes(struct saveBuffer *buffer, const void *bytes, size_t n);
+static void saveFlush(struct saveBuffer *buffer);
+static int varintLength(uint32_t value);
+static int varintWrite(uint8_t *bytes, uint32_t value);
+static const uint8_t *varintRead(const uint8_t *bytes, const uint8_t *end,
+uint32_t *value);
+static bool mappedValid(const struct savedHeader *header, size_t length);
+static void mappedFree(struct mapped *mapped);
+static const uint8_t *mappedBlockEnd(struct mapped *mapped, int b);
+static int mappedBlockOf(struct mapped *mapped, int item, bool inclusive);
+static int mappedGetCount(struct mapped *mapped, int item);
+static void mappedCursorStart(MsetCursor cur, int b);
+static void mappedCursorStep(MsetCursor cur);
+static bool mappedCursorNext(MsetCursor cur);
+static bool mappedCursorPrev(MsetCursor cur);
+static bool mappedCursorSeek(MsetCursor cur, int item, bool after);
+static int mappedCursorNextN(MsetCursor cur, int n, struct item items[]);
+static int mappedCountBelow(Mset s, int item, bool inclusive);
+static struct item mappedSelect(Mset s, int index);
+static struct item mappedSelectByCount(Mset s, int position);
+static int mappedMostCommon(Mset s, int k, struct item items[]);
 
-static bool doMsetIncluded(struct node *t1, struct node *t2);
+//Statistics
+#ifdef MSET_STATS
+static uint64_t statsNow(void);
+static void statsCall(Mset s, int call, uint64_t start);
+static void statsRotation(Mset s, struct node *tree);
+static void statsHeight(Mset s);
+static size_t statsBytes(Mset s);
+static size_t statsBtreeBytes(void *node, int height);
+#endif
 
-static void copyArray(struct node *tree, struct item *elements, int *index);
-static void mergeSort(struct item *elements, int lo, int hi);
-static void merge(struct item *elements, int lo, int mid, int hi);
+//Compact Multisets
+static struct compact *compactNew(void);
+static void compactFree(struct compact *compact);
+static void compactReserve(struct compact *compact, uint32_t n);
+static uint32_t compactAlloc(Mset s, int item, int amount);
+static void compactRelease(Mset s, uint32_t i);
+static int compactSize(const struct cnode *node);
+static int compactHeight(const struct cnode *node);
+static void compactUpdate(struct cnode *nodes, uint32_t i);
+static void compactUpdateTotals(struct cnode *nodes, uint32_t i);
+static uint32_t compactRotateRight(struct cnode *nodes, uint32_t i);
+static uint32_t compactRotateLeft(struct cnode *nodes, uint32_t i);
+static uint32_t compactRebalance(Mset s, uint32_t i);
+static void compactRebalancePath(Mset s, uint32_t path[], int depth);
+static void compactReplaceChild(Mset s, uint32_t path[], int depth,
+uint32_t old, uint32_t new);
+static void compactInsert(Mset s, int item, int amount);
+static void compactDelete(Mset s, int item, int amount);
+static int compactDetach(Mset s, uint32_t path[], int depth, uint32_t i);
+static int compactGetCount(Mset s, int item);
+static void compactLoad(struct compact *compact, struct item *items, int n);
+static uint32_t compactBuild(struct cnode *nodes, struct item *items, int lo,
+int hi);
+static int compactCollect(const struct cnode *nodes, uint32_t i,
+struct item *items, int n);
+static void compactInsertBatch(Mset s, struct item *batch, int n);
+static void compactToTree(Mset s);
+static uint32_t compactLowerBound(struct compact *compact, int item,
+bool after);
+static uint32_t compactUpperBound(struct compact *compact, int item,
+bool before);
+static bool compactCursorMove(MsetCursor cur, bool forward);
+static bool compactCursorSeek(MsetCursor cur, int item, bool after);
+static int compactRank(struct compact *compact, int item);
+static struct item compactSelect(struct compact *compact, int index);
+static struct item compactSelectByCount(struct compact *compact,
+int position);
+static int compactCountBelow(struct compact *compact, int item,
+bool inclusive);
+static int compactMostCommon(Mset s, int k, struct item items[]);
+
+//Multisets Without a List
+static bool keepsPath(Mset s);
+static void treeCursorReserve(MsetCursor cur);
+static bool treeCursorMove(MsetCursor cur, bool forward);
+static void treeCursorDescend(MsetCursor cur, struct node *tree,
+bool forward);
+static bool treeCursorSeek(MsetCursor cur, int item, bool after);
+static void threadList(Mset s);
+
+//Stale Cursors
+static bool cursorStale(MsetCursor cur);
+static void cursorKeep(MsetCursor cur);
+static void cursorRecover(MsetCursor cur, bool forward);
+static struct item staleCursorGet(MsetCursor cur);
+
+// The search of the lookup index used by MsetGetCount, picked by
+// chooseLookupSearch on the first build of a lookup index in any thread.
+static int (*lookupSearch)(struct lookupIndex *index, int item);
+static pthread_once_t lookupSearchChosen = PTHREAD_ONCE_INIT;
 
 ////////////////////////////////////////////////////////////////////////
 // Basic Operations
@@ -102,19 +489,150 @@ static void merge(struct item *elements, int lo, int mid, int hi);
  * Creates a new empty multiset.
  */
 Mset MsetNew(void) {
+	return MsetNewWithFlags(0);
+}
+
+/**
+ * Creates a new empty multiset with the given options, which are
+ * MSET_* flags combined with bitwise or.
+ */
+Mset MsetNewWithFlags(int flags) {
 	struct mset *new = malloc(sizeof(struct mset));
 	if (new == NULL) {
 		printNullError();
 	}
+	new->sync = NULL;
+	if (flags & MSET_CONCURRENT) {
+		//cursors of concurrent multisets follow the list and find their
+		//element again in the tree, so the other representations are not
+		//used.
+		flags &= ~(MSET_BTREE | MSET_LOOKUP_INDEX | MSET_COMPACT |
+		MSET_NO_LIST);
+		new->sync = syncNew();
+	}
+	new->flags = flags;
+	new->kind = KIND_AVL;
+	new->btree = NULL;
+	new->dense = NULL;
+	new->shards = NULL;
+	new->combiner = NULL;
+	new->shared = false;
+	new->mapped = NULL;
+	new->compact = NULL;
+	new->pool = NULL;
+	new->countTree = NULL;
+	new->lookup = NULL;
+	if (flags & MSET_LOOKUP_INDEX) {
+		new->lookup = lookupNew();
+	}
+	if (flags & MSET_BTREE) {
+		new->kind = KIND_BTREE;
+		new->btree = btreeNew();
+	} else if (flags & MSET_COMPACT) {
+		new->kind = KIND_COMPACT;
+		new->compact = compactNew();
+	} else if (flags & MSET_NODE_POOL) {
+		new->pool = malloc(sizeof(struct nodePool));
+		if (new->pool == NULL) {
+			printNullError();
+		}
+		new->pool->slabs = NULL;
+		new->pool->freeList = NULL;
+		new->pool->returned = NULL;
+		new->pool->users = 1;
+	}
 	new->tree = NULL;
 	new->size = 0;
 	new->totalCount = 0;
 	new->listBegin = NULL;
 	new->listEnd = NULL;
-	new->subTreeNext = NULL;
-	new->subTreePrev = NULL;
-	new->smallest = INT_MAX;
-	new->biggest = INT_MIN;
+	new->hash = 0;
+	new->epoch = 0;
+#ifdef MSET_STATS
+	memset(&new->stats, 0, sizeof(new->stats));
+#endif
+	return new;
+}
+
+/**
+ * Creates a new multiset holding the given n items, which should be in
+ * strictly increasing order of element. Items equal to UNDEFINED or
+ * with a count of 0 or less are skipped.
+ */
+Mset MsetFromSortedItems(const struct item *items, size_t n) {
+	//the nodes are allocated in one go, which a pool turns into a few slabs.
+	Mset s = MsetNewWithFlags(MSET_NODE_POOL);
+	size_t i = 1;
+	while (i < n && items[i - 1].elem < items[i].elem) {
+		i++;
+	}
+
+	if (i < n) {
+		//the items are not sorted after all, so they are sorted as a batch.
+		struct item *batch = malloc(n * sizeof(struct item));
+		if (batch == NULL) {
+			printNullError();
+		}
+		int size = 0;
+		for (i = 0; i < n; i++) {
+			if (items[i].elem != UNDEFINED && items[i].count > 0) {
+				batch[size++] = items[i];
+			}
+		}
+		doMsetInsertItems(s, batch, size);
+		free(batch);
+		return s;
+	}
+
+	struct node head = {.next = NULL};
+	struct node *tail = &head;
+	for (i = 0; i < n; i++) {
+		if (items[i].elem != UNDEFINED) {
+			appendNode(s, &tail, items[i].elem, items[i].count);
+		}
+	}
+	finishList(s, head.next, tail);
+	return s;
+}
+
+/**
+ * Creates a new empty multiset for elements from lo to hi inclusive,
+ * which keeps a count for every element in that range in a flat array
+ * with a bitmap of the elements that are present. Inserting an element
+ * outside the range moves the elements into an ordinary multiset. If lo
+ * is greater than hi or hi - lo does not fit in an int, an ordinary
+ * multiset is returned.
+ */
+Mset MsetNewDense(int lo, int hi) {
+	if (lo == UNDEFINED || lo > hi || (long long)hi - lo >= INT_MAX) {
+		return MsetNew();
+	}
+
+	Mset new = MsetNew();
+	new->kind = KIND_DENSE;
+	new->dense = denseNew(lo, hi);
+	return new;
+}
+
+/**
+ * Creates a new empty multiset that is split into nShards concurrent
+ * multisets by element range. The elements from lo to hi are cut into
+ * nShards equal ranges, elements below lo go to the first shard and
+ * elements above hi to the last. If nShards is less than 1 or lo is
+ * greater than hi, a single shard is used, and at most 1024 shards are
+ * used.
+ */
+Mset MsetNewSharded(int nShards, int lo, int hi) {
+	if (nShards < 1 || lo > hi) {
+		nShards = 1;
+	} else if (nShards > MAX_SHARDS) {
+		nShards = MAX_SHARDS;
+	}
+
+	Mset new = shardsNew(nShards, lo, hi);
+	for (int i = 0; i < nShards; i++) {
+		new->shards->parts[i] = MsetNewWithFlags(MSET_CONCURRENT);
+	}
 	return new;
 }
 
@@ -126,25 +644,86 @@ static void printNullError(void) {
 	exit(EXIT_FAILURE);
 }
 
+/*
+* Checks if the multiset is a snapshot or a mapped file, which inserts and
+* deletes leave alone.
+*/
+static bool readOnly(Mset s) {
+	return s->kind == KIND_SNAPSHOT || s->kind == KIND_MAPPED;
+}
+
 /**
  * Frees all memory allocated to the multiset.
  */
 void MsetFree(Mset s) {
-	doMsetFree(s->tree);
+	if (s->shared) {
+		//nodes still linked to by a snapshot or by the multiset a snapshot
+		//was taken from are kept, and so is the pool they are in.
+		nodeRelease(s->pool, s->tree);
+		nodeRelease(s->pool, s->countTree);
+		if (s->pool != NULL) {
+			poolRelease(s->pool);
+		}
+	} else if (s->pool != NULL) {
+		//every node lives in one of the pool's slabs.
+		freePool(s->pool);
+	} else {
+		if (s->kind == KIND_BTREE) {
+			btreeFree(s->btree);
+		} else if (s->kind == KIND_DENSE) {
+			denseFree(s->dense);
+		} else if (s->kind == KIND_SHARDED) {
+			shardsFree(s->shards);
+		} else if (s->kind == KIND_MAPPED) {
+			mappedFree(s->mapped);
+		} else if (s->kind == KIND_COMPACT) {
+			compactFree(s->compact);
+		} else {
+			doMsetFree(s);
+		}
+		freeTree(s->countTree);
+	}
+	if (s->lookup != NULL) {
+		lookupFree(s->lookup);
+	}
+	if (s->sync != NULL) {
+		syncFree(s->sync);
+	}
+	if (s->combiner != NULL) {
+		combinerFree(s->combiner);
+	}
 	free(s);
 }
 
 /*
-* Frees all the memory allocated to the tree.
+* Frees all the nodes of the multiset by walking its list, which holds every
+* node of the tree, or the tree itself if there is no list.
 */
-static void doMsetFree(struct node *tree) {
-	if (tree == NULL) {
+static void doMsetFree(Mset s) {
+	if (s->flags & MSET_NO_LIST) {
+		freeTree(s->tree);
 		return;
 	}
 
-	doMsetFree(tree->left);
-	doMsetFree(tree->right);
-	free(tree);
+	struct node *curr = s->listBegin;
+	while (curr != NULL) {
+		struct node *next = curr->next;
+		free(curr);
+		curr = next;
+	}
+}
+
+/*
+* Frees all the slabs of a node pool and the pool itself.
+*/
+static void freePool(struct nodePool *pool) {
+	struct nodeSlab *slab = pool->slabs;
+	while (slab != NULL) {
+		struct nodeSlab *next = slab->next;
+		free(slab);
+		slab = next;
+	}
+	free(pool);
 }
 
 /**
@@ -152,118 +731,225 @@ static void doMsetFree(struct node *tree) {
  * equal to UNDEFINED.
  */
 void MsetInsert(Mset s, int item) {
-	if (item != UNDEFINED) {
-		s->tree = doMsetInsert(s, s->tree, item, 1);
-		s->subTreeNext = NULL;
-		s->subTreePrev = NULL;
-		s->totalCount++;
-	}
+	MsetInsertMany(s, item, 1);
 }
 
 /*
 * Insets an item into the tree.
 * The following code was adapted from the comp2521 2024T3 avl slides.
 * Link: https://cgi.cse.unsw.edu.au/~cs2521/24T3/lectures/Week4Mon-avl.pdf
-* It recursively traverses through the current tree and inserts the new item
-* with the given amount when it has traversed to the correct position in the 
-* tree. It also rebalances the tree.
+* It walks down the tree to the correct position of the item, remembering the
+* links it followed, and either adds the amount to the item's node or hangs a
+* new node there. The new node's neighbours in the list are the last nodes on
+* the path where the walk went right and left. The path is then rebalanced
+* bottom-up.
 */
-static struct node *doMsetInsert(Mset s, struct node *tree, int item,
-int amount) {
-	if (tree == NULL) {
-		tree = newNode(item, amount);
-		s->size++;
+static void doMsetInsert(Mset s, int item, int amount) {
+	struct node **path[MAX_HEIGHT];
+	int depth = 0;
+	struct node **link = &s->tree;
+	struct node *prev = NULL;
+	struct node *next = NULL;
 
-		if (tree->elem < s->smallest) {
-			//Ensures that listBegin is the smallest element of the multiset.
-			s->listBegin = tree;
-			s->smallest = tree->elem;
+	while (*link != NULL) {
+		struct node *curr = ownLink(s, link);
+		if (item == curr->elem) {
+			//the item is already in the tree so only the counts of the
+			//subtrees on the path change.
+			countChanged(s, item, curr->count, curr->count + amount);
+			curr->count += amount;
+			path[depth++] = link;
+			rebalancePath(s, path, depth);
+			return;
 		}
 
-		if (tree->elem > s->biggest) {
-			//Ensures that listEnd is the biggest element of the multiset.
-			s->listEnd = tree;
-			s->biggest = tree->elem;
+		path[depth++] = link;
+		if (item < curr->elem) {
+			next = curr;
+			link = &curr->left;
+		} else {
+			prev = curr;
+			link = &curr->right;
 		}
-	} else if (item < tree->elem){
-		//keeps track of the node that is the next node of the rightest node
-		//in a subtree.
-		s->subTreeNext = tree;
-		tree->left = doMsetInsert(s, tree->left, item, amount);
-		setCursorList(tree, s, true);
-		tree->height = recomputeHeight(tree);
-	} else if (item > tree->elem) {
-		//keeps track of the node that is the next node of the leftest node
-		//in a subtree.
-		s->subTreePrev = tree;
-		tree->right = doMsetInsert(s, tree->right, item, amount);
-		setCursorList(tree, s, false);
-		tree->height = recomputeHeight(tree);
-	} else {
-		//the current node's element is equal to item.
-		tree->count += amount;
 	}
 
-	return avlRebalance(tree);
+	struct node *new = newNode(s, item, amount);
+	*link = new;
+	s->size++;
+	countChanged(s, item, 0, amount);
+	linkNode(s, new, prev, next);
+	rebalancePath(s, path, depth);
 }
 
 /*
 * creates a new node for the tree with the given item and amount.
 */
-static struct node *newNode(int item, int amount) {
-	struct node *new = malloc(sizeof(struct node));
-	if (new == NULL) {
-		printNullError();
+static struct node *newNode(Mset s, int item, int amount) {
+	struct node *new;
+	if (s->pool != NULL) {
+		new = poolAlloc(s->pool);
+	} else {
+		new = malloc(sizeof(struct node));
+		if (new == NULL) {
+			printNullError();
+		}
 	}
 	new->count = amount;
 	new->elem = item;
 	new->left = NULL;
 	new->right = NULL;
 	new->height = 0;
+	new->subTreeSize = 1;
+	new->subTreeCount = amount;
 	new->next = NULL;
 	new->prev = NULL;
+	new->refs = 1;
+	STATS_ADD(s, nodeAllocs, 1);
 	return new;
 }
 
 /*
-* Sets the next pointers and prev pointers of each node in the tree to set up
-* the list for the cursor operations. The operations depend on whether it is the
-* left subtree or the right subtree.
+* Takes a node from the pool, reusing a freed node if there is one and
+* otherwise bumping the position in the newest slab. Slabs double in size up to
+* POOL_MAX_SLAB nodes so small multisets stay small.
 */
-static void setCursorList(struct node *tree, Mset s, bool left) {
-	if (left) {
-		//if the node is the leftest node of the subtree and not when we are
-		//backtracking.
-		if (tree->left->prev == NULL && tree->left != s->subTreePrev) {
-			tree->left->prev = s->subTreePrev;
-			if (s->subTreePrev != NULL) {
-				s->subTreePrev->next = tree->left;
-			}
+static struct node *poolAlloc(struct nodePool *pool) {
+	if (pool->freeList == NULL &&
+		__atomic_load_n(&pool->returned, __ATOMIC_RELAXED) != NULL) {
+		//the nodes returned by snapshots are taken all at once, so that
+		//the free list stays private to the multiset's writer.
+		pool->freeList = __atomic_exchange_n(&pool->returned, NULL,
+		__ATOMIC_ACQUIRE);
+	}
+	if (pool->freeList != NULL) {
+		struct node *node = pool->freeList;
+		pool->freeList = node->left;
+		return node;
+	}
+
+	struct nodeSlab *slab = pool->slabs;
+	if (slab == NULL || slab->used == slab->capacity) {
+		//a block from poolReserve may be smaller than the smallest slab.
+		int capacity = POOL_MIN_SLAB;
+		if (slab != NULL && slab->capacity >= POOL_MAX_SLAB) {
+			capacity = POOL_MAX_SLAB;
+		} else if (slab != NULL && slab->capacity >= POOL_MIN_SLAB) {
+			capacity = slab->capacity * 2;
 		}
 
-		//sets the link between the current node and its left child if the left
-		//child's next value should be the current node's value.
-		if (tree->left->right == NULL) {
-			tree->left->next = tree;
-			tree->prev = tree->left;
+		slab = malloc(sizeof(struct nodeSlab) + capacity * sizeof(struct node));
+		if (slab == NULL) {
+			printNullError();
 		}
+		slab->capacity = capacity;
+		slab->used = 0;
+		slab->next = pool->slabs;
+		pool->slabs = slab;
+	}
+	return &slab->nodes[slab->used++];
+}
+
+/*
+* Frees a node of the multiset's tree, returning it to the pool if the multiset
+* has one.
+*/
+static void freeNode(Mset s, struct node *node) {
+	STATS_ADD(s, nodeFrees, 1);
+	if (s->pool != NULL) {
+		node->left = s->pool->freeList;
+		s->pool->freeList = node;
 	} else {
-		//if the node is the rightest node of the subtree and not when we are
-		//backtracking.
-		if (tree->right->next == NULL && tree->right != s->subTreeNext) {
-			tree->right->next = s->subTreeNext;
-			if (s->subTreeNext != NULL) {
-				s->subTreeNext->prev = tree->right;
-			}
-		}
+		free(node);
+	}
+}
+
+/*
+* Links a new node into the list between prev and next, either of which is NULL
+* when the node is the new start or end of the list. Does nothing if the
+* multiset has no list.
+*/
+static void linkNode(Mset s, struct node *node, struct node *prev,
+struct node *next) {
+	if (s->flags & MSET_NO_LIST) {
+		return;
+	}
+	node->prev = prev;
+	node->next = next;
+
+	if (prev != NULL) {
+		prev->next = node;
+	} else {
+		s->listBegin = node;
+	}
+
+	if (next != NULL) {
+		next->prev = node;
+	} else {
+		s->listEnd = node;
+	}
+}
 
-		//sets the link between the current node and its right child if the right
-		//child's next value should be the current node's value.
-		if (tree->right->left == NULL) {
-			tree->next = tree->right;
-			tree->right->prev = tree;
+/*
+* Recomputes the heights, sizes and counts of the subtrees on a path of links
+* from the root, starting at the deepest one, and rebalances them. Once a
+* subtree ends up with the same height as before nothing above it can need
+* rebalancing, so only the sizes and counts are updated from there on.
+*/
+static void rebalancePath(Mset s, struct node **path[], int depth) {
+	bool balanced = false;
+	while (depth > 0) {
+		struct node **link = path[--depth];
+		if (balanced) {
+			updateTotals(*link);
+			continue;
 		}
+
+		int oldHeight = (*link)->height;
+		updateNode(*link);
+		ownRotated(s, *link);
+		STATS_ROTATION(s, *link);
+		*link = avlRebalance(*link);
+		balanced = (*link)->height == oldHeight;
+	}
+}
+
+/*
+* Recomputes the height of a node and the number of distinct elements and the
+* total count of its subtree from its children.
+*/
+static void updateNode(struct node *tree) {
+	tree->height = recomputeHeight(tree);
+	updateTotals(tree);
+}
+
+/*
+* Recomputes the number of distinct elements and the total count of the subtree
+* of a node from its children.
+*/
+static void updateTotals(struct node *tree) {
+	tree->subTreeSize = treeSize(tree->left) + treeSize(tree->right) + 1;
+	tree->subTreeCount = treeCount(tree->left) + treeCount(tree->right) +
+	tree->count;
+}
+
+/*
+* Returns the number of distinct elements in a subtree.
+*/
+static int treeSize(struct node *tree) {
+	if (tree == NULL) {
+		return 0;
+	}
+	return tree->subTreeSize;
+}
+
+/*
+* Returns the sum of the counts of a subtree.
+*/
+static int treeCount(struct node *tree) {
+	if (tree == NULL) {
+		return 0;
 	}
+	return tree->subTreeCount;
 }
 
 /*
@@ -362,8 +1048,8 @@ static struct node *rotateRight(struct node *tree) {
 	struct node *newRoot = tree->left;
 	tree->left = newRoot->right;
 	newRoot->right = tree;
-	tree->height = recomputeHeight(tree);
-	newRoot->height = recomputeHeight(newRoot);
+	updateNode(tree);
+	updateNode(newRoot);
 
 	return newRoot;
 }
@@ -382,8 +1068,8 @@ static struct node *rotateLeft(struct node *tree) {
 	struct node *newRoot = tree->right;
 	tree->right = newRoot->left;
 	newRoot->left = tree;
-	tree->height = recomputeHeight(tree);
-	newRoot->height = recomputeHeight(newRoot);
+	updateNode(tree);
+	updateNode(newRoot);
 
 	return newRoot;
 }
@@ -393,549 +1079,6746 @@ static struct node *rotateLeft(struct node *tree) {
  * if the item is equal to UNDEFINED or the given amount is 0 or less.
  */
 void MsetInsertMany(Mset s, int item, int amount) {
-	if (item != UNDEFINED && amount > 0) {
-		s->tree = doMsetInsert(s, s->tree, item, amount);
-		s->subTreeNext = NULL;
-		s->subTreePrev = NULL;
-		s->totalCount += amount;
+	STATS_START(start);
+	if (s->combiner != NULL) {
+		if (item != UNDEFINED && amount > 0) {
+			combineInsert(s, item, amount);
+		}
+	} else if (s->kind == KIND_SHARDED) {
+		MsetInsertMany(shardFor(s, item), item, amount);
+	} else if (item != UNDEFINED && amount > 0 && !readOnly(s)) {
+		writeLock(s);
+		doMsetInsertMany(s, item, amount);
+		STATS_HEIGHT(s);
+		writeUnlock(s);
 	}
-}
-
-/**
- * Deletes one of an item from the multiset.
- */
-void MsetDelete(Mset s, int item) {
-	s->tree = doMsetDelete(s, s->tree, item, 1);
+	STATS_ADD(s, inserts, 1);
+	STATS_CALL(s, MSET_CALL_INSERT, start);
 }
 
 /*
-* Deletes an item from the tree.
-* The following code was adapted from the comp2521 2024T3 avl slides.
-* Link: https://cgi.cse.unsw.edu.au/~cs2521/24T3/lectures/Week4Mon-avl.pdf
-* It recursively traverses through the tree until we are at the node with the
-* item, then deletes it or subtracts the given amount and rebalances the tree.
+* Inserts a positive amount of an item other than UNDEFINED into the multiset,
+* whatever its representation.
 */
-static struct node *doMsetDelete(Mset s, struct node *tree, int item,
-int amount) {
-	if (tree == NULL) {
-		return NULL;
+static void doMsetInsertMany(Mset s, int item, int amount) {
+	if (s->kind == KIND_DENSE && !denseContains(s->dense, item)) {
+		denseToTree(s);
+	} else if (s->kind == KIND_COMPACT && s->size == COMPACT_MAX_SIZE) {
+		compactToTree(s);
 	}
 
-	if (item < tree->elem){
-		tree->left = doMsetDelete(s, tree->left, item, amount);
-		tree->height = recomputeHeight(tree);
-	} else if (item > tree->elem) {
-		tree->right = doMsetDelete(s, tree->right, item, amount);
-		tree->height = recomputeHeight(tree);
+	if (s->kind == KIND_BTREE) {
+		btreeInsert(s, item, amount);
+	} else if (s->kind == KIND_DENSE) {
+		denseInsert(s, item, amount);
+	} else if (s->kind == KIND_COMPACT) {
+		compactInsert(s, item, amount);
 	} else {
-		//the current node's element is equal to item
-		tree->count -= amount;
-		s->totalCount -= amount;
+		doMsetInsert(s, item, amount);
+	}
+	s->totalCount += amount;
+}
 
-		if (tree->count <= 0) {
-			s->size--;
-			s->totalCount -= tree->count;
+/**
+ * Inserts amounts[i] of items[i] into the multiset for each i from 0 to
+ * n - 1, or one of each item if amounts is NULL. Items equal to
+ * UNDEFINED and amounts of 0 or less are skipped.
+ */
+void MsetInsertBatch(Mset s, const int *items, const int *amounts, size_t n) {
+	if (n == 0) {
+		return;
+	}
+	STATS_START(start);
 
-			if (tree == s->listBegin) {
-				s->listBegin = s->listBegin->next;
-			}
-			if (tree == s->listEnd) {
-				s->listEnd = s->listEnd->prev;
-			}
+	struct item *batch = malloc(n * sizeof(struct item));
+	if (batch == NULL) {
+		printNullError();
+	}
 
-			updateLink(tree);
-			struct node *left = tree->left;
-			struct node *right = tree->right;
-			free(tree);
-			tree = bstJoin(left, right);
+	int size = 0;
+	for (size_t i = 0; i < n; i++) {
+		int amount = amounts != NULL ? amounts[i] : 1;
+		if (items[i] != UNDEFINED && amount > 0) {
+			batch[size++] = (struct item){items[i], amount};
 		}
 	}
-	return avlRebalance(tree);
+	insertItems(s, batch, size);
+	free(batch);
+	STATS_ADD(s, inserts, n);
+	STATS_CALL(s, MSET_CALL_INSERT, start);
 }
 
 /*
-* Updates the next and prev pointers of the next and previous nodes of the 
-* current node that is being deleted.
+* Inserts a batch of items with a count greater than 0 into the multiset,
+* taking the locks it needs.
 */
-static void updateLink(struct node *tree) {
-	if (tree->next != NULL) {
-		tree->next->prev = tree->prev;
-	}
-	if (tree->prev != NULL) {
-		tree->prev->next = tree->next;
+static void insertItems(Mset s, struct item *batch, int n) {
+	if (s->kind == KIND_SHARDED) {
+		shardsInsertItems(s, batch, n);
+	} else if (!readOnly(s)) {
+		writeLock(s);
+		doMsetInsertItems(s, batch, n);
+		STATS_HEIGHT(s);
+		writeUnlock(s);
 	}
 }
 
-/*
-* The following code was adapted from the comp2521 2024T3 bst slides.
-* Link: https://cgi.cse.unsw.edu.au/~cs2521/24T3/lectures/Week3Mon-bst.pdf
-* Joins two trees into one tree.
-*/
-static struct node *bstJoin(struct node *left, struct node *right) {
-	if (left == NULL) {
-		return right;
-	}
-	if (right == NULL) {
-		return left;
+/**
+ * Turns on write combining for the multiset, for streams of inserts
+ * that repeat the same elements often. Each thread's inserts are added
+ * up per element in a small buffer of its own, and once threshold
+ * distinct elements are buffered they are inserted as one sorted batch,
+ * taking the multiset's lock once. The threshold should be about the
+ * number of distinct elements that are inserted often. If flushOnRead
+ * is true, every read and every new cursor flushes the buffers first;
+ * otherwise reads are eventually consistent and only see buffered
+ * inserts once MsetFlush is called or the buffer fills up. Deletes
+ * always flush first. A threshold of 0 or less turns write combining
+ * off after flushing. Must not be called while other threads are using
+ * the multiset. If the multiset is neither MSET_CONCURRENT nor sharded,
+ * the batches of different threads are inserted one at a time, but the
+ * multiset must still not be read while other threads insert into it.
+ */
+void MsetSetWriteCombining(Mset s, int threshold, bool flushOnRead) {
+	if (readOnly(s)) {
+		return;
 	}
-	struct node *curr = right;
-	struct node *parent = NULL;
-
-	while (curr->left != NULL) {
-		//finds leftmost node
-		parent = curr;
-		curr = curr->left;
+	if (s->combiner != NULL) {
+		MsetFlush(s);
+		combinerFree(s->combiner);
+		s->combiner = NULL;
 	}
-
-	if (parent != NULL) {
-		//joins left subtree to right subtree
-		parent->left = curr->right;
-		curr->right = right;
+	if (threshold > 0) {
+		s->combiner = combinerNew(threshold, flushOnRead);
 	}
-
-	curr->left = left;
-	return curr;
-}
-
-/**
- * Deletes the given amount of an item from the multiset.
- */
-void MsetDeleteMany(Mset s, int item, int amount) {
-	s->tree = doMsetDelete(s, s->tree, item, amount);
 }
 
 /**
- * Returns the number of distinct elements in the multiset.
+ * Inserts the buffered inserts of every thread into the multiset. Does
+ * nothing if write combining is off.
  */
-int MsetSize(Mset s) {
-	return s->size;
-}
+void MsetFlush(Mset s) {
+	if (s->combiner == NULL) {
+		return;
+	}
 
-/**
- * Returns the sum of counts of all elements in the multiset.
- */
-int MsetTotalCount(Mset s) {
-	return s->totalCount;
+	pthread_mutex_lock(&s->combiner->lock);
+	for (struct combineBuffer *buffer = s->combiner->buffers; buffer != NULL;
+		buffer = buffer->next) {
+		pthread_mutex_lock(&buffer->lock);
+		combineFlushBuffer(s, buffer);
+		pthread_mutex_unlock(&buffer->lock);
+	}
+	pthread_mutex_unlock(&s->combiner->lock);
 }
 
-/**
- * Returns the count of an item in the multiset, or 0 if it doesn't
- * occur in the multiset.
- */
-int MsetGetCount(Mset s, int item) {
-	struct node *node = bstFind(s->tree, item);
+/*
+* Inserts a batch of valid items in any order into the multiset, sorting and
+* collapsing the batch in place first.
+*/
+static void doMsetInsertItems(Mset s, struct item *batch, int n) {
+	qsort(batch, n, sizeof(struct item), compareElems);
+	n = collapseBatch(batch, n);
+	if (s->kind == KIND_COMPACT && n > COMPACT_MAX_SIZE - s->size) {
+		compactToTree(s);
+	}
 
-	if (node != NULL) {
-		return node->count;
+	//a few items are cheaper to insert one by one than to walk the whole
+	//list, and inserting them in order keeps the descents in cache. Inserts
+	//into a dense multiset take O(1) time anyway.
+	if (n < s->size / 16 || s->kind == KIND_DENSE) {
+		for (int i = 0; i < n; i++) {
+			doMsetInsertMany(s, batch[i].elem, batch[i].count);
+		}
+	} else if (s->kind == KIND_BTREE) {
+		btreeInsertBatch(s, batch, n);
+	} else if (s->kind == KIND_COMPACT) {
+		compactInsertBatch(s, batch, n);
+	} else {
+		doMsetInsertBatch(s, batch, n);
 	}
-	return 0;
 }
 
 /*
-* Finds the given item if it exists in the tree. If not, return NULL.
+* Adds up the amounts of equal elements in a sorted batch so that every element
+* appears once, and returns the new size of the batch.
 */
-static struct node *bstFind(struct node *tree, int item) {
-	if (tree == NULL) {
-		return NULL;
-	}
-	if (item < tree->elem) {
-		return bstFind(tree->left, item);
-	} else if (item > tree->elem) {
-		return bstFind(tree->right, item);
+static int collapseBatch(struct item *batch, int n) {
+	int size = 0;
+	for (int i = 0; i < n; i++) {
+		if (size > 0 && batch[size - 1].elem == batch[i].elem) {
+			batch[size - 1].count += batch[i].count;
+		} else {
+			batch[size++] = batch[i];
+		}
 	}
-	//the current node's value is equal to item
-	return tree;
+	return size;
 }
 
-/**
- * Prints the multiset to a file.
- * The elements of the multiset should be printed in ascending order
- * inside a pair of curly braces, with elements separated by a comma
- * and space. Each element should be printed inside a pair of
- * parentheses with its count, separated by a comma and space.
- */
-void MsetPrint(Mset s, FILE *file) {
-	fprintf(file,"{");
-	int size = MsetSize(s);
-	doMsetPrint(s->tree, file, &size);
-	fprintf(file,"}");
-	
+/*
+* Orders items by increasing element for qsort.
+*/
+static int compareElems(const void *a, const void *b) {
+	int elem1 = ((const struct item *)a)->elem;
+	int elem2 = ((const struct item *)b)->elem;
+	return (elem1 > elem2) - (elem1 < elem2);
 }
 
 /*
-* Prints the bst in the multiset to a file.
+* Merges a sorted batch of distinct items into the multiset in one pass over
+* its list. Existing nodes are kept and relinked in order together with the new
+* nodes, then the tree is rebuilt from the merged list, so the whole batch takes
+* O(size + n) time and no rotations.
 */
-static void doMsetPrint(struct node *tree, FILE *file, int *size) {
-	if (tree == NULL) {
-		return;
+static void doMsetInsertBatch(Mset s, struct item *batch, int n) {
+	//every node of the list is linked into a new tree.
+	if (s->shared) {
+		ownTree(s, &s->tree);
 	}
+	if (s->flags & MSET_NO_LIST) {
+		threadList(s);
+	}
+
+	struct node head = {.next = NULL};
+	struct node *tail = &head;
+	struct node *curr = s->listBegin;
+	int i = 0;
 
-	doMsetPrint(tree->left, file, size);
-	fprintf(file, "(%d, %d)", tree->elem, tree->count);
-	*size-=1;
+	while (curr != NULL || i < n) {
+		struct node *node;
+		if (i < n && (curr == NULL || batch[i].elem < curr->elem)) {
+			node = newNode(s, batch[i].elem, batch[i].count);
+			s->size++;
+			countChanged(s, node->elem, 0, node->count);
+			i++;
+		} else {
+			node = curr;
+			curr = curr->next;
+			if (i < n && batch[i].elem == node->elem) {
+				countChanged(s, node->elem, node->count,
+				node->count + batch[i].count);
+				node->count += batch[i].count;
+				i++;
+			}
+		}
 
-	if (*size > 0) {
-		fprintf(file, ", ");
+		node->prev = tail;
+		tail->next = node;
+		tail = node;
 	}
+	tail->next = NULL;
 
-	doMsetPrint(tree->right, file, size);
+	for (i = 0; i < n; i++) {
+		s->totalCount += batch[i].count;
+	}
+	finishList(s, head.next, tail);
 }
 
-
-////////////////////////////////////////////////////////////////////////
-// Advanced Operations
-
 /**
- * Returns a new multiset representing the union of the two given
- * multisets.
+ * Deletes one of an item from the multiset.
  */
-Mset MsetUnion(Mset s1, Mset s2) {
-	Mset setUnion = MsetNew();
-	if (s1->size == 0) {
-		doMsetUnion(setUnion, setUnion->tree, s2->tree);
-		return setUnion;
+void MsetDelete(Mset s, int item) {
+	MsetDeleteMany(s, item, 1);
+}
+
+/*
+* Deletes an item from the tree.
+* The following code was adapted from the comp2521 2024T3 avl slides.
+* Link: https://cgi.cse.unsw.edu.au/~cs2521/24T3/lectures/Week4Mon-avl.pdf
+* It walks down the tree to the node with the item, remembering the links it
+* followed, then subtracts the given amount or removes the node. A node with two
+* children is replaced by its successor, the leftmost node of its right subtree,
+* and the path down to the successor's old position is rebalanced bottom-up.
+*/
+static void doMsetDelete(Mset s, int item, int amount) {
+	//the path is copied on the way down, which a missing item must not do.
+	if (s->shared && bstFind(s->tree, item) == NULL) {
+		return;
 	}
 
-	//sets the union set with s1's tree.
-	doMsetUnion(setUnion, setUnion->tree, s1->tree);
-	if (s2->size == 0) {
-		return setUnion;
+	struct node **path[MAX_HEIGHT];
+	int depth = 0;
+	struct node **link = &s->tree;
+
+	while (ownLink(s, link) != NULL && (*link)->elem != item) {
+		path[depth++] = link;
+		if (item < (*link)->elem) {
+			link = &(*link)->left;
+		} else {
+			link = &(*link)->right;
+		}
 	}
-	doMsetUnion(setUnion, setUnion->tree, s2->tree);
 
-	return setUnion;
+	struct node *tree = *link;
+	if (tree == NULL) {
+		return;
+	}
+
+	if (tree->count > amount) {
+		countChanged(s, item, tree->count, tree->count - amount);
+		tree->count -= amount;
+		s->totalCount -= amount;
+		path[depth++] = link;
+		rebalancePath(s, path, depth);
+		return;
+	}
+
+	countChanged(s, item, tree->count, 0);
+	s->totalCount -= tree->count;
+	s->size--;
+	unlinkNode(s, tree);
+	depth = detachNode(s, path, depth, link);
+	freeNode(s, tree);
+	rebalancePath(s, path, depth);
+}
+
+/*
+* Takes the node at *link out of the tree, where path holds the depth links
+* above it. A node with two children is replaced by its successor, the leftmost
+* node of its right subtree, so the path is extended down to the successor's old
+* position. Returns the depth of the path that needs to be rebalanced.
+*/
+static int detachNode(Mset s, struct node **path[], int depth,
+struct node **link) {
+	struct node *tree = *link;
+	if (tree->left == NULL) {
+		*link = tree->right;
+		return depth;
+	} else if (tree->right == NULL) {
+		*link = tree->left;
+		return depth;
+	}
+
+	//the successor's old position is below the removed node's position,
+	//which will hold the successor itself.
+	path[depth++] = link;
+	int succDepth = depth;
+	struct node **succLink = &tree->right;
+	while (ownLink(s, succLink)->left != NULL) {
+		path[depth++] = succLink;
+		succLink = &(*succLink)->left;
+	}
+
+	struct node *succ = *succLink;
+	*succLink = succ->right;
+	succ->left = tree->left;
+	succ->right = tree->right;
+	succ->height = tree->height;
+	*link = succ;
+
+	//the first link below the removed node was its right field.
+	if (depth > succDepth) {
+		path[succDepth] = &succ->right;
+	}
+	return depth;
 }
 
 /*
-* Add the elements in t2 bst that are not in setUnion and updates the count if 
-* the element exists in setUnion.
+* Removes a node that is being deleted from the list, updating the start and end
+* of the list if needed. Does nothing if the multiset has no list.
 */
-static void doMsetUnion(Mset setUnion, struct node *t1, struct node *t2) {
-	if (t2 == NULL) {
+static void unlinkNode(Mset s, struct node *node) {
+	if (s->flags & MSET_NO_LIST) {
 		return;
 	}
-	//if t2's element is found in t1, returns the element, NULL otherwise.
-	struct node *foundElement = bstFind(t1, t2->elem);
-	if (foundElement != NULL) {
-		if (foundElement->count < t2->count) {
-			//Sets the element in the union multiset to have the highest count
-			//out of the two.
-			setUnion->totalCount += (t2->count - foundElement->count);
-			foundElement->count = t2->count;
-		}
+	if (node->next != NULL) {
+		node->next->prev = node->prev;
+	} else {
+		s->listEnd = node->prev;
+	}
+
+	if (node->prev != NULL) {
+		node->prev->next = node->next;
 	} else {
-		MsetInsertMany(setUnion, t2->elem, t2->count);
+		s->listBegin = node->next;
 	}
-	
-	doMsetUnion(setUnion, t1, t2->left);
-	doMsetUnion(setUnion, t1, t2->right);
 }
 
 /**
- * Returns a new multiset representing the intersection of the two
- * given multisets.
+ * Deletes the given amount of an item from the multiset.
  */
-Mset MsetIntersection(Mset s1, Mset s2) {
-	Mset setIntersection = MsetNew();
-	if (s1->size == 0 || s2->size == 0) {
-		return setIntersection;
-	}
-	// this ensures that the first argument is the tree of the smaller multiset.
-	if (s1->size >= s2->size) {
-		doMsetIntersection(setIntersection, s2->tree, s1->tree);
-	} else {
-		doMsetIntersection(setIntersection, s1->tree, s2->tree);
+void MsetDeleteMany(Mset s, int item, int amount) {
+	STATS_START(start);
+	//buffered inserts of the item have to be made before it is deleted.
+	MsetFlush(s);
+	if (s->kind == KIND_SHARDED) {
+		MsetDeleteMany(shardFor(s, item), item, amount);
+	} else if (amount > 0 && !readOnly(s)) {
+		writeLock(s);
+		doMsetDeleteMany(s, item, amount);
+		writeUnlock(s);
 	}
-	return setIntersection;
+	STATS_ADD(s, deletes, 1);
+	STATS_CALL(s, MSET_CALL_DELETE, start);
 }
 
 /*
-* Checks if the nodes in t1(smaller tree) exist in t2, if it exists, add to the 
-* intersection multiset.
+* Deletes a positive amount of an item from the multiset, whatever its
+* representation.
 */
-static void doMsetIntersection(Mset setIntersection, struct node *t1, 
-struct node *t2) {
-	if (t1 == NULL) {
-		return;
+static void doMsetDeleteMany(Mset s, int item, int amount) {
+	if (s->kind == KIND_BTREE) {
+		btreeDelete(s, item, amount);
+	} else if (s->kind == KIND_DENSE) {
+		denseDelete(s, item, amount);
+	} else if (s->kind == KIND_COMPACT) {
+		compactDelete(s, item, amount);
+	} else {
+		doMsetDelete(s, item, amount);
 	}
+}
 
-	struct node *foundElement = bstFind(t2, t1->elem);
-	if (foundElement != NULL) {
-		//Ensuring that we are inserting into the union multiset with the lowest
-		//count.
-		if (t1->count < foundElement->count) {
-			MsetInsertMany(setIntersection, t1->elem, t1->count);
-		} else {
-			MsetInsertMany(setIntersection, t1->elem, foundElement->count);
-		}
+/**
+ * Returns the number of distinct elements in the multiset.
+ */
+int MsetSize(Mset s) {
+	combineBeforeRead(s);
+	if (s->kind == KIND_SHARDED) {
+		return shardsTotal(s, false);
+	}
+	if (s->sync != NULL) {
+		return __atomic_load_n(&s->sync->size, __ATOMIC_RELAXED);
 	}
+	return s->size;
+}
 
-	doMsetIntersection(setIntersection, t1->left, t2);
-	doMsetIntersection(setIntersection, t1->right, t2);
+/**
+ * Returns the sum of counts of all elements in the multiset.
+ */
+int MsetTotalCount(Mset s) {
+	combineBeforeRead(s);
+	if (s->kind == KIND_SHARDED) {
+		return shardsTotal(s, true);
+	}
+	if (s->sync != NULL) {
+		return __atomic_load_n(&s->sync->totalCount, __ATOMIC_RELAXED);
+	}
+	return s->totalCount;
 }
 
 /**
- * Returns true if the multiset s1 is included in the multiset s2, and
- * false otherwise.
+ * Returns the count of an item in the multiset, or 0 if it doesn't
+ * occur in the multiset.
  */
-bool MsetIncluded(Mset s1, Mset s2) {
-	if (s1->size > s2->size) {
-		return false;
+int MsetGetCount(Mset s, int item) {
+	STATS_START(start);
+	combineBeforeRead(s);
+	int count;
+	if (s->kind == KIND_SHARDED) {
+		count = MsetGetCount(shardFor(s, item), item);
+	} else {
+		readLock(s);
+		count = doMsetGetCount(s, item);
+		readUnlock(s);
 	}
-	
-	return doMsetIncluded(s1->tree, s2->tree);
+	STATS_CALL(s, MSET_CALL_GET_COUNT, start);
+	return count;
 }
 
 /*
-* Checks if the tree t2 includes the tree t1.
+* Returns the count of an item in the multiset, whatever its representation.
 */
-static bool doMsetIncluded(struct node *t1, struct node *t2) {
-	//the empty set is always a subset of the other set.
-	if (t1 == NULL) {
-		return true;
+static int doMsetGetCount(Mset s, int item) {
+	if (s->lookup != NULL && lookupReady(s)) {
+		return lookupSearch(s->lookup, item);
+	}
+	if (s->kind == KIND_BTREE) {
+		return btreeGetCount(s->btree, item);
+	}
+	if (s->kind == KIND_DENSE) {
+		if (!denseContains(s->dense, item)) {
+			return 0;
+		}
+		return s->dense->counts[item - s->dense->lo];
+	}
+	if (s->kind == KIND_MAPPED) {
+		return mappedGetCount(s->mapped, item);
+	}
+	if (s->kind == KIND_COMPACT) {
+		return compactGetCount(s, item);
 	}
 
-	struct node *foundElement = bstFind(t2, t1->elem);
-	if (foundElement != NULL) {
-		if (t1->count <= foundElement->count) {
-			//recursively checks that every element of t1 is in t2.
-			return true && doMsetIncluded(t1->left, t2) && 
-			doMsetIncluded(t1->right, t2);
+	//the same walk as bstFind, which also counts the nodes it passes.
+	struct node *node = s->tree;
+	int depth = 0;
+	while (node != NULL && node->elem != item) {
+		node = item < node->elem ? node->left : node->right;
+		depth++;
+	}
+	STATS_ADD(s, lookups, 1);
+	STATS_ADD(s, lookupDepth, depth);
+
+	if (node != NULL) {
+		return node->count;
+	}
+	return 0;
+}
+
+/*
+* Finds the given item if it exists in the tree. If not, return NULL.
+*/
+static struct node *bstFind(struct node *tree, int item) {
+	while (tree != NULL && tree->elem != item) {
+		if (item < tree->elem) {
+			tree = tree->left;
+		} else {
+			tree = tree->right;
 		}
 	}
-	return false;
+	return tree;
 }
 
-/**
- * Returns true if the two given multisets are equal, and false
- * otherwise.
- */
-bool MsetEquals(Mset s1, Mset s2) {
-	if ((s1->size != s2->size) || (s1->totalCount != s2->totalCount)) {
-		return false;
+/*
+* Updates the parts of the multiset that depend on the counts of its elements
+* when the count of an item changes, where a count of 0 means the item is not in
+* the multiset. size and totalCount are kept by the callers.
+*/
+static void countChanged(Mset s, int item, int oldCount, int newCount) {
+	updateHash(s, item, oldCount, newCount);
+	if (s->flags & MSET_COUNT_INDEX) {
+		countIndexUpdate(s, item, oldCount, newCount);
+	}
+	if (s->lookup != NULL) {
+		s->lookup->valid = false;
+		s->lookup->pending = 0;
 	}
+}
+
+/*
+* Keeps the content hash of the multiset up to date when the count of an item
+* changes, where a count of 0 means the item is not in the multiset. The hash is
+* the sum of the hashes of every (element, count) pair, so it does not depend on
+* the shape of the tree and two equal multisets always have the same hash.
+*/
+static void updateHash(Mset s, int item, int oldCount, int newCount) {
+	if (oldCount > 0) {
+		s->hash -= itemHash(item, oldCount);
+	}
+	if (newCount > 0) {
+		s->hash += itemHash(item, newCount);
+	}
+}
 
-	//The sets are only equal if and only if they both include each other.
-	return doMsetIncluded(s1->tree, s2->tree) && 
-	doMsetIncluded(s2->tree, s1->tree);
+/*
+* Mixes an element and its count into a well distributed 64-bit value
+* (the splitmix64 finaliser).
+*/
+static uint64_t itemHash(int item, int count) {
+	uint64_t x = ((uint64_t)(uint32_t)item << 32) | (uint32_t)count;
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
 }
 
 /**
- * Stores the k most common elements in the multiset into the given
- * items array in decreasing order of count and returns the number of
- * elements stored. Elements with the same count should be stored in
- * increasing order. Assumes that the items array has size k.
+ * Prints the multiset to a file.
+ * The elements of the multiset should be printed in ascending order
+ * inside a pair of curly braces, with elements separated by a comma
+ * and space. Each element should be printed inside a pair of
+ * parentheses with its count, separated by a comma and space.
  */
-int MsetMostCommon(Mset s, int k, struct item items[]) {
-	if (k <= 0 || s->size == 0) {
-		return 0;
+void MsetPrint(Mset s, FILE *file) {
+	combineBeforeRead(s);
+	if (s->kind == KIND_SHARDED) {
+		Mset flat = shardsFlatten(s);
+		MsetPrint(flat, file);
+		MsetFree(flat);
+		return;
 	}
 
-	struct item *elements = malloc(sizeof(struct item) * s->size);
-	if (elements == NULL) {
-		printNullError();
-	}
-	int index = 0;
-	//copies the elements of the current tree into an array.
-	copyArray(s->tree, elements, &index);
-	mergeSort(elements, 0, s->size - 1);
+	struct cursor cur;
+	struct node *path[MAX_HEIGHT];
+	cursorInit(&cur, s, path);
 
-	int i = 0;
-	while (i < k && i < s->size) {
-		items[i] = elements[i];
-		i++;
+	readLock(s);
+	fprintf(file,"{");
+	bool first = true;
+	while (cursorNext(&cur)) {
+		struct item item = cursorGet(&cur);
+		if (!first) {
+			fprintf(file, ", ");
+		}
+		fprintf(file, "(%d, %d)", item.elem, item.count);
+		first = false;
 	}
-	free(elements);
-	return i;
+	fprintf(file,"}");
+	readUnlock(s);
 }
 
+
+////////////////////////////////////////////////////////////////////////
+// Advanced Operations
+
 /*
-* Copies the count and element of all the nodes of the tree into the given 
-* array.
+* The ways two counts of the same element can be combined by doMsetMerge.
 */
-static void copyArray(struct node *tree, struct item *elements, int *index) {
-	if (tree == NULL) {
-		return;
-	}
+enum mergeOp {
+	MERGE_UNION,
+	MERGE_INTERSECTION,
+	MERGE_SUM,
+	MERGE_DIFFERENCE,
+	MERGE_SYMMETRIC_DIFFERENCE,
+};
 
-	copyArray(tree->left, elements, index);
-	struct item newItem = {tree->elem, tree->count};
-	elements[*index] = newItem;
-	(*index)++;
-	copyArray(tree->right, elements, index);
+/**
+ * Returns a new multiset representing the union of the two given
+ * multisets.
+ */
+Mset MsetUnion(Mset s1, Mset s2) {
+	STATS_START(start);
+	combineBeforeRead(s1);
+	combineBeforeRead(s2);
+	Mset setUnion;
+	if (s1->kind == KIND_SHARDED || s2->kind == KIND_SHARDED) {
+		setUnion = shardsSetOp(s1, s2, MsetUnion);
+	} else {
+		readLockPair(s1, s2);
+		setUnion = doMsetCombine(s1, s2, MERGE_UNION);
+		readUnlockPair(s1, s2);
+	}
+	STATS_CALL(s1, MSET_CALL_SET_OP, start);
+	return setUnion;
 }
 
 /*
-* Sorts the array using mergeSort.
-* The following code was adapted from the comp2521 2024T3 divide-and-conquer-
-* sorts slides.
-* Link: https://cgi.cse.unsw.edu.au/~cs2521/24T3/lectures/Week2Wed-divide-and-conquer-sorts.pdf
-* It uses the mergeSort algorithm to sort the given array in descending order.
+* Returns the combination of two multisets that are locked for reading under a
+* merge operation other than intersection, which has its own shortcuts.
 */
-static void mergeSort(struct item *elements, int lo, int hi) {
-	if (lo >= hi) {
-		return;
+static Mset doMsetCombine(Mset s1, Mset s2, int op) {
+	if (denseMatch(s1, s2)) {
+		Mset result = MsetNewDense(s1->dense->lo, s1->dense->hi);
+		denseMerge(result, s1, s2, op);
+		return result;
 	}
 
-	int mid = (lo + hi) / 2;
-	mergeSort(elements, lo, mid);
-	mergeSort(elements, mid+1, hi);
-	merge(elements, lo, mid, hi);
+	Mset result = MsetNewWithFlags(s1->flags);
+	if (joinApplies(s1, s2)) {
+		joinMergeSets(result, s1, s2, op);
+	} else {
+		doMsetMerge(result, s1, s2, op);
+	}
+	if (result->sync != NULL) {
+		syncPublish(result);
+	}
+	return result;
+}
+
+/**
+ * Returns a new multiset representing the intersection of the two
+ * given multisets.
+ */
+Mset MsetIntersection(Mset s1, Mset s2) {
+	STATS_START(start);
+	combineBeforeRead(s1);
+	combineBeforeRead(s2);
+	Mset setIntersection;
+	if (s1->kind == KIND_SHARDED || s2->kind == KIND_SHARDED) {
+		setIntersection = shardsSetOp(s1, s2, MsetIntersection);
+	} else {
+		readLockPair(s1, s2);
+		setIntersection = doMsetIntersection(s1, s2);
+		readUnlockPair(s1, s2);
+	}
+	STATS_CALL(s1, MSET_CALL_SET_OP, start);
+	return setIntersection;
 }
 
 /*
-* Merges the arrays.
-* The following code was adapted from the comp2521 2024T3 divide-and-conquer-
-* sorts slides.
-* Link: https://cgi.cse.unsw.edu.au/~cs2521/24T3/lectures/Week2Wed-divide-and-conquer-sorts.pdf
-* It uses the mergeSort algorithm to sort the given array.
+* Returns the intersection of two multisets that are locked for reading.
 */
-static void merge(struct item *elements, int lo, int mid, int hi) {
-	struct item *tmp = malloc((hi - lo + 1) * sizeof(struct item));
-	if (tmp == NULL) {
-		printNullError();
+static Mset doMsetIntersection(Mset s1, Mset s2) {
+	if (denseMatch(s1, s2)) {
+		Mset setIntersection = MsetNewDense(s1->dense->lo, s1->dense->hi);
+		denseMerge(setIntersection, s1, s2, MERGE_INTERSECTION);
+		return setIntersection;
 	}
-	int i = lo, j = mid + 1, k = 0;
 
-	while (i <= mid && j <= hi) {
-		if (elements[i].count > elements[j].count) {
-			tmp[k++] = elements[i++];
-		} else if (elements[i].count < elements[j].count){
-			tmp[k++] = elements[j++];
-		} else {
-			//if the counts of the two elements are the same, sort according to
-			//their element values in ascending order.
-			if (elements[i].elem < elements[j].elem) {
-				tmp[k++] = elements[i++];
-			} else {
-				tmp[k++] = elements[j++];
-			}
-		}
+	Mset setIntersection = MsetNewWithFlags(s1->flags);
+	if (s1->size == 0 || s2->size == 0) {
+		return setIntersection;
 	}
 
-	//copies the rest of the uncopied values into the tmp array.
-	while (i <= mid) {
-		tmp[k++] = elements[i++];
+	// when one multiset is much smaller than the other, looking up each of its
+	// elements in the bigger tree is cheaper than walking the bigger list.
+	if (s1->size <= s2->size / 32) {
+		doMsetIntersectionProbe(setIntersection, s1, s2);
+	} else if (s2->size <= s1->size / 32) {
+		doMsetIntersectionProbe(setIntersection, s2, s1);
+	} else if (joinApplies(s1, s2)) {
+		joinMergeSets(setIntersection, s1, s2, MERGE_INTERSECTION);
+	} else {
+		doMsetMerge(setIntersection, s1, s2, MERGE_INTERSECTION);
 	}
-	while (j <= hi) {
-		tmp[k++] = elements[j++];
+	if (setIntersection->sync != NULL) {
+		syncPublish(setIntersection);
 	}
+	return setIntersection;
+}
 
-	for (int i = lo, k = 0; i <= hi; i++, k++) {
-		elements[i] = tmp[k];
+/**
+ * Returns a new multiset representing the sum of the two given
+ * multisets, in which the count of each element is the sum of its
+ * counts in the two multisets.
+ */
+Mset MsetSum(Mset s1, Mset s2) {
+	STATS_START(start);
+	combineBeforeRead(s1);
+	combineBeforeRead(s2);
+	Mset setSum;
+	if (s1->kind == KIND_SHARDED || s2->kind == KIND_SHARDED) {
+		setSum = shardsSetOp(s1, s2, MsetSum);
+	} else {
+		readLockPair(s1, s2);
+		setSum = doMsetCombine(s1, s2, MERGE_SUM);
+		readUnlockPair(s1, s2);
 	}
-	free(tmp);
+	STATS_CALL(s1, MSET_CALL_SET_OP, start);
+	return setSum;
 }
 
-////////////////////////////////////////////////////////////////////////
-// Cursor Operations
+/**
+ * Returns a new multiset representing the difference of the two given
+ * multisets, in which the count of each element is its count in s1
+ * minus its count in s2. Elements whose count would be 0 or less are
+ * left out.
+ */
+Mset MsetDifference(Mset s1, Mset s2) {
+	STATS_START(start);
+	combineBeforeRead(s1);
+	combineBeforeRead(s2);
+	Mset setDifference;
+	if (s1->kind == KIND_SHARDED || s2->kind == KIND_SHARDED) {
+		setDifference = shardsSetOp(s1, s2, MsetDifference);
+	} else {
+		readLockPair(s1, s2);
+		setDifference = doMsetCombine(s1, s2, MERGE_DIFFERENCE);
+		readUnlockPair(s1, s2);
+	}
+	STATS_CALL(s1, MSET_CALL_SET_OP, start);
+	return setDifference;
+}
 
 /**
- * Creates a new cursor positioned at the start of the multiset.
- * (see spec for explanation of start and end)
+ * Returns a new multiset representing the symmetric difference of the
+ * two given multisets, in which the count of each element is the
+ * absolute difference of its counts in the two multisets.
  */
-MsetCursor MsetCursorNew(Mset s) {
-	MsetCursor new = malloc(sizeof(struct cursor));
-	if (new == NULL) {
-		printNullError();
+Mset MsetSymmetricDifference(Mset s1, Mset s2) {
+	STATS_START(start);
+	combineBeforeRead(s1);
+	combineBeforeRead(s2);
+	Mset setDifference;
+	if (s1->kind == KIND_SHARDED || s2->kind == KIND_SHARDED) {
+		setDifference = shardsSetOp(s1, s2, MsetSymmetricDifference);
+	} else {
+		readLockPair(s1, s2);
+		setDifference = doMsetCombine(s1, s2, MERGE_SYMMETRIC_DIFFERENCE);
+		readUnlockPair(s1, s2);
 	}
-	new->start = newNode(UNDEFINED, 0);
-	new->start->next = s->listBegin;
-	new->end = newNode(UNDEFINED, 0);
-	new->end->prev = s->listEnd;
-	new->curr = new->start;
-	new->right = new->curr->next;
-	new->left = NULL;
-	new->s = s;
-	return new;
+	STATS_CALL(s1, MSET_CALL_SET_OP, start);
+	return setDifference;
 }
 
 /**
- * Frees all memory allocated to the given cursor.
+ * Changes dst into the union of dst and src, without making a new
+ * multiset. An AVL multiset is merged with src in one pass over both
+ * lists, reusing the nodes of the elements it keeps. When src is much
+ * smaller than dst, only the elements of src are looked up and
+ * changed. The same holds for the other functions below, except that
+ * the intersection always walks both. dst and src may be the same
+ * multiset.
  */
-void MsetCursorFree(MsetCursor cur) {
-	free(cur->start);
-	free(cur->end);
-	free(cur);
+void MsetUnionInto(Mset dst, Mset src) {
+	STATS_START(start);
+	mergeInto(dst, src, MERGE_UNION);
+	STATS_CALL(dst, MSET_CALL_SET_OP, start);
 }
 
 /**
- * Returns the element at the cursor's position and its count, or
- * {UNDEFINED, 0} if the cursor is positioned at the start or end of
- * the multiset.
+ * Changes dst into the intersection of dst and src.
  */
-struct item MsetCursorGet(MsetCursor cur) {
-	return (struct item){cur->curr->elem, cur->curr->count};
+void MsetIntersectionInto(Mset dst, Mset src) {
+	STATS_START(start);
+	mergeInto(dst, src, MERGE_INTERSECTION);
+	STATS_CALL(dst, MSET_CALL_SET_OP, start);
 }
 
 /**
- * Moves the cursor to the next greatest element, or to the end of the
- * multiset if there is no next greatest element. Does not move the
- * cursor if it is already at the end. Returns false if the cursor is at
- * the end after this operation, and true otherwise.
+ * Changes dst into the sum of dst and src.
  */
-bool MsetCursorNext(MsetCursor cur) {
-	//the next element in the list is the end.
-	if (cur->curr->next == NULL) {
-		cur->left = cur->s->listEnd;
-		cur->curr = cur->end;
-		cur->curr->prev = cur->left;	
-		cur->right = NULL;
-		return false;
-	}
+void MsetSumInto(Mset dst, Mset src) {
+	STATS_START(start);
+	mergeInto(dst, src, MERGE_SUM);
+	STATS_CALL(dst, MSET_CALL_SET_OP, start);
+}
 
-	if (cur->curr->elem == UNDEFINED) {
-		//cursor is currently at the end.
-		if (cur->curr->prev != NULL) {
-			return false;
-		} else {
-			//cursor is currently at the beginning.
-			cur->left = cur->curr;
-			cur->curr = cur->s->listBegin;
-			cur->right = cur->curr->next;
-			return true;
-		}
-	}
-	//moves the cursor to the next element in the list.
-	cur->left = cur->curr;
-	cur->curr = cur->curr->next;
-	cur->right = cur->curr->next;
-	return true;
+/**
+ * Changes dst into the difference of dst and src.
+ */
+void MsetDifferenceInto(Mset dst, Mset src) {
+	STATS_START(start);
+	mergeInto(dst, src, MERGE_DIFFERENCE);
+	STATS_CALL(dst, MSET_CALL_SET_OP, start);
 }
 
 /**
- * Moves the cursor to the next smallest element, or to the start of the
- * multiset if there is no next smallest element. Does not move the
- * cursor if it is already at the start. Returns false if the cursor is
- * at the start after this operation, and true otherwise.
+ * Changes dst into the symmetric difference of dst and src.
  */
-bool MsetCursorPrev(MsetCursor cur) {
-	//the previous element is the beginning.
-	if (cur->curr->prev == NULL) {
-		cur->right = cur->s->listBegin;
-		cur->curr = cur->start;
-		cur->curr->next = cur->right;
-		cur->left = NULL;
-		return false;
-	}	
-	
-	if (cur->curr->elem == UNDEFINED) {
-		//cursor is currently at the beginning.
-		if (cur->curr->next != NULL) {
-			return false;
-		} else {
-			//cursor is currently at the end.
-			cur->right = cur->curr;
-			cur->curr = cur->s->listEnd;
-			cur->left = cur->curr->prev;
-			return true;
+void MsetSymmetricDifferenceInto(Mset dst, Mset src) {
+	STATS_START(start);
+	mergeInto(dst, src, MERGE_SYMMETRIC_DIFFERENCE);
+	STATS_CALL(dst, MSET_CALL_SET_OP, start);
+}
+
+/*
+* Changes dst into its combination with src under the given merge operation,
+* locking dst for writing and src for reading in order of address.
+*/
+static void mergeInto(Mset dst, Mset src, int op) {
+	//buffered inserts must be in dst before its counts are combined.
+	MsetFlush(dst);
+	combineBeforeRead(src);
+	if (dst->kind == KIND_SHARDED || src->kind == KIND_SHARDED) {
+		shardsMergeInto(dst, src, op);
+		return;
+	}
+	if (readOnly(dst)) {
+		return;
+	}
+
+	if ((uintptr_t)src < (uintptr_t)dst) {
+		readLock(src);
+		writeLock(dst);
+	} else {
+		writeLock(dst);
+		if (src != dst) {
+			readLock(src);
 		}
 	}
-	//moves the cursor to the previous element in the list.
-	cur->right = cur->curr;
-	cur->curr = cur->curr->prev;
-	cur->left = cur->curr->prev;
-	return true;
+	doMsetMergeInto(dst, src, op);
+	if (src != dst) {
+		readUnlock(src);
+	}
+	writeUnlock(dst);
+}
+
+/*
+* Changes dst into its combination with src, where dst is locked for writing
+* and src for reading.
+*/
+static void doMsetMergeInto(Mset dst, Mset src, int op) {
+	//under every operation but intersection the elements only in dst keep
+	//their counts, so when src is much smaller only its elements are
+	//changed, one at a time.
+	bool probe = mergeCount(op, 1, 0) == 1 && src->size < dst->size / 16;
+	if (dst->kind == KIND_AVL && dst != src && !probe) {
+		doMsetMergeList(dst, src, op);
+	} else {
+		doMsetMergeChanges(dst, src, op, probe);
+	}
+}
+
+/*
+* Walks the list of the AVL multiset dst and the elements of src in lockstep,
+* changing the counts of the nodes of dst in place, unlinking the nodes whose
+* count drops to 0 and linking in new nodes for the elements only in src. The
+* tree is then rebuilt from the list, so the whole merge takes
+* O(|dst| + |src|) time.
+*/
+static void doMsetMergeList(Mset dst, Mset src, int op) {
+	if (dst->shared) {
+		ownTree(dst, &dst->tree);
+	}
+	if (dst->flags & MSET_NO_LIST) {
+		threadList(dst);
+	}
+
+	struct node head = {.next = NULL};
+	struct node *tail = &head;
+	struct node *curr = dst->listBegin;
+	struct cursor cur;
+	struct node *path[MAX_HEIGHT];
+	cursorInit(&cur, src, path);
+	bool more = cursorNext(&cur);
+	int size = 0;
+	int totalCount = 0;
+
+	while (curr != NULL || more) {
+		struct item item = cursorGet(&cur);
+		struct node *node;
+		if (curr == NULL || (more && item.elem < curr->elem)) {
+			more = cursorNext(&cur);
+			int count = mergeCount(op, 0, item.count);
+			if (count <= 0) {
+				continue;
+			}
+			node = newNode(dst, item.elem, count);
+			countChanged(dst, item.elem, 0, count);
+		} else {
+			node = curr;
+			curr = curr->next;
+			int count2 = 0;
+			if (more && item.elem == node->elem) {
+				count2 = item.count;
+				more = cursorNext(&cur);
+			}
+
+			int count = mergeCount(op, node->count, count2);
+			if (count != node->count) {
+				countChanged(dst, node->elem, node->count, count);
+			}
+			if (count <= 0) {
+				freeNode(dst, node);
+				continue;
+			}
+			node->count = count;
+		}
+
+		node->prev = tail;
+		tail->next = node;
+		tail = node;
+		size++;
+		totalCount += node->count;
+	}
+	tail->next = NULL;
+
+	dst->size = size;
+	dst->totalCount = totalCount;
+	dst->tree = NULL;
+	dst->listBegin = NULL;
+	dst->listEnd = NULL;
+	finishList(dst, head.next, tail);
+}
+
+/*
+* Changes dst into its combination with src by working out how much the count
+* of each element changes first and then inserting or deleting that amount.
+* This works for every representation, since a B+ tree or dense multiset may
+* move its elements while they are changed, and for dst and src being the same
+* multiset. The two are walked in lockstep in O(|dst| + |src|) time, or if probe
+* is true only the elements of src are looked up in dst, plus the time of the
+* changes.
+*/
+static void doMsetMergeChanges(Mset dst, Mset src, int op, bool probe) {
+	int capacity = probe ? src->size : dst->size + src->size;
+	//the count of each change is the amount added, or removed if negative.
+	struct item *changes = malloc((capacity + 1) * sizeof(struct item));
+	if (changes == NULL) {
+		printNullError();
+	}
+
+	struct cursor cur1;
+	struct node *path1[MAX_HEIGHT];
+	struct cursor cur2;
+	struct node *path2[MAX_HEIGHT];
+	cursorInit(&cur1, dst, path1);
+	cursorInit(&cur2, src, path2);
+	bool more1 = !probe && cursorNext(&cur1);
+	bool more2 = cursorNext(&cur2);
+	int n = 0;
+
+	while (more1 || more2) {
+		struct item item1 = cursorGet(&cur1);
+		struct item item2 = cursorGet(&cur2);
+		int elem;
+		int count1;
+		if (probe) {
+			elem = item2.elem;
+			count1 = doMsetGetCount(dst, elem);
+			more2 = cursorNext(&cur2);
+		} else if (!more2 || (more1 && item1.elem < item2.elem)) {
+			elem = item1.elem;
+			count1 = item1.count;
+			item2.count = 0;
+			more1 = cursorNext(&cur1);
+		} else if (!more1 || item2.elem < item1.elem) {
+			elem = item2.elem;
+			count1 = 0;
+			more2 = cursorNext(&cur2);
+		} else {
+			elem = item1.elem;
+			count1 = item1.count;
+			more1 = cursorNext(&cur1);
+			more2 = cursorNext(&cur2);
+		}
+
+		int change = mergeCount(op, count1, item2.count) - count1;
+		if (change != 0) {
+			changes[n++] = (struct item){elem, change};
+		}
+	}
+
+	for (int i = 0; i < n; i++) {
+		if (changes[i].count > 0) {
+			doMsetInsertMany(dst, changes[i].elem, changes[i].count);
+		} else {
+			doMsetDeleteMany(dst, changes[i].elem, -changes[i].count);
+		}
+	}
+	free(changes);
+}
+
+/*
+* Walks s1 and s2 in order in lockstep and stores the combination of the two
+* multisets in the empty multiset result. The items of the result come out in
+* increasing order, so they are loaded into the result in one pass without any
+* rotations. Takes O(|s1| + |s2|) time.
+*/
+static void doMsetMerge(Mset result, Mset s1, Mset s2, int op) {
+	struct item *items = malloc((s1->size + s2->size + 1) *
+	sizeof(struct item));
+	if (items == NULL) {
+		printNullError();
+	}
+
+	struct cursor cur1;
+	struct node *path1[MAX_HEIGHT];
+	struct cursor cur2;
+	struct node *path2[MAX_HEIGHT];
+	cursorInit(&cur1, s1, path1);
+	cursorInit(&cur2, s2, path2);
+	bool more1 = cursorNext(&cur1);
+	bool more2 = cursorNext(&cur2);
+	int n = 0;
+
+	while (more1 || more2) {
+		struct item item1 = cursorGet(&cur1);
+		struct item item2 = cursorGet(&cur2);
+		if (!more2 || (more1 && item1.elem < item2.elem)) {
+			items[n] = (struct item){item1.elem,
+			mergeCount(op, item1.count, 0)};
+			more1 = cursorNext(&cur1);
+		} else if (!more1 || item2.elem < item1.elem) {
+			items[n] = (struct item){item2.elem,
+			mergeCount(op, 0, item2.count)};
+			more2 = cursorNext(&cur2);
+		} else {
+			items[n] = (struct item){item1.elem,
+			mergeCount(op, item1.count, item2.count)};
+			more1 = cursorNext(&cur1);
+			more2 = cursorNext(&cur2);
+		}
+
+		//elements that end up with a count of 0 are left out.
+		if (items[n].count > 0) {
+			n++;
+		}
+	}
+
+	loadItems(result, items, n);
+	free(items);
+}
+
+/*
+* Stores the intersection of small and big in the empty multiset result by
+* looking up every element of small in big. Since small is walked in order, the
+* result is still loaded from sorted items.
+*/
+static void doMsetIntersectionProbe(Mset result, Mset small, Mset big) {
+	struct item *items = malloc((small->size + 1) * sizeof(struct item));
+	if (items == NULL) {
+		printNullError();
+	}
+
+	struct cursor cur;
+	struct node *path[MAX_HEIGHT];
+	cursorInit(&cur, small, path);
+	int n = 0;
+	while (cursorNext(&cur)) {
+		struct item item = cursorGet(&cur);
+		int count = mergeCount(MERGE_INTERSECTION, item.count,
+		doMsetGetCount(big, item.elem));
+		if (count > 0) {
+			items[n++] = (struct item){item.elem, count};
+		}
+	}
+
+	loadItems(result, items, n);
+	free(items);
+}
+
+/*
+* Returns the count an element should have in the result of the given merge
+* operation, where a count of 0 means the element is missing from that multiset.
+*/
+static int mergeCount(int op, int count1, int count2) {
+	switch (op) {
+	case MERGE_UNION:
+		return count1 > count2 ? count1 : count2;
+	case MERGE_INTERSECTION:
+		return count1 < count2 ? count1 : count2;
+	case MERGE_SUM:
+		return count1 + count2;
+	case MERGE_DIFFERENCE:
+		return count1 > count2 ? count1 - count2 : 0;
+	default:
+		return count1 > count2 ? count1 - count2 : count2 - count1;
+	}
+}
+
+/*
+* Appends a new node to the end of the result's list if the amount is positive.
+* Elements must be appended in increasing order.
+*/
+static void appendNode(Mset result, struct node **tail, int item, int amount) {
+	if (amount <= 0) {
+		return;
+	}
+
+	struct node *new = newNode(result, item, amount);
+	new->prev = *tail;
+	(*tail)->next = new;
+	*tail = new;
+	result->size++;
+	result->totalCount += amount;
+	countChanged(result, item, 0, amount);
+}
+
+/*
+* Loads n items with positive counts in strictly increasing order of element
+* into the empty multiset s in O(n) time.
+*/
+static void loadItems(Mset s, struct item *items, int n) {
+	if (s->kind == KIND_BTREE) {
+		for (int i = 0; i < n; i++) {
+			s->size++;
+			s->totalCount += items[i].count;
+			countChanged(s, items[i].elem, 0, items[i].count);
+		}
+		btreeLoad(s->btree, items, n);
+		return;
+	}
+	if (s->kind == KIND_COMPACT && n > COMPACT_MAX_SIZE) {
+		compactToTree(s);
+	}
+	if (s->kind == KIND_COMPACT) {
+		for (int i = 0; i < n; i++) {
+			s->size++;
+			s->totalCount += items[i].count;
+			countChanged(s, items[i].elem, 0, items[i].count);
+		}
+		compactLoad(s->compact, items, n);
+		return;
+	}
+
+	struct node head = {.next = NULL};
+	struct node *tail = &head;
+	for (int i = 0; i < n; i++) {
+		appendNode(s, &tail, items[i].elem, items[i].count);
+	}
+	finishList(s, head.next, tail);
+}
+
+/*
+* Sets up the multiset around a sorted list of nodes from head to tail which
+* has already been counted in size and totalCount, and builds its tree. The
+* list is dropped again if the multiset has none.
+*/
+static void finishList(Mset result, struct node *head, struct node *tail) {
+	if (head == NULL) {
+		return;
+	}
+
+	//the dummy head node used while appending must not be linked to.
+	head->prev = NULL;
+	result->listBegin = head;
+	result->listEnd = tail;
+
+	struct node *curr = head;
+	result->tree = listToTree(&curr, result->size);
+	if (result->flags & MSET_NO_LIST) {
+		result->listBegin = NULL;
+		result->listEnd = NULL;
+	}
+}
+
+/*
+* Builds a height-balanced tree out of the next n nodes of a sorted list in
+* O(n) time, advancing *head past them. The left subtree is built first so that
+* the nodes are used in order. The sizes of the two subtrees differ by at most
+* one, so their heights do too and no rebalancing is needed.
+*/
+static struct node *listToTree(struct node **head, int n) {
+	if (n <= 0) {
+		return NULL;
+	}
+
+	struct node *left = listToTree(head, n / 2);
+	struct node *root = *head;
+	*head = root->next;
+	root->left = left;
+	root->right = listToTree(head, n - n / 2 - 1);
+	updateNode(root);
+	return root;
+}
+
+/**
+ * Returns true if the multiset s1 is included in the multiset s2, and
+ * false otherwise.
+ */
+bool MsetIncluded(Mset s1, Mset s2) {
+	STATS_START(start);
+	combineBeforeRead(s1);
+	combineBeforeRead(s2);
+	bool included;
+	if (s1->kind == KIND_SHARDED || s2->kind == KIND_SHARDED) {
+		included = shardsTest(s1, s2, MsetIncluded);
+	} else {
+		readLockPair(s1, s2);
+		included = doMsetIncluded(s1, s2);
+		readUnlockPair(s1, s2);
+	}
+	STATS_CALL(s1, MSET_CALL_SET_OP, start);
+	return included;
+}
+
+/*
+* Checks if s1 is included in s2, where both are locked for reading.
+*/
+static bool doMsetIncluded(Mset s1, Mset s2) {
+	if (s1->size > s2->size || s1->totalCount > s2->totalCount) {
+		return false;
+	}
+	//the empty set is always a subset of the other set.
+	if (s1->size == 0) {
+		return true;
+	}
+	if (doMsetSelect(s1, 0).elem < doMsetSelect(s2, 0).elem ||
+		doMsetSelect(s1, s1->size - 1).elem >
+		doMsetSelect(s2, s2->size - 1).elem) {
+		return false;
+	}
+
+	if (s1->size <= s2->size / 32) {
+		return doMsetIncludedProbe(s1, s2);
+	}
+	if (joinApplies(s1, s2)) {
+		return joinIncludedSets(s1, s2);
+	}
+	return doMsetIncludedWalk(s1, s2);
+}
+
+/*
+* Checks if s2 includes s1 by walking both in order in lockstep, stopping at the
+* first element of s1 that is missing from s2 or has a bigger count.
+*/
+static bool doMsetIncludedWalk(Mset s1, Mset s2) {
+	struct cursor cur1;
+	struct node *path1[MAX_HEIGHT];
+	struct cursor cur2;
+	struct node *path2[MAX_HEIGHT];
+	cursorInit(&cur1, s1, path1);
+	cursorInit(&cur2, s2, path2);
+	bool more2 = cursorNext(&cur2);
+
+	while (cursorNext(&cur1)) {
+		struct item item1 = cursorGet(&cur1);
+		while (more2 && cursorGet(&cur2).elem < item1.elem) {
+			more2 = cursorNext(&cur2);
+		}
+
+		struct item item2 = cursorGet(&cur2);
+		if (!more2 || item2.elem != item1.elem || item2.count < item1.count) {
+			return false;
+		}
+		more2 = cursorNext(&cur2);
+	}
+	return true;
+}
+
+/*
+* Checks if s2 includes s1 by looking up each element of s1 in s2, which is
+* cheaper than walking all of s2 when s1 is much smaller.
+*/
+static bool doMsetIncludedProbe(Mset s1, Mset s2) {
+	struct cursor cur;
+	struct node *path[MAX_HEIGHT];
+	cursorInit(&cur, s1, path);
+	while (cursorNext(&cur)) {
+		struct item item = cursorGet(&cur);
+		if (doMsetGetCount(s2, item.elem) < item.count) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Returns true if the two given multisets are equal, and false
+ * otherwise.
+ */
+bool MsetEquals(Mset s1, Mset s2) {
+	STATS_START(start);
+	combineBeforeRead(s1);
+	combineBeforeRead(s2);
+	bool equal;
+	if (s1->kind == KIND_SHARDED || s2->kind == KIND_SHARDED) {
+		equal = shardsTest(s1, s2, MsetEquals);
+	} else {
+		readLockPair(s1, s2);
+		equal = doMsetEquals(s1, s2);
+		readUnlockPair(s1, s2);
+	}
+	STATS_CALL(s1, MSET_CALL_SET_OP, start);
+	return equal;
+}
+
+/*
+* Checks if two multisets that are locked for reading are equal.
+*/
+static bool doMsetEquals(Mset s1, Mset s2) {
+	//equal multisets always have the same content hash, so most unequal
+	//multisets are told apart without looking at any nodes.
+	if (s1->size != s2->size || s1->totalCount != s2->totalCount ||
+		s1->hash != s2->hash) {
+		return false;
+	}
+
+	//both have the same number of elements, so they run out together.
+	struct cursor cur1;
+	struct node *path1[MAX_HEIGHT];
+	struct cursor cur2;
+	struct node *path2[MAX_HEIGHT];
+	cursorInit(&cur1, s1, path1);
+	cursorInit(&cur2, s2, path2);
+	while (cursorNext(&cur1) && cursorNext(&cur2)) {
+		struct item item1 = cursorGet(&cur1);
+		struct item item2 = cursorGet(&cur2);
+		if (item1.elem != item2.elem || item1.count != item2.count) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Stores the k most common elements in the multiset into the given
+ * items array in decreasing order of count and returns the number of
+ * elements stored. Elements with the same count should be stored in
+ * increasing order. Assumes that the items array has size k.
+ */
+int MsetMostCommon(Mset s, int k, struct item items[]) {
+	STATS_START(start);
+	combineBeforeRead(s);
+	int n;
+	if (s->kind == KIND_SHARDED) {
+		Mset flat = shardsFlatten(s);
+		n = MsetMostCommon(flat, k, items);
+		MsetFree(flat);
+	} else {
+		readLock(s);
+		n = doMsetMostCommon(s, k, items);
+		readUnlock(s);
+	}
+	STATS_CALL(s, MSET_CALL_MOST_COMMON, start);
+	return n;
+}
+
+/*
+* Stores the k most common elements of a multiset that is locked for reading
+* into items and returns the number stored.
+*/
+static int doMsetMostCommon(Mset s, int k, struct item items[]) {
+	if (k <= 0 || s->size == 0) {
+		return 0;
+	}
+	if (s->flags & MSET_COUNT_INDEX) {
+		return countIndexMostCommon(s, k, items);
+	}
+	if (s->kind == KIND_MAPPED) {
+		return mappedMostCommon(s, k, items);
+	}
+	if (s->kind == KIND_COMPACT) {
+		return compactMostCommon(s, k, items);
+	}
+
+	struct cursor cur;
+	struct node *path[MAX_HEIGHT];
+	cursorInit(&cur, s, path);
+	if (k == 1) {
+		//a single most common element only needs a linear scan.
+		cursorNext(&cur);
+		items[0] = cursorGet(&cur);
+		while (cursorNext(&cur)) {
+			struct item newItem = cursorGet(&cur);
+			if (newItem.count > items[0].count) {
+				items[0] = newItem;
+			}
+		}
+		return 1;
+	}
+
+	//items is used as a heap of the most common elements seen so far, with
+	//the least common of them at the root.
+	int n = 0;
+	while (cursorNext(&cur)) {
+		struct item newItem = cursorGet(&cur);
+		if (n < k) {
+			items[n] = newItem;
+			heapSiftUp(items, n);
+			n++;
+		} else if (moreCommon(newItem, items[0])) {
+			items[0] = newItem;
+			heapSiftDown(items, 0, n);
+		}
+	}
+
+	heapSort(items, n);
+	return n;
+}
+
+/*
+* Stores the first k elements of the count index into items with an in-order
+* walk that stops after k nodes, which takes O(k + log n) time.
+*/
+static int countIndexMostCommon(Mset s, int k, struct item items[]) {
+	struct node *stack[MAX_HEIGHT];
+	int depth = 0;
+	int n = 0;
+	struct node *curr = s->countTree;
+
+	while (n < k && (curr != NULL || depth > 0)) {
+		if (curr != NULL) {
+			stack[depth++] = curr;
+			curr = curr->left;
+		} else {
+			curr = stack[--depth];
+			items[n++] = (struct item){curr->elem, curr->count};
+			curr = curr->right;
+		}
+	}
+	return n;
+}
+
+/*
+* Moves an item to its new position in the count index when its count changes.
+* The index node is reused when the item stays in the multiset.
+*/
+static void countIndexUpdate(Mset s, int item, int oldCount, int newCount) {
+	struct node *node = NULL;
+	if (oldCount > 0) {
+		node = countIndexRemove(s, item, oldCount);
+	}
+
+	if (newCount <= 0) {
+		if (node != NULL) {
+			freeNode(s, node);
+		}
+		return;
+	}
+
+	if (node == NULL) {
+		node = newNode(s, item, newCount);
+	}
+	node->count = newCount;
+	node->left = NULL;
+	node->right = NULL;
+	node->height = 0;
+	node->subTreeSize = 1;
+	node->subTreeCount = newCount;
+	countIndexInsert(s, node);
+}
+
+/*
+* Inserts a node into the count index, which is an AVL tree of its own ordered
+* by decreasing count and then increasing element.
+*/
+static void countIndexInsert(Mset s, struct node *new) {
+	struct node **path[MAX_HEIGHT];
+	int depth = 0;
+	struct node **link = &s->countTree;
+
+	while (*link != NULL) {
+		path[depth++] = link;
+		if (countOrder(new->elem, new->count, *link) < 0) {
+			link = &(*link)->left;
+		} else {
+			link = &(*link)->right;
+		}
+	}
+
+	*link = new;
+	rebalancePath(s, path, depth);
+}
+
+/*
+* Takes the node of the given item and count out of the count index and returns
+* it, or NULL if there is no such node.
+*/
+static struct node *countIndexRemove(Mset s, int item, int count) {
+	struct node **path[MAX_HEIGHT];
+	int depth = 0;
+	struct node **link = &s->countTree;
+
+	while (*link != NULL) {
+		int order = countOrder(item, count, *link);
+		if (order == 0) {
+			break;
+		}
+		path[depth++] = link;
+		if (order < 0) {
+			link = &(*link)->left;
+		} else {
+			link = &(*link)->right;
+		}
+	}
+
+	struct node *node = *link;
+	if (node != NULL) {
+		depth = detachNode(s, path, depth, link);
+		rebalancePath(s, path, depth);
+	}
+	return node;
+}
+
+/*
+* Compares an item with the given count against a node of the count index,
+* returning a negative number if the item comes first, 0 if they are the same
+* and a positive number otherwise.
+*/
+static int countOrder(int item, int count, struct node *node) {
+	if (count != node->count) {
+		return count > node->count ? -1 : 1;
+	}
+	return (item > node->elem) - (item < node->elem);
+}
+
+/*
+* Frees all the nodes of a tree that is not threaded by a list, rotating left
+* children up so that no stack is needed.
+*/
+static void freeTree(struct node *tree) {
+	while (tree != NULL) {
+		if (tree->left != NULL) {
+			struct node *left = tree->left;
+			tree->left = left->right;
+			left->right = tree;
+			tree = left;
+		} else {
+			struct node *right = tree->right;
+			free(tree);
+			tree = right;
+		}
+	}
+}
+
+/*
+* Checks if item1 comes before item2 in the order of MsetMostCommon, which is
+* decreasing order of count and then increasing order of element.
+*/
+static bool moreCommon(struct item item1, struct item item2) {
+	if (item1.count != item2.count) {
+		return item1.count > item2.count;
+	}
+	return item1.elem < item2.elem;
+}
+
+/*
+* Moves the item at index i of the heap up until its parent is less common.
+*/
+static void heapSiftUp(struct item heap[], int i) {
+	while (i > 0 && moreCommon(heap[(i - 1) / 2], heap[i])) {
+		struct item parent = heap[(i - 1) / 2];
+		heap[(i - 1) / 2] = heap[i];
+		heap[i] = parent;
+		i = (i - 1) / 2;
+	}
+}
+
+/*
+* Moves the item at index i of a heap of n items down until both of its
+* children are more common.
+*/
+static void heapSiftDown(struct item heap[], int i, int n) {
+	while (2 * i + 1 < n) {
+		int child = 2 * i + 1;
+		if (child + 1 < n && moreCommon(heap[child], heap[child + 1])) {
+			child++;
+		}
+		if (!moreCommon(heap[i], heap[child])) {
+			return;
+		}
+
+		struct item parent = heap[i];
+		heap[i] = heap[child];
+		heap[child] = parent;
+		i = child;
+	}
+}
+
+/*
+* Sorts a heap of n items into decreasing order of how common they are by
+* moving the least common item left to the back.
+*/
+static void heapSort(struct item heap[], int n) {
+	for (int end = n - 1; end > 0; end--) {
+		struct item least = heap[0];
+		heap[0] = heap[end];
+		heap[end] = least;
+		heapSiftDown(heap, 0, end);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////
+// Order Statistics
+
+/**
+ * Returns the number of distinct elements in the multiset that are
+ * smaller than the given item.
+ */
+int MsetRank(Mset s, int item) {
+	combineBeforeRead(s);
+	if (s->kind == KIND_SHARDED) {
+		return shardsRank(s, item);
+	}
+	readLock(s);
+	int rank = doMsetRank(s, item);
+	readUnlock(s);
+	return rank;
+}
+
+/*
+* Returns the rank of the item in a multiset that is locked for reading.
+*/
+static int doMsetRank(Mset s, int item) {
+	if (s->kind == KIND_BTREE) {
+		return btreeRank(s->btree, item);
+	}
+	if (s->kind == KIND_DENSE) {
+		return denseRank(s->dense, item);
+	}
+	if (s->kind == KIND_MAPPED) {
+		struct cursor cur;
+		cursorInit(&cur, s, NULL);
+		return mappedCursorSeek(&cur, item, false) ? cur.index : s->size;
+	}
+	if (s->kind == KIND_COMPACT) {
+		return compactRank(s->compact, item);
+	}
+
+	int rank = 0;
+	struct node *tree = s->tree;
+	while (tree != NULL) {
+		if (tree->elem < item) {
+			rank += treeSize(tree->left) + 1;
+			tree = tree->right;
+		} else {
+			tree = tree->left;
+		}
+	}
+	return rank;
+}
+
+/**
+ * Returns the element with the given index in increasing order of the
+ * distinct elements, starting from 0, and its count, or {UNDEFINED, 0}
+ * if the index is not between 0 and MsetSize - 1.
+ */
+struct item MsetSelect(Mset s, int index) {
+	combineBeforeRead(s);
+	if (s->kind == KIND_SHARDED) {
+		return shardsSelect(s, index, false);
+	}
+	readLock(s);
+	struct item item = doMsetSelect(s, index);
+	readUnlock(s);
+	return item;
+}
+
+/*
+* Returns the element with the given index of a multiset that is locked for
+* reading.
+*/
+static struct item doMsetSelect(Mset s, int index) {
+	if (index < 0 || index >= s->size) {
+		return (struct item){UNDEFINED, 0};
+	}
+	if (s->kind == KIND_BTREE) {
+		return btreeSelect(s->btree, index);
+	}
+	if (s->kind == KIND_DENSE) {
+		return denseSelect(s->dense, index);
+	}
+	if (s->kind == KIND_MAPPED) {
+		return mappedSelect(s, index);
+	}
+	if (s->kind == KIND_COMPACT) {
+		return compactSelect(s->compact, index);
+	}
+
+	struct node *tree = s->tree;
+	while (index != treeSize(tree->left)) {
+		if (index < treeSize(tree->left)) {
+			tree = tree->left;
+		} else {
+			index -= treeSize(tree->left) + 1;
+			tree = tree->right;
+		}
+	}
+	return (struct item){tree->elem, tree->count};
+}
+
+/**
+ * Returns the element at the given position, starting from 0, of the
+ * multiset written out in increasing order with each element repeated
+ * as many times as its count, and its count, or {UNDEFINED, 0} if the
+ * position is not between 0 and MsetTotalCount - 1. For example
+ * position MsetTotalCount / 2 holds the median.
+ */
+struct item MsetSelectByCount(Mset s, int position) {
+	combineBeforeRead(s);
+	if (s->kind == KIND_SHARDED) {
+		return shardsSelect(s, position, true);
+	}
+	readLock(s);
+	struct item item = doMsetSelectByCount(s, position);
+	readUnlock(s);
+	return item;
+}
+
+/*
+* Returns the element at the given position of a multiset that is locked for
+* reading.
+*/
+static struct item doMsetSelectByCount(Mset s, int position) {
+	if (position < 0 || position >= s->totalCount) {
+		return (struct item){UNDEFINED, 0};
+	}
+	if (s->kind == KIND_BTREE) {
+		return btreeSelectByCount(s->btree, position);
+	}
+	if (s->kind == KIND_DENSE) {
+		return denseSelectByCount(s->dense, position);
+	}
+	if (s->kind == KIND_MAPPED) {
+		return mappedSelectByCount(s, position);
+	}
+	if (s->kind == KIND_COMPACT) {
+		return compactSelectByCount(s->compact, position);
+	}
+
+	struct node *tree = s->tree;
+	while (true) {
+		if (position < treeCount(tree->left)) {
+			tree = tree->left;
+		} else if (position < treeCount(tree->left) + tree->count) {
+			return (struct item){tree->elem, tree->count};
+		} else {
+			position -= treeCount(tree->left) + tree->count;
+			tree = tree->right;
+		}
+	}
+}
+
+/**
+ * Returns the sum of the counts of the elements of the multiset that
+ * are between lo and hi inclusive.
+ */
+int MsetCountRange(Mset s, int lo, int hi) {
+	combineBeforeRead(s);
+	if (s->kind == KIND_SHARDED) {
+		return shardsCountRange(s, lo, hi);
+	}
+	readLock(s);
+	int count = doMsetCountRange(s, lo, hi);
+	readUnlock(s);
+	return count;
+}
+
+/*
+* Returns the sum of the counts between lo and hi of a multiset that is locked
+* for reading.
+*/
+static int doMsetCountRange(Mset s, int lo, int hi) {
+	if (lo > hi) {
+		return 0;
+	}
+	if (s->kind == KIND_BTREE) {
+		return btreeCountBelow(s->btree, hi, true) -
+		btreeCountBelow(s->btree, lo, false);
+	}
+	if (s->kind == KIND_DENSE) {
+		return denseCountBelow(s->dense, hi, true) -
+		denseCountBelow(s->dense, lo, false);
+	}
+	if (s->kind == KIND_MAPPED) {
+		return mappedCountBelow(s, hi, true) - mappedCountBelow(s, lo, false);
+	}
+	if (s->kind == KIND_COMPACT) {
+		return compactCountBelow(s->compact, hi, true) -
+		compactCountBelow(s->compact, lo, false);
+	}
+	return countBelow(s->tree, hi, true) - countBelow(s->tree, lo, false);
+}
+
+/*
+* Returns the sum of the counts of the elements in the tree that are smaller
+* than the given item, or smaller or equal if inclusive is true.
+*/
+static int countBelow(struct node *tree, int item, bool inclusive) {
+	int total = 0;
+	while (tree != NULL) {
+		if (tree->elem < item || (inclusive && tree->elem == item)) {
+			total += treeCount(tree->left) + tree->count;
+			tree = tree->right;
+		} else {
+			tree = tree->left;
+		}
+	}
+	return total;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Cursor Operations
+
+/**
+ * Creates a new cursor positioned at the start of the multiset.
+ * (see spec for explanation of start and end)
+ */
+MsetCursor MsetCursorNew(Mset s) {
+	combineBeforeRead(s);
+	MsetCursor new = malloc(sizeof(struct cursor));
+	if (new == NULL) {
+		printNullError();
+	}
+	cursorInit(new, s, NULL);
+	if (s->kind == KIND_SHARDED) {
+		//the cursor starts at the start of the first shard.
+		new->index = 0;
+		new->part = MsetCursorNew(s->shards->parts[0]);
+	}
+	return new;
+}
+
+/*
+* Positions a cursor at the start of the multiset. Cursors that are only used
+* inside one function are kept on the stack and set up with this, together
+* with room on the stack for MAX_HEIGHT nodes of path if the multiset may be
+* one whose cursors keep their path. Otherwise path is NULL, and cursors made
+* by MsetCursorNew allocate it when it is first needed.
+*/
+static void cursorInit(struct cursor *cur, Mset s, struct node **path) {
+	cur->curr = NULL;
+	cur->leaf = NULL;
+	cur->index = -1;
+	cur->atEnd = false;
+	cur->s = s;
+	cur->item = (struct item){UNDEFINED, 0};
+	cur->version = 0;
+	cur->part = NULL;
+	cur->elemAt = NULL;
+	cur->countAt = NULL;
+	cur->path = path;
+	cur->depth = 0;
+	cur->epoch = s->epoch;
+}
+
+/**
+ * Frees all memory allocated to the given cursor.
+ */
+void MsetCursorFree(MsetCursor cur) {
+	if (cur->part != NULL) {
+		MsetCursorFree(cur->part);
+	}
+	free(cur->path);
+	free(cur);
+}
+
+/**
+ * Returns the element at the cursor's position and its count, or
+ * {UNDEFINED, 0} if the cursor is positioned at the start or end of
+ * the multiset.
+ */
+struct item MsetCursorGet(MsetCursor cur) {
+	if (cur->s->sync != NULL) {
+		return syncCursorGet(cur);
+	}
+	if (cur->s->kind == KIND_SHARDED) {
+		return MsetCursorGet(cur->part);
+	}
+	if (cursorStale(cur)) {
+		return staleCursorGet(cur);
+	}
+	return cursorGet(cur);
+}
+
+/*
+* Returns the element at the cursor's position and its count, whatever the
+* representation of the multiset.
+*/
+static struct item cursorGet(MsetCursor cur) {
+	if (cur->s->kind == KIND_BTREE) {
+		if (cur->leaf == NULL) {
+			return (struct item){UNDEFINED, 0};
+		}
+		return (struct item){cur->leaf->elems[cur->index],
+		cur->leaf->counts[cur->index]};
+	}
+	if (cur->s->kind == KIND_DENSE) {
+		if (cur->index < 0) {
+			return (struct item){UNDEFINED, 0};
+		}
+		return (struct item){cur->s->dense->lo + cur->index,
+		cur->s->dense->counts[cur->index]};
+	}
+	if (cur->s->kind == KIND_MAPPED) {
+		if (cur->index < 0) {
+			return (struct item){UNDEFINED, 0};
+		}
+		return cur->item;
+	}
+	if (cur->s->kind == KIND_COMPACT) {
+		if (cur->index < 0) {
+			return (struct item){UNDEFINED, 0};
+		}
+		struct cnode *node = &cur->s->compact->nodes[cur->index];
+		return (struct item){node->elem, node->count};
+	}
+
+	if (cur->curr == NULL) {
+		return (struct item){UNDEFINED, 0};
+	}
+	return (struct item){cur->curr->elem, cur->curr->count};
+}
+
+/**
+ * Moves the cursor to the next greatest element, or to the end of the
+ * multiset if there is no next greatest element. Does not move the
+ * cursor if it is already at the end. Returns false if the cursor is at
+ * the end after this operation, and true otherwise.
+ */
+bool MsetCursorNext(MsetCursor cur) {
+	if (cur->s->sync != NULL) {
+		return syncCursorMove(cur, true);
+	}
+	if (cur->s->kind == KIND_SHARDED) {
+		return shardsCursorNext(cur);
+	}
+	if (cursorStale(cur)) {
+		cursorRecover(cur, true);
+	}
+	bool moved = cursorNext(cur);
+	cursorKeep(cur);
+	return moved;
+}
+
+/*
+* Moves the cursor to the next element, whatever the representation of the
+* multiset.
+*/
+static bool cursorNext(MsetCursor cur) {
+	if (cur->s->kind == KIND_BTREE) {
+		return btreeCursorNext(cur);
+	}
+	if (cur->s->kind == KIND_DENSE) {
+		return denseCursorNext(cur);
+	}
+	if (keepsPath(cur->s)) {
+		return treeCursorMove(cur, true);
+	}
+	if (cur->s->kind == KIND_MAPPED) {
+		return mappedCursorNext(cur);
+	}
+	if (cur->s->kind == KIND_COMPACT) {
+		return compactCursorMove(cur, true);
+	}
+
+	if (cur->curr != NULL) {
+		cur->curr = cur->curr->next;
+	} else if (!cur->atEnd) {
+		//cursor is currently at the start.
+		cur->curr = cur->s->listBegin;
+	}
+
+	//there was no next element, so the cursor is now at the end.
+	if (cur->curr == NULL) {
+		cur->atEnd = true;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Moves the cursor to the next smallest element, or to the start of the
+ * multiset if there is no next smallest element. Does not move the
+ * cursor if it is already at the start. Returns false if the cursor is
+ * at the start after this operation, and true otherwise.
+ */
+bool MsetCursorPrev(MsetCursor cur) {
+	if (cur->s->sync != NULL) {
+		return syncCursorMove(cur, false);
+	}
+	if (cur->s->kind == KIND_SHARDED) {
+		return shardsCursorPrev(cur);
+	}
+	if (cursorStale(cur)) {
+		cursorRecover(cur, false);
+	}
+	bool moved = cursorPrev(cur);
+	cursorKeep(cur);
+	return moved;
+}
+
+/*
+* Moves the cursor to the previous element, whatever the representation of the
+* multiset.
+*/
+static bool cursorPrev(MsetCursor cur) {
+	if (cur->s->kind == KIND_BTREE) {
+		return btreeCursorPrev(cur);
+	}
+	if (cur->s->kind == KIND_DENSE) {
+		return denseCursorPrev(cur);
+	}
+	if (keepsPath(cur->s)) {
+		return treeCursorMove(cur, false);
+	}
+	if (cur->s->kind == KIND_MAPPED) {
+		return mappedCursorPrev(cur);
+	}
+	if (cur->s->kind == KIND_COMPACT) {
+		return compactCursorMove(cur, false);
+	}
+
+	if (cur->curr != NULL) {
+		cur->curr = cur->curr->prev;
+	} else if (cur->atEnd) {
+		//cursor is currently at the end.
+		cur->curr = cur->s->listEnd;
+	}
+
+	//there was no previous element, so the cursor is now at the start.
+	if (cur->curr == NULL) {
+		cur->atEnd = false;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Moves the cursor to the smallest element that is greater than or
+ * equal to the given item, or to the end of the multiset if there is no
+ * such element. Returns false if the cursor is at the end after this
+ * operation, and true otherwise.
+ */
+bool MsetCursorSeek(MsetCursor cur, int item) {
+	if (cur->s->sync != NULL) {
+		return syncCursorSeek(cur, item, false);
+	}
+	if (cur->s->kind == KIND_SHARDED) {
+		return shardsCursorSeek(cur, item, false);
+	}
+	bool found = cursorSeek(cur, item, false);
+	cursorKeep(cur);
+	return found;
+}
+
+/**
+ * Moves the cursor to the smallest element that is greater than the
+ * given item, or to the end of the multiset if there is no such
+ * element. Returns false if the cursor is at the end after this
+ * operation, and true otherwise.
+ */
+bool MsetCursorSeekAfter(MsetCursor cur, int item) {
+	if (cur->s->sync != NULL) {
+		return syncCursorSeek(cur, item, true);
+	}
+	if (cur->s->kind == KIND_SHARDED) {
+		return shardsCursorSeek(cur, item, true);
+	}
+	bool found = cursorSeek(cur, item, true);
+	cursorKeep(cur);
+	return found;
+}
+
+/*
+* Moves the cursor to the first element that is not smaller than the item, or
+* the first element that is greater than the item if after is true.
+*/
+static bool cursorSeek(MsetCursor cur, int item, bool after) {
+	if (cur->s->kind == KIND_BTREE) {
+		return btreeCursorSeek(cur, item, after);
+	}
+	if (cur->s->kind == KIND_DENSE) {
+		return denseCursorSeek(cur, item, after);
+	}
+	if (cur->s->kind == KIND_MAPPED) {
+		return mappedCursorSeek(cur, item, after);
+	}
+	if (cur->s->kind == KIND_COMPACT) {
+		return compactCursorSeek(cur, item, after);
+	}
+	if (keepsPath(cur->s)) {
+		return treeCursorSeek(cur, item, after);
+	}
+
+	cur->curr = bstLowerBound(cur->s->tree, item, after);
+	cur->atEnd = cur->curr == NULL;
+	return cur->curr != NULL;
+}
+
+/*
+* Finds the node with the smallest element that is greater than or equal to the
+* item, or strictly greater if after is true. Returns NULL if there is none.
+*/
+static struct node *bstLowerBound(struct node *tree, int item, bool after) {
+	struct node *found = NULL;
+	while (tree != NULL) {
+		if (tree->elem > item || (!after && tree->elem == item)) {
+			found = tree;
+			tree = tree->left;
+		} else {
+			tree = tree->right;
+		}
+	}
+	return found;
+}
+
+/**
+ * Moves the cursor forward by up to n elements as if by calling
+ * MsetCursorNext n times, storing each element the cursor moves onto
+ * and its count into the given items array, which must have size n.
+ * Stops early at the end of the multiset. Returns the number of
+ * elements stored.
+ */
+int MsetCursorNextN(MsetCursor cur, int n, struct item items[]) {
+	if (n <= 0) {
+		return 0;
+	}
+	if (cur->s->sync != NULL) {
+		//the whole batch is read under one lock.
+		readLock(cur->s);
+		syncCursorRecover(cur, true);
+		int stored = cursorNextN(cur, n, items);
+		cur->item = cursorGet(cur);
+		cur->version = cur->s->sync->version;
+		readUnlock(cur->s);
+		return stored;
+	}
+	if (cur->s->kind == KIND_SHARDED) {
+		int stored = 0;
+		while (stored < n && shardsCursorNext(cur)) {
+			items[stored++] = MsetCursorGet(cur);
+		}
+		return stored;
+	}
+
+	if (cursorStale(cur)) {
+		cursorRecover(cur, true);
+	}
+	int stored = cursorNextN(cur, n, items);
+	cursorKeep(cur);
+	return stored;
+}
+
+/*
+* Moves the cursor forward by up to n elements, n being at least 1, storing
+* each element it moves onto, whatever the representation of the multiset.
+* Each representation is read in a loop of its own rather than through a call
+* per element. Returns the number of elements stored.
+*/
+static int cursorNextN(MsetCursor cur, int n, struct item items[]) {
+	if (cur->s->kind == KIND_BTREE) {
+		return btreeCursorNextN(cur, n, items);
+	}
+	if (cur->s->kind == KIND_DENSE) {
+		return denseCursorNextN(cur, n, items);
+	}
+	if (cur->s->kind == KIND_MAPPED) {
+		return mappedCursorNextN(cur, n, items);
+	}
+	if (keepsPath(cur->s) || cur->s->kind == KIND_COMPACT) {
+		//these cursors search for each next element anyway.
+		int stored = 0;
+		while (stored < n && cursorNext(cur)) {
+			items[stored++] = cursorGet(cur);
+		}
+		return stored;
+	}
+
+	struct node *node = cur->s->listBegin;
+	if (cur->curr != NULL) {
+		node = cur->curr->next;
+	} else if (cur->atEnd) {
+		node = NULL;
+	}
+	struct node *last = cur->curr;
+	int stored = 0;
+	for (; node != NULL && stored < n; node = node->next) {
+		items[stored++] = (struct item){node->elem, node->count};
+		last = node;
+	}
+
+	//running out of elements leaves the cursor at the end.
+	if (stored < n) {
+		last = NULL;
+		cur->atEnd = true;
+	}
+	cur->curr = last;
+	return stored;
+}
+
+////////////////////////////////////////////////////////////////////////
+// B+ Trees
+
+/*
+* Creates an empty B+ tree.
+*/
+static struct btree *btreeNew(void) {
+	struct btree *new = malloc(sizeof(struct btree));
+	if (new == NULL) {
+		printNullError();
+	}
+	new->root = NULL;
+	new->height = 0;
+	new->first = NULL;
+	new->last = NULL;
+	return new;
+}
+
+/*
+* Creates an empty leaf that is not linked to any other leaf.
+*/
+static struct bleaf *btreeNewLeaf(void) {
+	struct bleaf *new = malloc(sizeof(struct bleaf));
+	if (new == NULL) {
+		printNullError();
+	}
+	new->size = 0;
+	new->next = NULL;
+	new->prev = NULL;
+	return new;
+}
+
+/*
+* Creates an inner node without any keys or children.
+*/
+static struct binner *btreeNewInner(void) {
+	struct binner *new = malloc(sizeof(struct binner));
+	if (new == NULL) {
+		printNullError();
+	}
+	new->size = 0;
+	return new;
+}
+
+/*
+* Frees all the nodes of a B+ tree and the tree itself.
+*/
+static void btreeFree(struct btree *tree) {
+	btreeClear(tree);
+	free(tree);
+}
+
+/*
+* Frees all the nodes of a B+ tree, leaving it empty.
+*/
+static void btreeClear(struct btree *tree) {
+	if (tree->root != NULL) {
+		btreeFreeNode(tree->root, tree->height);
+	}
+	tree->root = NULL;
+	tree->height = 0;
+	tree->first = NULL;
+	tree->last = NULL;
+}
+
+/*
+* Frees a node with the given number of inner levels below and including it,
+* and everything under it.
+*/
+static void btreeFreeNode(void *node, int height) {
+	if (height > 0) {
+		struct binner *inner = node;
+		for (int i = 0; i <= inner->size; i++) {
+			btreeFreeNode(inner->children[i], height - 1);
+		}
+	}
+	free(node);
+}
+
+/*
+* Returns the number of keys in a sorted array that are smaller than the item,
+* or smaller or equal if inclusive is true. This is the index of the child to
+* follow in an inner node when inclusive is true, and the position of the item
+* in a leaf otherwise. The binary search moves the base with a conditional move
+* instead of a branch, so it never mispredicts.
+*/
+static int btreeSlot(const int keys[], int size, int item, bool inclusive) {
+	if (size == 0) {
+		return 0;
+	}
+
+	const int *base = keys;
+	int n = size;
+	if (inclusive) {
+		while (n > 1) {
+			int half = n / 2;
+			base = base[half] <= item ? base + half : base;
+			n -= half;
+		}
+		return base - keys + (*base <= item);
+	}
+
+	while (n > 1) {
+		int half = n / 2;
+		base = base[half] < item ? base + half : base;
+		n -= half;
+	}
+	return base - keys + (*base < item);
+}
+
+/*
+* Walks down a non-empty tree to the leaf that holds or would hold the item,
+* storing the inner nodes on the way in path and the child taken at each of
+* them in slots.
+*/
+static struct bleaf *btreeDescend(struct btree *tree, int item,
+struct binner *path[], int slots[]) {
+	void *node = tree->root;
+	for (int depth = 0; depth < tree->height; depth++) {
+		path[depth] = node;
+		slots[depth] = btreeSlot(path[depth]->keys, path[depth]->size, item,
+		true);
+		node = path[depth]->children[slots[depth]];
+	}
+	return node;
+}
+
+/*
+* Returns the count of an item in the tree, or 0 if it doesn't occur.
+*/
+static int btreeGetCount(struct btree *tree, int item) {
+	void *node = tree->root;
+	if (node == NULL) {
+		return 0;
+	}
+
+	for (int depth = 0; depth < tree->height; depth++) {
+		struct binner *inner = node;
+		node = inner->children[btreeSlot(inner->keys, inner->size, item, true)];
+	}
+
+	struct bleaf *leaf = node;
+	int slot = btreeSlot(leaf->elems, leaf->size, item, false);
+	if (slot < leaf->size && leaf->elems[slot] == item) {
+		return leaf->counts[slot];
+	}
+	return 0;
+}
+
+/*
+* Inserts the given amount of an item into the B+ tree of the multiset. A full
+* leaf is split in half before the new element goes in, and the new half is
+* added to the parent, which may have to be split in turn all the way up to the
+* root. totalCount is kept by the caller.
+*/
+static void btreeInsert(Mset s, int item, int amount) {
+	struct btree *tree = s->btree;
+	if (tree->root == NULL) {
+		tree->root = btreeNewLeaf();
+		tree->first = tree->root;
+		tree->last = tree->root;
+	}
+
+	struct binner *path[BTREE_MAX_HEIGHT];
+	int slots[BTREE_MAX_HEIGHT];
+	struct bleaf *leaf = btreeDescend(tree, item, path, slots);
+	int slot = btreeSlot(leaf->elems, leaf->size, item, false);
+
+	if (slot < leaf->size && leaf->elems[slot] == item) {
+		//the item is already in the tree so only the counts on the path change.
+		countChanged(s, item, leaf->counts[slot], leaf->counts[slot] + amount);
+		leaf->counts[slot] += amount;
+		for (int depth = 0; depth < tree->height; depth++) {
+			path[depth]->childCounts[slots[depth]] += amount;
+		}
+		return;
+	}
+
+	s->size++;
+	countChanged(s, item, 0, amount);
+
+	void *split = NULL;
+	int splitKey = 0;
+	if (leaf->size == BTREE_KEYS) {
+		struct bleaf *right = btreeSplitLeaf(tree, leaf);
+		split = right;
+		splitKey = right->elems[0];
+		if (slot > leaf->size) {
+			slot -= leaf->size;
+			leaf = right;
+		}
+	}
+
+	for (int i = leaf->size; i > slot; i--) {
+		leaf->elems[i] = leaf->elems[i - 1];
+		leaf->counts[i] = leaf->counts[i - 1];
+	}
+	leaf->elems[slot] = item;
+	leaf->counts[slot] = amount;
+	leaf->size++;
+
+	//adds the new element to the totals of the inner nodes on the path,
+	//passing a split child up to its parent until one has room for it.
+	for (int depth = tree->height - 1; depth >= 0; depth--) {
+		struct binner *parent = path[depth];
+		int child = slots[depth];
+		if (split == NULL) {
+			parent->childSizes[child]++;
+			parent->childCounts[child] += amount;
+			continue;
+		}
+
+		bool leaves = depth == tree->height - 1;
+		btreeTotals(parent->children[child], leaves,
+		&parent->childSizes[child], &parent->childCounts[child]);
+		split = btreeInsertChild(parent, child, splitKey, split, leaves,
+		&splitKey);
+	}
+
+	if (split != NULL) {
+		//the root was split, so the tree grows a new root above both halves.
+		bool leaves = tree->height == 0;
+		struct binner *root = btreeNewInner();
+		root->size = 1;
+		root->keys[0] = splitKey;
+		root->children[0] = tree->root;
+		root->children[1] = split;
+		btreeTotals(root->children[0], leaves, &root->childSizes[0],
+		&root->childCounts[0]);
+		btreeTotals(root->children[1], leaves, &root->childSizes[1],
+		&root->childCounts[1]);
+		tree->root = root;
+		tree->height++;
+	}
+}
+
+/*
+* Moves the upper half of a full leaf into a new leaf that follows it in the
+* chain of leaves, and returns the new leaf.
+*/
+static struct bleaf *btreeSplitLeaf(struct btree *tree, struct bleaf *leaf) {
+	struct bleaf *right = btreeNewLeaf();
+	int half = leaf->size / 2;
+	right->size = leaf->size - half;
+	for (int i = 0; i < right->size; i++) {
+		right->elems[i] = leaf->elems[half + i];
+		right->counts[i] = leaf->counts[half + i];
+	}
+	leaf->size = half;
+
+	right->prev = leaf;
+	right->next = leaf->next;
+	if (leaf->next != NULL) {
+		leaf->next->prev = right;
+	} else {
+		tree->last = right;
+	}
+	leaf->next = right;
+	return right;
+}
+
+/*
+* Adds a child that was split off the child at index slot of an inner node, with
+* the key separating the two. leaves is true if the children are leaves. If the
+* inner node is full it is split first, the new right half is returned and
+* *upKey is set to the key separating the halves. Returns NULL otherwise.
+*/
+static struct binner *btreeInsertChild(struct binner *inner, int slot, int key,
+void *child, bool leaves, int *upKey) {
+	struct binner *target = inner;
+	struct binner *right = NULL;
+
+	if (inner->size == BTREE_KEYS) {
+		//the left half keeps the keys before the middle one, which moves up,
+		//and the right half gets the keys after it.
+		int half = BTREE_KEYS / 2;
+		right = btreeNewInner();
+		right->size = inner->size - half - 1;
+		for (int i = 0; i < right->size; i++) {
+			right->keys[i] = inner->keys[half + 1 + i];
+		}
+		for (int i = 0; i <= right->size; i++) {
+			right->children[i] = inner->children[half + 1 + i];
+			right->childSizes[i] = inner->childSizes[half + 1 + i];
+			right->childCounts[i] = inner->childCounts[half + 1 + i];
+		}
+		*upKey = inner->keys[half];
+		inner->size = half;
+
+		if (slot > half) {
+			target = right;
+			slot -= half + 1;
+		}
+	}
+
+	for (int i = target->size; i > slot; i--) {
+		target->keys[i] = target->keys[i - 1];
+	}
+	for (int i = target->size + 1; i > slot + 1; i--) {
+		target->children[i] = target->children[i - 1];
+		target->childSizes[i] = target->childSizes[i - 1];
+		target->childCounts[i] = target->childCounts[i - 1];
+	}
+	target->keys[slot] = key;
+	target->children[slot + 1] = child;
+	btreeTotals(child, leaves, &target->childSizes[slot + 1],
+	&target->childCounts[slot + 1]);
+	target->size++;
+	return right;
+}
+
+/*
+* Computes the number of elements and the sum of the counts under a node, which
+* is a leaf if leaves is true and an inner node otherwise.
+*/
+static void btreeTotals(void *node, bool leaves, int *size, int *count) {
+	*size = 0;
+	*count = 0;
+	if (leaves) {
+		struct bleaf *leaf = node;
+		*size = leaf->size;
+		for (int i = 0; i < leaf->size; i++) {
+			*count += leaf->counts[i];
+		}
+		return;
+	}
+
+	struct binner *inner = node;
+	for (int i = 0; i <= inner->size; i++) {
+		*size += inner->childSizes[i];
+		*count += inner->childCounts[i];
+	}
+}
+
+/*
+* Merges a sorted batch of distinct items with the elements of the B+ tree of
+* the multiset and rebuilds the tree from the result, which takes
+* O(size + n) time.
+*/
+static void btreeInsertBatch(Mset s, struct item *batch, int n) {
+	struct item *items = malloc((s->size + n) * sizeof(struct item));
+	if (items == NULL) {
+		printNullError();
+	}
+
+	int size = 0;
+	int i = 0;
+	for (struct bleaf *leaf = s->btree->first; leaf != NULL;
+		leaf = leaf->next) {
+		for (int j = 0; j < leaf->size; j++) {
+			int elem = leaf->elems[j];
+			for (; i < n && batch[i].elem < elem; i++) {
+				items[size++] = batch[i];
+				s->size++;
+				countChanged(s, batch[i].elem, 0, batch[i].count);
+			}
+
+			items[size] = (struct item){elem, leaf->counts[j]};
+			if (i < n && batch[i].elem == elem) {
+				countChanged(s, elem, items[size].count,
+				items[size].count + batch[i].count);
+				items[size].count += batch[i].count;
+				i++;
+			}
+			size++;
+		}
+	}
+	for (; i < n; i++) {
+		items[size++] = batch[i];
+		s->size++;
+		countChanged(s, batch[i].elem, 0, batch[i].count);
+	}
+
+	for (i = 0; i < n; i++) {
+		s->totalCount += batch[i].count;
+	}
+	btreeClear(s->btree);
+	btreeLoad(s->btree, items, size);
+	free(items);
+}
+
+/*
+* Builds the empty tree out of n items in strictly increasing order of element
+* in O(n) time. The items are spread evenly over leaves that are three quarters
+* full, and each level of inner nodes is built over the level below the same
+* way until a single root is left.
+*/
+static void btreeLoad(struct btree *tree, struct item *items, int n) {
+	if (n == 0) {
+		return;
+	}
+
+	int count = (n + BTREE_FILL - 1) / BTREE_FILL;
+	void **nodes = malloc(count * sizeof(void *));
+	int *mins = malloc(count * sizeof(int));
+	if (nodes == NULL || mins == NULL) {
+		printNullError();
+	}
+
+	struct bleaf *prev = NULL;
+	for (int i = 0; i < count; i++) {
+		int from = (long long)n * i / count;
+		int to = (long long)n * (i + 1) / count;
+		struct bleaf *leaf = btreeNewLeaf();
+		leaf->size = to - from;
+		for (int j = from; j < to; j++) {
+			leaf->elems[j - from] = items[j].elem;
+			leaf->counts[j - from] = items[j].count;
+		}
+
+		leaf->prev = prev;
+		if (prev != NULL) {
+			prev->next = leaf;
+		} else {
+			tree->first = leaf;
+		}
+		prev = leaf;
+		nodes[i] = leaf;
+		mins[i] = items[from].elem;
+	}
+	tree->last = prev;
+
+	//the nodes of the new level are stored over the start of the level below,
+	//which is never ahead of the nodes still to be read.
+	bool leaves = true;
+	while (count > 1) {
+		int parents = (count + BTREE_FILL) / (BTREE_FILL + 1);
+		for (int i = 0; i < parents; i++) {
+			int from = (long long)count * i / parents;
+			int to = (long long)count * (i + 1) / parents;
+			struct binner *inner = btreeNewInner();
+			inner->size = to - from - 1;
+			for (int j = from; j < to; j++) {
+				inner->children[j - from] = nodes[j];
+				btreeTotals(nodes[j], leaves, &inner->childSizes[j - from],
+				&inner->childCounts[j - from]);
+				if (j > from) {
+					inner->keys[j - from - 1] = mins[j];
+				}
+			}
+			nodes[i] = inner;
+			mins[i] = mins[from];
+		}
+		count = parents;
+		leaves = false;
+		tree->height++;
+	}
+
+	tree->root = nodes[0];
+	free(nodes);
+	free(mins);
+}
+
+/*
+* Deletes the given amount of an item from the B+ tree of the multiset. Empty
+* leaves are removed, and a leaf that drops below a quarter full is merged with
+* a neighbour under the same parent if they fit together in three quarters of a
+* leaf. Inner nodes are only removed once they have no children left.
+*/
+static void btreeDelete(Mset s, int item, int amount) {
+	struct btree *tree = s->btree;
+	if (tree->root == NULL) {
+		return;
+	}
+
+	struct binner *path[BTREE_MAX_HEIGHT];
+	int slots[BTREE_MAX_HEIGHT];
+	struct bleaf *leaf = btreeDescend(tree, item, path, slots);
+	int slot = btreeSlot(leaf->elems, leaf->size, item, false);
+	if (slot == leaf->size || leaf->elems[slot] != item) {
+		return;
+	}
+
+	int count = leaf->counts[slot];
+	int removed = count > amount ? amount : count;
+	countChanged(s, item, count, count - removed);
+	s->totalCount -= removed;
+	for (int depth = 0; depth < tree->height; depth++) {
+		path[depth]->childCounts[slots[depth]] -= removed;
+	}
+	if (count > removed) {
+		leaf->counts[slot] -= removed;
+		return;
+	}
+
+	s->size--;
+	for (int depth = 0; depth < tree->height; depth++) {
+		path[depth]->childSizes[slots[depth]]--;
+	}
+	leaf->size--;
+	for (int i = slot; i < leaf->size; i++) {
+		leaf->elems[i] = leaf->elems[i + 1];
+		leaf->counts[i] = leaf->counts[i + 1];
+	}
+
+	if (leaf->size < BTREE_KEYS / 4) {
+		btreeFixLeaf(tree, leaf, path, slots);
+	}
+}
+
+/*
+* Removes a leaf that has become empty, or merges a leaf that is less than a
+* quarter full with its left or right neighbour under the same parent if both
+* fit in three quarters of a leaf. path and slots hold the way down to the leaf.
+*/
+static void btreeFixLeaf(struct btree *tree, struct bleaf *leaf,
+struct binner *path[], int slots[]) {
+	int depth = tree->height - 1;
+	if (leaf->size == 0) {
+		btreeUnlinkLeaf(tree, leaf);
+		free(leaf);
+		if (depth < 0) {
+			//the leaf was the root.
+			tree->root = NULL;
+		} else {
+			btreeRemoveChild(tree, path, slots, depth, slots[depth]);
+		}
+		return;
+	}
+
+	if (depth < 0 || path[depth]->size == 0) {
+		return;
+	}
+
+	//the leaf is merged into its left neighbour if it has one, and its right
+	//neighbour is merged into it otherwise.
+	struct binner *parent = path[depth];
+	int left = slots[depth] > 0 ? slots[depth] - 1 : 0;
+	struct bleaf *leftLeaf = parent->children[left];
+	struct bleaf *rightLeaf = parent->children[left + 1];
+	if (leftLeaf->size + rightLeaf->size > BTREE_FILL) {
+		return;
+	}
+
+	for (int i = 0; i < rightLeaf->size; i++) {
+		leftLeaf->elems[leftLeaf->size + i] = rightLeaf->elems[i];
+		leftLeaf->counts[leftLeaf->size + i] = rightLeaf->counts[i];
+	}
+	leftLeaf->size += rightLeaf->size;
+	parent->childSizes[left] += parent->childSizes[left + 1];
+	parent->childCounts[left] += parent->childCounts[left + 1];
+
+	btreeUnlinkLeaf(tree, rightLeaf);
+	free(rightLeaf);
+	btreeRemoveChild(tree, path, slots, depth, left + 1);
+}
+
+/*
+* Removes the child at the given index from the inner node at the given depth of
+* the path, after the child has been freed. An inner node that is left without
+* children is removed from its own parent in turn, and a root with a single
+* child is replaced by that child.
+*/
+static void btreeRemoveChild(struct btree *tree, struct binner *path[],
+int slots[], int depth, int child) {
+	//an inner node whose only child goes is removed as well.
+	while (path[depth]->size == 0) {
+		free(path[depth]);
+		if (depth == 0) {
+			tree->root = NULL;
+			tree->height = 0;
+			return;
+		}
+		depth--;
+		child = slots[depth];
+	}
+
+	//the key between the child and its left neighbour goes with it, or the
+	//key after it for the first child.
+	struct binner *inner = path[depth];
+	int key = child > 0 ? child - 1 : 0;
+	for (int i = key; i < inner->size - 1; i++) {
+		inner->keys[i] = inner->keys[i + 1];
+	}
+	for (int i = child; i < inner->size; i++) {
+		inner->children[i] = inner->children[i + 1];
+		inner->childSizes[i] = inner->childSizes[i + 1];
+		inner->childCounts[i] = inner->childCounts[i + 1];
+	}
+	inner->size--;
+
+	while (tree->height > 0 && ((struct binner *)tree->root)->size == 0) {
+		struct binner *root = tree->root;
+		tree->root = root->children[0];
+		tree->height--;
+		free(root);
+	}
+}
+
+/*
+* Removes a leaf from the chain of leaves, updating the first and last leaves
+* of the tree if needed.
+*/
+static void btreeUnlinkLeaf(struct btree *tree, struct bleaf *leaf) {
+	if (leaf->prev != NULL) {
+		leaf->prev->next = leaf->next;
+	} else {
+		tree->first = leaf->next;
+	}
+
+	if (leaf->next != NULL) {
+		leaf->next->prev = leaf->prev;
+	} else {
+		tree->last = leaf->prev;
+	}
+}
+
+/*
+* Returns the number of elements in the tree that are smaller than the item.
+*/
+static int btreeRank(struct btree *tree, int item) {
+	void *node = tree->root;
+	if (node == NULL) {
+		return 0;
+	}
+
+	int rank = 0;
+	for (int depth = 0; depth < tree->height; depth++) {
+		struct binner *inner = node;
+		int slot = btreeSlot(inner->keys, inner->size, item, true);
+		for (int i = 0; i < slot; i++) {
+			rank += inner->childSizes[i];
+		}
+		node = inner->children[slot];
+	}
+
+	struct bleaf *leaf = node;
+	return rank + btreeSlot(leaf->elems, leaf->size, item, false);
+}
+
+/*
+* Returns the element with the given index in increasing order and its count,
+* where the index is between 0 and the number of elements - 1.
+*/
+static struct item btreeSelect(struct btree *tree, int index) {
+	void *node = tree->root;
+	for (int depth = 0; depth < tree->height; depth++) {
+		struct binner *inner = node;
+		int child = 0;
+		while (index >= inner->childSizes[child]) {
+			index -= inner->childSizes[child];
+			child++;
+		}
+		node = inner->children[child];
+	}
+
+	struct bleaf *leaf = node;
+	return (struct item){leaf->elems[index], leaf->counts[index]};
+}
+
+/*
+* Returns the element at the given position of the tree written out with each
+* element repeated as many times as its count, and its count, where the
+* position is between 0 and the total count - 1.
+*/
+static struct item btreeSelectByCount(struct btree *tree, int position) {
+	void *node = tree->root;
+	for (int depth = 0; depth < tree->height; depth++) {
+		struct binner *inner = node;
+		int child = 0;
+		while (position >= inner->childCounts[child]) {
+			position -= inner->childCounts[child];
+			child++;
+		}
+		node = inner->children[child];
+	}
+
+	struct bleaf *leaf = node;
+	int i = 0;
+	while (position >= leaf->counts[i]) {
+		position -= leaf->counts[i];
+		i++;
+	}
+	return (struct item){leaf->elems[i], leaf->counts[i]};
+}
+
+/*
+* Returns the sum of the counts of the elements in the tree that are smaller
+* than the given item, or smaller or equal if inclusive is true.
+*/
+static int btreeCountBelow(struct btree *tree, int item, bool inclusive) {
+	void *node = tree->root;
+	if (node == NULL) {
+		return 0;
+	}
+
+	int total = 0;
+	for (int depth = 0; depth < tree->height; depth++) {
+		struct binner *inner = node;
+		int slot = btreeSlot(inner->keys, inner->size, item, true);
+		for (int i = 0; i < slot; i++) {
+			total += inner->childCounts[i];
+		}
+		node = inner->children[slot];
+	}
+
+	struct bleaf *leaf = node;
+	int slot = btreeSlot(leaf->elems, leaf->size, item, inclusive);
+	for (int i = 0; i < slot; i++) {
+		total += leaf->counts[i];
+	}
+	return total;
+}
+
+/*
+* Moves a cursor over a B+ tree to the next element, or to the end. Leaves are
+* never empty, so moving off the end of a leaf lands on the next one's first
+* element.
+*/
+static bool btreeCursorNext(MsetCursor cur) {
+	if (cur->leaf != NULL) {
+		cur->index++;
+		if (cur->index == cur->leaf->size) {
+			cur->leaf = cur->leaf->next;
+			cur->index = 0;
+		}
+	} else if (!cur->atEnd) {
+		//cursor is currently at the start.
+		cur->leaf = cur->s->btree->first;
+		cur->index = 0;
+	}
+
+	if (cur->leaf == NULL) {
+		cur->atEnd = true;
+		return false;
+	}
+	return true;
+}
+
+/*
+* Moves a cursor over a B+ tree forward by up to n elements, n being at least
+* 1, copying them out of the leaves a run at a time. Returns the number of
+* elements stored.
+*/
+static int btreeCursorNextN(MsetCursor cur, int n, struct item items[]) {
+	if (!btreeCursorNext(cur)) {
+		return 0;
+	}
+
+	struct bleaf *leaf = cur->leaf;
+	int index = cur->index;
+	int stored = 0;
+	while (true) {
+		int run = leaf->size - index;
+		if (run > n - stored) {
+			run = n - stored;
+		}
+		for (int i = 0; i < run; i++) {
+			items[stored + i] = (struct item){leaf->elems[index + i],
+			leaf->counts[index + i]};
+		}
+		stored += run;
+		index += run;
+		if (stored == n) {
+			cur->leaf = leaf;
+			cur->index = index - 1;
+			return stored;
+		}
+		leaf = leaf->next;
+		index = 0;
+		if (leaf == NULL) {
+			cur->leaf = NULL;
+			cur->index = 0;
+			cur->atEnd = true;
+			return stored;
+		}
+	}
+}
+
+/*
+* Moves a cursor over a B+ tree to the previous element, or to the start.
+*/
+static bool btreeCursorPrev(MsetCursor cur) {
+	if (cur->leaf != NULL && cur->index > 0) {
+		cur->index--;
+		return true;
+	}
+
+	if (cur->leaf != NULL) {
+		cur->leaf = cur->leaf->prev;
+	} else if (cur->atEnd) {
+		//cursor is currently at the end.
+		cur->leaf = cur->s->btree->last;
+	}
+
+	if (cur->leaf == NULL) {
+		cur->atEnd = false;
+		return false;
+	}
+	cur->index = cur->leaf->size - 1;
+	return true;
+}
+
+/*
+* Moves a cursor over a B+ tree to the first element that is not smaller than
+* the item, or the first element that is greater than the item if after is
+* true. If every element of the leaf the item belongs in is smaller, the answer
+* is the first element of the next leaf.
+*/
+static bool btreeCursorSeek(MsetCursor cur, int item, bool after) {
+	struct btree *tree = cur->s->btree;
+	cur->leaf = NULL;
+	cur->index = 0;
+	if (tree->root != NULL) {
+		struct binner *path[BTREE_MAX_HEIGHT];
+		int slots[BTREE_MAX_HEIGHT];
+		cur->leaf = btreeDescend(tree, item, path, slots);
+		cur->index = btreeSlot(cur->leaf->elems, cur->leaf->size, item, after);
+		if (cur->index == cur->leaf->size) {
+			cur->leaf = cur->leaf->next;
+			cur->index = 0;
+		}
+	}
+
+	cur->atEnd = cur->leaf == NULL;
+	return cur->leaf != NULL;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Lookup Index
+// A copy of the elements and counts laid out as an implicit B-tree of blocks
+// of LOOKUP_BLOCK sorted keys, where block k has children k * 17 + 1 to
+// k * 17 + 17. A block is one cache line and is compared against the item in a
+// couple of vector instructions, so a lookup in a million elements takes five
+// cache misses instead of about twenty for the AVL tree.
+
+/*
+* Creates a lookup index that has not been built yet.
+*/
+static struct lookupIndex *lookupNew(void) {
+	struct lookupIndex *new = malloc(sizeof(struct lookupIndex));
+	if (new == NULL) {
+		printNullError();
+	}
+	new->keys = NULL;
+	new->counts = NULL;
+	new->blocks = 0;
+	new->capacity = 0;
+	new->valid = false;
+	new->pending = 0;
+	return new;
+}
+
+/*
+* Frees a lookup index.
+*/
+static void lookupFree(struct lookupIndex *index) {
+	free(index->keys);
+	free(index->counts);
+	free(index);
+}
+
+/*
+* Returns true if the lookup index of the multiset can answer lookups. An index
+* that is out of date is only rebuilt once there have been size / 8 lookups
+* since the last change, so that the O(n) rebuild is paid for by the lookups
+* it speeds up and a multiset that changes between lookups never rebuilds.
+*/
+static bool lookupReady(Mset s) {
+	struct lookupIndex *index = s->lookup;
+	if (index->valid) {
+		return true;
+	}
+	if (++index->pending < s->size / 8) {
+		return false;
+	}
+	lookupBuild(s);
+	return true;
+}
+
+/*
+* Rebuilds the lookup index of the multiset from its elements in order.
+*/
+static void lookupBuild(Mset s) {
+	struct lookupIndex *index = s->lookup;
+	index->blocks = (s->size + LOOKUP_BLOCK - 1) / LOOKUP_BLOCK;
+	if (index->blocks > index->capacity) {
+		//the blocks are aligned to cache lines so that each is a single load.
+		size_t bytes = (size_t)index->blocks * LOOKUP_BLOCK * sizeof(int);
+		free(index->keys);
+		free(index->counts);
+		index->keys = aligned_alloc(64, bytes);
+		index->counts = malloc(bytes);
+		if (index->keys == NULL || index->counts == NULL) {
+			printNullError();
+		}
+		index->capacity = index->blocks;
+	}
+
+	//threads building their own indexes all wait for the one choice.
+	pthread_once(&lookupSearchChosen, chooseLookupSearch);
+
+	struct cursor cur;
+	struct node *path[MAX_HEIGHT];
+	cursorInit(&cur, s, path);
+	bool more = cursorNext(&cur);
+	lookupFill(index, 0, &cur, &more);
+	index->valid = true;
+	index->pending = 0;
+}
+
+/*
+* Fills block k of the lookup index and the blocks under it in order with the
+* elements from the cursor. *more is false once the cursor has run out, after
+* which the keys are padded with INT_MAX and a count of 0. Since the padding
+* comes after every element, a real element equal to INT_MAX is still found.
+*/
+static void lookupFill(struct lookupIndex *index, int k, struct cursor *cur,
+bool *more) {
+	if (k >= index->blocks) {
+		return;
+	}
+
+	for (int i = 0; i < LOOKUP_BLOCK; i++) {
+		lookupFill(index, k * (LOOKUP_BLOCK + 1) + i + 1, cur, more);
+
+		int slot = k * LOOKUP_BLOCK + i;
+		if (*more) {
+			struct item item = cursorGet(cur);
+			index->keys[slot] = item.elem;
+			index->counts[slot] = item.count;
+			*more = cursorNext(cur);
+		} else {
+			index->keys[slot] = INT_MAX;
+			index->counts[slot] = 0;
+		}
+	}
+	lookupFill(index, k * (LOOKUP_BLOCK + 1) + LOOKUP_BLOCK + 1, cur, more);
+}
+
+/*
+* Returns the count of an item in a lookup index that is up to date, using the
+* given block search. The search goes down one block per level, remembering the
+* smallest key seen so far that is not smaller than the item, which ends up
+* being the item if it is there. It is inlined into a search function for each
+* block search so that the block search is inlined as well.
+*/
+__attribute__((always_inline))
+static inline int lookupGetCount(struct lookupIndex *index, int item,
+int (*blockRank)(const int block[], int item)) {
+	int found = -1;
+	int k = 0;
+	while (k < index->blocks) {
+		int i = blockRank(&index->keys[k * LOOKUP_BLOCK], item);
+		if (i < LOOKUP_BLOCK) {
+			found = k * LOOKUP_BLOCK + i;
+		}
+		k = k * (LOOKUP_BLOCK + 1) + i + 1;
+	}
+
+	if (found >= 0 && index->keys[found] == item) {
+		return index->counts[found];
+	}
+	return 0;
+}
+
+/*
+* Picks the search with the fastest block search the processor supports.
+*/
+static void chooseLookupSearch(void) {
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		lookupSearch = lookupSearchAvx2;
+	} else {
+		lookupSearch = lookupSearchSse2;
+	}
+#else
+	lookupSearch = lookupSearchScalar;
+#endif
+}
+
+#if defined(__x86_64__)
+/*
+* Searches a lookup index with blockRankAvx2.
+*/
+__attribute__((target("avx2")))
+static int lookupSearchAvx2(struct lookupIndex *index, int item) {
+	return lookupGetCount(index, item, blockRankAvx2);
+}
+
+/*
+* Returns the number of keys in a sorted block that are smaller than the item,
+* comparing eight keys per instruction. The keys are sorted, so the mask of the
+* smaller keys is a run of low bits and its length is the first zero bit.
+*/
+__attribute__((target("avx2")))
+static int blockRankAvx2(const int block[], int item) {
+	__m256i items = _mm256_set1_epi32(item);
+	__m256i low = _mm256_load_si256((const __m256i *)block);
+	__m256i high = _mm256_load_si256((const __m256i *)(block + 8));
+	int mask = _mm256_movemask_ps(_mm256_castsi256_ps(
+	_mm256_cmpgt_epi32(items, low)));
+	mask |= _mm256_movemask_ps(_mm256_castsi256_ps(
+	_mm256_cmpgt_epi32(items, high))) << 8;
+	return __builtin_ctz(~mask);
+}
+
+/*
+* Searches a lookup index with blockRankSse2.
+*/
+static int lookupSearchSse2(struct lookupIndex *index, int item) {
+	return lookupGetCount(index, item, blockRankSse2);
+}
+
+/*
+* The same as blockRankAvx2 with four keys per instruction, for processors
+* without AVX2. Every x86-64 processor has SSE2.
+*/
+static int blockRankSse2(const int block[], int item) {
+	__m128i items = _mm_set1_epi32(item);
+	int mask = 0;
+	for (int i = 0; i < LOOKUP_BLOCK / 4; i++) {
+		__m128i keys = _mm_load_si128((const __m128i *)(block + 4 * i));
+		mask |= _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(items, keys)))
+		<< (4 * i);
+	}
+	return __builtin_ctz(~mask);
+}
+#else
+/*
+* Searches a lookup index with blockRankScalar.
+*/
+static int lookupSearchScalar(struct lookupIndex *index, int item) {
+	return lookupGetCount(index, item, blockRankScalar);
+}
+
+/*
+* Returns the number of keys in a sorted block that are smaller than the item,
+* one key at a time.
+*/
+static int blockRankScalar(const int block[], int item) {
+	int rank = 0;
+	for (int i = 0; i < LOOKUP_BLOCK; i++) {
+		rank += block[i] < item;
+	}
+	return rank;
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////
+// Dense Multisets
+// A multiset made by MsetNewDense keeps the count of every element from lo to
+// hi in a flat array, with a bitmap of the elements that are present so that
+// cursors can skip over empty runs 64 elements at a time.
+
+/*
+* Creates the array and bitmap of a dense multiset for elements from lo to hi.
+*/
+static struct dense *denseNew(int lo, int hi) {
+	struct dense *new = malloc(sizeof(struct dense));
+	if (new == NULL) {
+		printNullError();
+	}
+	new->lo = lo;
+	new->hi = hi;
+	new->counts = calloc(denseRange(new), sizeof(int));
+	new->bits = calloc((denseRange(new) + 63) / 64, sizeof(uint64_t));
+	if (new->counts == NULL || new->bits == NULL) {
+		printNullError();
+	}
+	return new;
+}
+
+/*
+* Frees the array and bitmap of a dense multiset.
+*/
+static void denseFree(struct dense *dense) {
+	free(dense->counts);
+	free(dense->bits);
+	free(dense);
+}
+
+/*
+* Returns the number of elements a dense multiset has room for.
+*/
+static int denseRange(struct dense *dense) {
+	return dense->hi - dense->lo + 1;
+}
+
+/*
+* Checks if the item is in the range of elements of a dense multiset.
+*/
+static bool denseContains(struct dense *dense, int item) {
+	return item >= dense->lo && item <= dense->hi;
+}
+
+/*
+* Checks if two multisets are dense over the same range of elements, so that
+* they can be combined slot by slot.
+*/
+static bool denseMatch(Mset s1, Mset s2) {
+	return s1->kind == KIND_DENSE && s2->kind == KIND_DENSE &&
+	s1->dense->lo == s2->dense->lo && s1->dense->hi == s2->dense->hi;
+}
+
+/*
+* Inserts the given amount of an item in the range of a dense multiset.
+* totalCount is kept by the caller.
+*/
+static void denseInsert(Mset s, int item, int amount) {
+	struct dense *dense = s->dense;
+	int slot = item - dense->lo;
+	if (dense->counts[slot] == 0) {
+		dense->bits[slot / 64] |= 1ULL << (slot % 64);
+		s->size++;
+	}
+	countChanged(s, item, dense->counts[slot], dense->counts[slot] + amount);
+	dense->counts[slot] += amount;
+}
+
+/*
+* Deletes the given amount of an item from a dense multiset.
+*/
+static void denseDelete(Mset s, int item, int amount) {
+	struct dense *dense = s->dense;
+	if (!denseContains(dense, item) || dense->counts[item - dense->lo] == 0) {
+		return;
+	}
+
+	int slot = item - dense->lo;
+	int count = dense->counts[slot];
+	int removed = count > amount ? amount : count;
+	countChanged(s, item, count, count - removed);
+	dense->counts[slot] -= removed;
+	s->totalCount -= removed;
+	if (dense->counts[slot] == 0) {
+		dense->bits[slot / 64] &= ~(1ULL << (slot % 64));
+		s->size--;
+	}
+}
+
+/*
+* Moves the elements of a dense multiset into an AVL tree, which happens when
+* an element outside its range is inserted.
+*/
+static void denseToTree(Mset s) {
+	struct item *items = malloc((s->size + 1) * sizeof(struct item));
+	if (items == NULL) {
+		printNullError();
+	}
+
+	struct cursor cur;
+	cursorInit(&cur, s, NULL);
+	int n = 0;
+	while (cursorNext(&cur)) {
+		items[n++] = cursorGet(&cur);
+	}
+
+	//the items are loaded into the multiset as if it were new.
+	denseFree(s->dense);
+	s->dense = NULL;
+	s->kind = KIND_AVL;
+	s->size = 0;
+	s->totalCount = 0;
+	s->hash = 0;
+	loadItems(s, items, n);
+	free(items);
+}
+
+/*
+* Stores the combination of two dense multisets over the same range in the
+* empty dense multiset result, one slot at a time. The loop over the counts has
+* no branches, so the compiler can do several slots per instruction.
+*/
+static void denseMerge(Mset result, Mset s1, Mset s2, int op) {
+	int range = denseRange(result->dense);
+	int *counts = result->dense->counts;
+	const int *counts1 = s1->dense->counts;
+	const int *counts2 = s2->dense->counts;
+
+	//the common operations keep loops of their own, which the compiler can
+	//vectorise.
+	if (op == MERGE_UNION) {
+		for (int i = 0; i < range; i++) {
+			counts[i] = counts1[i] > counts2[i] ? counts1[i] : counts2[i];
+		}
+	} else if (op == MERGE_INTERSECTION) {
+		for (int i = 0; i < range; i++) {
+			counts[i] = counts1[i] < counts2[i] ? counts1[i] : counts2[i];
+		}
+	} else {
+		for (int i = 0; i < range; i++) {
+			counts[i] = mergeCount(op, counts1[i], counts2[i]);
+		}
+	}
+
+	for (int i = 0; i < range; i++) {
+		if (counts[i] > 0) {
+			result->dense->bits[i / 64] |= 1ULL << (i % 64);
+			result->size++;
+			result->totalCount += counts[i];
+			countChanged(result, result->dense->lo + i, 0, counts[i]);
+		}
+	}
+}
+
+/*
+* Returns the first slot from the given one onwards that holds an element, or
+* -1 if there is none. Whole words of the bitmap are skipped at a time and the
+* set bit is found with a count of trailing zeros.
+*/
+static int denseNextSlot(struct dense *dense, int from) {
+	int words = (denseRange(dense) + 63) / 64;
+	if (from >= denseRange(dense)) {
+		return -1;
+	}
+
+	int word = from / 64;
+	uint64_t bits = dense->bits[word] & (~0ULL << (from % 64));
+	while (bits == 0) {
+		if (++word == words) {
+			return -1;
+		}
+		bits = dense->bits[word];
+	}
+	return word * 64 + __builtin_ctzll(bits);
+}
+
+/*
+* Returns the last slot up to and including the given one that holds an
+* element, or -1 if there is none.
+*/
+static int densePrevSlot(struct dense *dense, int from) {
+	if (from < 0) {
+		return -1;
+	}
+
+	int word = from / 64;
+	uint64_t bits = dense->bits[word] & (~0ULL >> (63 - from % 64));
+	while (bits == 0) {
+		if (word-- == 0) {
+			return -1;
+		}
+		bits = dense->bits[word];
+	}
+	return word * 64 + 63 - __builtin_clzll(bits);
+}
+
+/*
+* Returns the slot of the first element that is not smaller than the item, or
+* that is greater than the item if after is true, as a number of slots from lo
+* that may be past the end of the range.
+*/
+static long long denseSlotOf(struct dense *dense, int item, bool after) {
+	long long slot = (long long)item - dense->lo + after;
+	return slot < 0 ? 0 : slot;
+}
+
+/*
+* Returns the number of elements of a dense multiset that are smaller than the
+* item, counting the set bits before its slot.
+*/
+static int denseRank(struct dense *dense, int item) {
+	long long end = denseSlotOf(dense, item, false);
+	if (end > denseRange(dense)) {
+		end = denseRange(dense);
+	}
+
+	int rank = 0;
+	for (int word = 0; word < end / 64; word++) {
+		rank += __builtin_popcountll(dense->bits[word]);
+	}
+	if (end % 64 != 0) {
+		rank += __builtin_popcountll(dense->bits[end / 64] &
+		((1ULL << (end % 64)) - 1));
+	}
+	return rank;
+}
+
+/*
+* Returns the element with the given index in increasing order of a dense
+* multiset and its count, where the index is between 0 and size - 1.
+*/
+static struct item denseSelect(struct dense *dense, int index) {
+	int word = 0;
+	while (index >= __builtin_popcountll(dense->bits[word])) {
+		index -= __builtin_popcountll(dense->bits[word]);
+		word++;
+	}
+
+	//clears the lowest set bits of the word until the one wanted is lowest.
+	uint64_t bits = dense->bits[word];
+	for (int i = 0; i < index; i++) {
+		bits &= bits - 1;
+	}
+	int slot = word * 64 + __builtin_ctzll(bits);
+	return (struct item){dense->lo + slot, dense->counts[slot]};
+}
+
+/*
+* Returns the element at the given position of a dense multiset written out
+* with each element repeated as many times as its count, and its count, where
+* the position is between 0 and totalCount - 1.
+*/
+static struct item denseSelectByCount(struct dense *dense, int position) {
+	int slot = 0;
+	while (position >= dense->counts[slot]) {
+		position -= dense->counts[slot];
+		slot++;
+	}
+	return (struct item){dense->lo + slot, dense->counts[slot]};
+}
+
+/*
+* Returns the sum of the counts of the elements of a dense multiset that are
+* smaller than the given item, or smaller or equal if inclusive is true.
+*/
+static int denseCountBelow(struct dense *dense, int item, bool inclusive) {
+	long long end = denseSlotOf(dense, item, inclusive);
+	if (end > denseRange(dense)) {
+		end = denseRange(dense);
+	}
+
+	int total = 0;
+	for (int slot = 0; slot < end; slot++) {
+		total += dense->counts[slot];
+	}
+	return total;
+}
+
+/*
+* Moves a cursor over a dense multiset to the next element, or to the end.
+*/
+static bool denseCursorNext(MsetCursor cur) {
+	if (cur->index >= 0) {
+		cur->index = denseNextSlot(cur->s->dense, cur->index + 1);
+	} else if (!cur->atEnd) {
+		//cursor is currently at the start.
+		cur->index = denseNextSlot(cur->s->dense, 0);
+	}
+
+	if (cur->index < 0) {
+		cur->atEnd = true;
+		return false;
+	}
+	return true;
+}
+
+/*
+* Moves a cursor over a dense multiset forward by up to n elements, n being at
+* least 1, taking the set bits of each word of the bitmap in turn. Returns the
+* number of elements stored.
+*/
+static int denseCursorNextN(MsetCursor cur, int n, struct item items[]) {
+	struct dense *dense = cur->s->dense;
+	if (cur->index < 0 && cur->atEnd) {
+		return 0;
+	}
+
+	int range = denseRange(dense);
+	int words = (range + 63) / 64;
+	int from = cur->index + 1;
+	int last = cur->index;
+	int stored = 0;
+	if (from < range) {
+		int word = from / 64;
+		uint64_t bits = dense->bits[word] & (~0ULL << (from % 64));
+		while (true) {
+			for (; bits != 0 && stored < n; bits &= bits - 1) {
+				last = word * 64 + __builtin_ctzll(bits);
+				items[stored++] = (struct item){dense->lo + last,
+				dense->counts[last]};
+			}
+			if (stored == n || ++word == words) {
+				break;
+			}
+			bits = dense->bits[word];
+		}
+	}
+
+	//running out of elements leaves the cursor at the end.
+	if (stored < n) {
+		last = -1;
+		cur->atEnd = true;
+	}
+	cur->index = last;
+	return stored;
+}
+
+/*
+* Moves a cursor over a dense multiset to the previous element, or to the
+* start.
+*/
+static bool denseCursorPrev(MsetCursor cur) {
+	struct dense *dense = cur->s->dense;
+	if (cur->index >= 0) {
+		cur->index = densePrevSlot(dense, cur->index - 1);
+	} else if (cur->atEnd) {
+		//cursor is currently at the end.
+		cur->index = densePrevSlot(dense, denseRange(dense) - 1);
+	}
+
+	if (cur->index < 0) {
+		cur->atEnd = false;
+		return false;
+	}
+	return true;
+}
+
+/*
+* Moves a cursor over a dense multiset to the first element that is not smaller
+* than the item, or that is greater than the item if after is true.
+*/
+static bool denseCursorSeek(MsetCursor cur, int item, bool after) {
+	struct dense *dense = cur->s->dense;
+	long long slot = denseSlotOf(dense, item, after);
+	cur->index = slot < denseRange(dense) ? denseNextSlot(dense, slot) : -1;
+	cur->atEnd = cur->index < 0;
+	return cur->index >= 0;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Concurrency
+// A multiset made with MSET_CONCURRENT is locked with one mutex for changes and
+// SYNC_SLOTS counts of readers, each on its own cache line. A thread reads
+// under the slot it was handed: it adds itself to that slot's count and goes
+// ahead if no change is under way, so readers in different slots never write
+// to the same cache line and scale with the cores. A change takes the mutex,
+// marks that it is writing, which makes new readers wait on the mutex, and
+// waits for every slot's count to fall to 0. Both sides use sequentially
+// consistent atomics, so either the reader sees the change's mark or the change
+// sees the reader's count. Every change also moves the version on, which a
+// cursor keeps between moves: the cursor's node may have been deleted while it
+// was not reading, so if the version has moved on, the cursor finds its element
+// again before it moves. The size and total count are also stored atomically
+// as each change ends, so MsetSize and MsetTotalCount read them without
+// locking.
+
+// The slot that the next thread to read is handed, and the slot of the calling
+// thread, or -1 until it first reads.
+static int nextSlot = 0;
+static __thread int threadSlot = -1;
+
+/*
+* Creates the locks and version of a concurrent multiset.
+*/
+static struct msetSync *syncNew(void) {
+	struct msetSync *sync = aligned_alloc(_Alignof(struct syncSlot),
+	sizeof(struct msetSync) + SYNC_SLOTS * sizeof(struct syncSlot));
+	if (sync == NULL) {
+		printNullError();
+	}
+	pthread_mutex_init(&sync->lock, NULL);
+	sync->writing = 0;
+	for (int i = 0; i < SYNC_SLOTS; i++) {
+		sync->slots[i].readers = 0;
+	}
+	sync->version = 0;
+	sync->size = 0;
+	sync->totalCount = 0;
+	return sync;
+}
+
+/*
+* Frees the locks and version of a concurrent multiset.
+*/
+static void syncFree(struct msetSync *sync) {
+	pthread_mutex_destroy(&sync->lock);
+	free(sync);
+}
+
+/*
+* Returns the count of readers of a concurrent multiset that the calling thread
+* reads under, handing the thread the next slot on its first read.
+*/
+static int *threadReaders(Mset s) {
+	if (threadSlot < 0) {
+		threadSlot = __atomic_fetch_add(&nextSlot, 1, __ATOMIC_RELAXED) %
+		SYNC_SLOTS;
+	}
+	return &s->sync->slots[threadSlot].readers;
+}
+
+/*
+* Locks the multiset for a change and moves its version on. If the multiset is
+* not concurrent, moves its epoch on instead, which its cursors check.
+*/
+static void writeLock(Mset s) {
+	if (s->sync != NULL) {
+		pthread_mutex_lock(&s->sync->lock);
+		__atomic_store_n(&s->sync->writing, 1, __ATOMIC_SEQ_CST);
+		for (int i = 0; i < SYNC_SLOTS; i++) {
+			while (__atomic_load_n(&s->sync->slots[i].readers,
+				__ATOMIC_SEQ_CST) > 0) {
+				sched_yield();
+			}
+		}
+		s->sync->version++;
+	} else {
+		s->epoch++;
+	}
+}
+
+/*
+* Stores the size and total count of a concurrent multiset where MsetSize and
+* MsetTotalCount read them without the lock. The multiset must be locked for
+* writing or not yet shared with other threads.
+*/
+static void syncPublish(Mset s) {
+	__atomic_store_n(&s->sync->size, s->size, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->sync->totalCount, s->totalCount, __ATOMIC_RELAXED);
+}
+
+/*
+* Unlocks a multiset locked by writeLock.
+*/
+static void writeUnlock(Mset s) {
+	if (s->sync != NULL) {
+		syncPublish(s);
+		__atomic_store_n(&s->sync->writing, 0, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&s->sync->lock);
+	}
+}
+
+/*
+* Locks the multiset for reading under the calling thread's slot, waiting for
+* a change that is under way to end. Does nothing if the multiset is not
+* concurrent.
+*/
+static void readLock(Mset s) {
+	if (s->sync == NULL) {
+		return;
+	}
+	int *readers = threadReaders(s);
+	while (true) {
+		__atomic_fetch_add(readers, 1, __ATOMIC_SEQ_CST);
+		if (!__atomic_load_n(&s->sync->writing, __ATOMIC_SEQ_CST)) {
+			return;
+		}
+		//the change may be waiting for this thread to leave, and holds the
+		//mutex until it ends.
+		__atomic_fetch_sub(readers, 1, __ATOMIC_RELEASE);
+		pthread_mutex_lock(&s->sync->lock);
+		pthread_mutex_unlock(&s->sync->lock);
+	}
+}
+
+/*
+* Unlocks a multiset locked by readLock.
+*/
+static void readUnlock(Mset s) {
+	if (s->sync != NULL) {
+		__atomic_fetch_sub(threadReaders(s), 1, __ATOMIC_RELEASE);
+	}
+}
+
+/*
+* Locks two multisets for reading, in order of address so that two threads
+* locking the same pair cannot wait on each other. A multiset given twice is
+* only locked once.
+*/
+static void readLockPair(Mset s1, Mset s2) {
+	if (s1 == s2) {
+		readLock(s1);
+	} else if ((uintptr_t)s1 < (uintptr_t)s2) {
+		readLock(s1);
+		readLock(s2);
+	} else {
+		readLock(s2);
+		readLock(s1);
+	}
+}
+
+/*
+* Unlocks two multisets locked by readLockPair.
+*/
+static void readUnlockPair(Mset s1, Mset s2) {
+	readUnlock(s1);
+	if (s1 != s2) {
+		readUnlock(s2);
+	}
+}
+
+/*
+* Moves a cursor of a concurrent multiset to the next element, or the previous
+* one if forward is false, and keeps a copy of that element in the cursor. If
+* the multiset has changed since the cursor last moved, the cursor's node may
+* have been deleted, so it is found again from the element the cursor kept.
+*/
+static bool syncCursorMove(MsetCursor cur, bool forward) {
+	readLock(cur->s);
+	syncCursorRecover(cur, forward);
+	bool moved = forward ? cursorNext(cur) : cursorPrev(cur);
+	cur->item = cursorGet(cur);
+	cur->version = cur->s->sync->version;
+	readUnlock(cur->s);
+	return moved;
+}
+
+/*
+* Finds the node of a cursor of a concurrent multiset again if the multiset
+* has changed since the cursor last moved, or if the element is gone, puts the
+* cursor where the next move in the given direction lands on the right
+* element. The multiset must be locked.
+*/
+static void syncCursorRecover(MsetCursor cur, bool forward) {
+	if (cur->curr == NULL || cur->version == cur->s->sync->version) {
+		return;
+	}
+	struct node *node = bstLowerBound(cur->s->tree, cur->item.elem, false);
+	if (node != NULL && node->elem == cur->item.elem) {
+		cur->curr = node;
+	} else if (forward) {
+		//the element is gone, so the cursor is put just before the
+		//element that followed it.
+		cur->curr = node != NULL ? node->prev : cur->s->listEnd;
+		cur->atEnd = false;
+	} else {
+		//or just after the element that preceded it.
+		cur->curr = node;
+		cur->atEnd = node == NULL;
+	}
+}
+
+/*
+* Returns the element a cursor of a concurrent multiset is on with its count
+* now, or as it was when the cursor reached it if it has been deleted.
+*/
+static struct item syncCursorGet(MsetCursor cur) {
+	readLock(cur->s);
+	struct item item = cur->item;
+	if (cur->version != cur->s->sync->version) {
+		item = staleCursorGet(cur);
+	}
+	readUnlock(cur->s);
+	return item;
+}
+
+/*
+* Seeks a cursor of a concurrent multiset under the lock and keeps a copy of
+* the element it lands on.
+*/
+static bool syncCursorSeek(MsetCursor cur, int item, bool after) {
+	readLock(cur->s);
+	bool found = cursorSeek(cur, item, after);
+	cur->item = cursorGet(cur);
+	cur->version = cur->s->sync->version;
+	readUnlock(cur->s);
+	return found;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Sharded Multisets
+// A multiset made by MsetNewSharded cuts the elements from lo to hi into
+// equal ranges and keeps each range in its own concurrent multiset, so writers
+// of different ranges take different locks. Since the ranges are in order,
+// cursors and the order statistics go through the shards one after another.
+// The other whole-set operations work shard by shard on two multisets that
+// were split the same way, and on a copy of the elements otherwise.
+
+/*
+* Creates a sharded multiset of n shards over lo to hi without creating the
+* shards themselves.
+*/
+static Mset shardsNew(int n, int lo, int hi) {
+	Mset new = MsetNew();
+	new->kind = KIND_SHARDED;
+	new->shards = malloc(sizeof(struct shards) + n * sizeof(Mset));
+	if (new->shards == NULL) {
+		printNullError();
+	}
+	new->shards->n = n;
+	new->shards->lo = lo;
+	new->shards->hi = hi;
+	return new;
+}
+
+/*
+* Frees every shard of a sharded multiset.
+*/
+static void shardsFree(struct shards *shards) {
+	for (int i = 0; i < shards->n; i++) {
+		MsetFree(shards->parts[i]);
+	}
+	free(shards);
+}
+
+/*
+* Returns the index of the shard that holds the item.
+*/
+static int shardIndex(struct shards *shards, int item) {
+	if (item <= shards->lo) {
+		return 0;
+	}
+	if (item >= shards->hi) {
+		return shards->n - 1;
+	}
+	return (int)(((long long)item - shards->lo) * shards->n /
+	((long long)shards->hi - shards->lo + 1));
+}
+
+/*
+* Returns the shard that holds the item.
+*/
+static Mset shardFor(Mset s, int item) {
+	return s->shards->parts[shardIndex(s->shards, item)];
+}
+
+/*
+* Returns the sum of the sizes of the shards, or of their total counts if total
+* is true, read from the copies each shard stores as its changes end so that
+* no shard is locked.
+*/
+static int shardsTotal(Mset s, bool total) {
+	int sum = 0;
+	for (int i = 0; i < s->shards->n; i++) {
+		struct msetSync *sync = s->shards->parts[i]->sync;
+		sum += total ? __atomic_load_n(&sync->totalCount, __ATOMIC_RELAXED)
+		: __atomic_load_n(&sync->size, __ATOMIC_RELAXED);
+	}
+	return sum;
+}
+
+/*
+* Inserts a batch of items into a sharded multiset, locking each shard once for
+* all of the items that belong to it.
+*/
+static void shardsInsertItems(Mset s, struct item *batch, int n) {
+	qsort(batch, n, sizeof(struct item), compareElems);
+	int start = 0;
+	while (start < n) {
+		int shard = shardIndex(s->shards, batch[start].elem);
+		int end = start + 1;
+		while (end < n && shardIndex(s->shards, batch[end].elem) == shard) {
+			end++;
+		}
+
+		Mset part = s->shards->parts[shard];
+		if (part->kind != KIND_SNAPSHOT) {
+			writeLock(part);
+			doMsetInsertItems(part, batch + start, end - start);
+			writeUnlock(part);
+		}
+		start = end;
+	}
+}
+
+/*
+* Checks if two multisets are both sharded, and split the same way.
+*/
+static bool shardsMatch(Mset s1, Mset s2) {
+	return s1->kind == KIND_SHARDED && s2->kind == KIND_SHARDED &&
+	s1->shards->n == s2->shards->n && s1->shards->lo == s2->shards->lo &&
+	s1->shards->hi == s2->shards->hi;
+}
+
+/*
+* Returns an ordinary multiset with the elements of a sharded multiset. Every
+* shard is locked for reading while it is copied, so the copy is the state of
+* all the shards at one time.
+*/
+static Mset shardsFlatten(Mset s) {
+	struct shards *shards = s->shards;
+	int size = 0;
+	for (int i = 0; i < shards->n; i++) {
+		readLock(shards->parts[i]);
+		size += shards->parts[i]->size;
+	}
+
+	struct item *items = malloc((size + 1) * sizeof(struct item));
+	if (items == NULL) {
+		printNullError();
+	}
+	int n = 0;
+	for (int i = 0; i < shards->n; i++) {
+		struct cursor cur;
+		struct node *path[MAX_HEIGHT];
+		cursorInit(&cur, shards->parts[i], path);
+		while (cursorNext(&cur)) {
+			items[n++] = cursorGet(&cur);
+		}
+		readUnlock(shards->parts[i]);
+	}
+
+	Mset flat = MsetNew();
+	loadItems(flat, items, n);
+	free(items);
+	return flat;
+}
+
+/*
+* Applies a set operation such as MsetUnion to two multisets of which at least
+* one is sharded. The result is split the same way if both are split the same
+* way, and is an ordinary multiset otherwise.
+*/
+static Mset shardsSetOp(Mset s1, Mset s2, Mset (*op)(Mset, Mset)) {
+	if (shardsMatch(s1, s2)) {
+		struct shards *shards = s1->shards;
+		Mset result = shardsNew(shards->n, shards->lo, shards->hi);
+		for (int i = 0; i < shards->n; i++) {
+			result->shards->parts[i] = op(shards->parts[i],
+			s2->shards->parts[i]);
+		}
+		return result;
+	}
+
+	Mset flat1 = s1->kind == KIND_SHARDED ? shardsFlatten(s1) : s1;
+	Mset flat2 = s2->kind == KIND_SHARDED ? shardsFlatten(s2) : s2;
+	Mset result = op(flat1, flat2);
+	if (flat1 != s1) {
+		MsetFree(flat1);
+	}
+	if (flat2 != s2) {
+		MsetFree(flat2);
+	}
+	return result;
+}
+
+/*
+* Applies MsetIncluded or MsetEquals to two multisets of which at least one is
+* sharded, shard by shard if both are split the same way.
+*/
+static bool shardsTest(Mset s1, Mset s2, bool (*test)(Mset, Mset)) {
+	if (shardsMatch(s1, s2)) {
+		for (int i = 0; i < s1->shards->n; i++) {
+			if (!test(s1->shards->parts[i], s2->shards->parts[i])) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	Mset flat1 = s1->kind == KIND_SHARDED ? shardsFlatten(s1) : s1;
+	Mset flat2 = s2->kind == KIND_SHARDED ? shardsFlatten(s2) : s2;
+	bool result = test(flat1, flat2);
+	if (flat1 != s1) {
+		MsetFree(flat1);
+	}
+	if (flat2 != s2) {
+		MsetFree(flat2);
+	}
+	return result;
+}
+
+/*
+* Changes dst into its combination with src where at least one of them is
+* sharded. Shards split the same way are merged pairwise. Otherwise each shard
+* of dst is merged with the elements of src in its range, so the shards are
+* changed one at a time and not all at once.
+*/
+static void shardsMergeInto(Mset dst, Mset src, int op) {
+	if (shardsMatch(dst, src)) {
+		for (int i = 0; i < dst->shards->n; i++) {
+			mergeInto(dst->shards->parts[i], src->shards->parts[i], op);
+		}
+		return;
+	}
+
+	Mset flat = src->kind == KIND_SHARDED ? shardsFlatten(src) : src;
+	if (dst->kind != KIND_SHARDED) {
+		mergeInto(dst, flat, op);
+		MsetFree(flat);
+		return;
+	}
+
+	readLock(flat);
+	struct item *items = malloc((flat->size + 1) * sizeof(struct item));
+	if (items == NULL) {
+		printNullError();
+	}
+	int n = 0;
+	struct cursor cur;
+	struct node *path[MAX_HEIGHT];
+	cursorInit(&cur, flat, path);
+	while (cursorNext(&cur)) {
+		items[n++] = cursorGet(&cur);
+	}
+	readUnlock(flat);
+	if (flat != src) {
+		MsetFree(flat);
+	}
+
+	//the items are sorted, so the ones in each shard are next to each other.
+	int start = 0;
+	for (int i = 0; i < dst->shards->n; i++) {
+		int end = start;
+		while (end < n && shardIndex(dst->shards, items[end].elem) == i) {
+			end++;
+		}
+
+		Mset part = dst->shards->parts[i];
+		Mset slice = MsetNew();
+		loadItems(slice, items + start, end - start);
+		mergeInto(part, slice, op);
+		MsetFree(slice);
+		start = end;
+	}
+	free(items);
+}
+
+/*
+* Returns a sharded multiset of snapshots of the shards. All the shards are
+* locked for reading at once, so the snapshots are of the same moment.
+*/
+static Mset shardsSnapshot(Mset s) {
+	struct shards *shards = s->shards;
+	Mset snapshot = shardsNew(shards->n, shards->lo, shards->hi);
+	for (int i = 0; i < shards->n; i++) {
+		readLock(shards->parts[i]);
+	}
+	for (int i = 0; i < shards->n; i++) {
+		snapshot->shards->parts[i] = doMsetSnapshot(shards->parts[i]);
+		readUnlock(shards->parts[i]);
+	}
+	return snapshot;
+}
+
+/*
+* Returns the number of distinct elements of a sharded multiset that are
+* smaller than the item, which are the elements of the shards before the
+* item's shard and those below it in its shard.
+*/
+static int shardsRank(Mset s, int item) {
+	int shard = shardIndex(s->shards, item);
+	int rank = 0;
+	for (int i = 0; i < shard; i++) {
+		rank += MsetSize(s->shards->parts[i]);
+	}
+	return rank + MsetRank(s->shards->parts[shard], item);
+}
+
+/*
+* Returns the element of a sharded multiset with the given index, or at the
+* given position if byCount is true, by skipping over the shards before it.
+*/
+static struct item shardsSelect(Mset s, int index, bool byCount) {
+	for (int i = 0; i < s->shards->n && index >= 0; i++) {
+		Mset part = s->shards->parts[i];
+		int size = byCount ? MsetTotalCount(part) : MsetSize(part);
+		if (index < size) {
+			return byCount ? MsetSelectByCount(part, index)
+			: MsetSelect(part, index);
+		}
+		index -= size;
+	}
+	return (struct item){UNDEFINED, 0};
+}
+
+/*
+* Returns the sum of the counts of the elements of a sharded multiset that are
+* between lo and hi inclusive, from the shards that overlap that range.
+*/
+static int shardsCountRange(Mset s, int lo, int hi) {
+	if (lo > hi) {
+		return 0;
+	}
+	int count = 0;
+	int last = shardIndex(s->shards, hi);
+	for (int i = shardIndex(s->shards, lo); i <= last; i++) {
+		count += MsetCountRange(s->shards->parts[i], lo, hi);
+	}
+	return count;
+}
+
+/*
+* Moves a cursor of a sharded multiset to the next element, going on to the
+* start of the next shard whenever it runs off the end of one.
+*/
+static bool shardsCursorNext(MsetCursor cur) {
+	struct shards *shards = cur->s->shards;
+	while (!MsetCursorNext(cur->part)) {
+		if (cur->index == shards->n - 1) {
+			return false;
+		}
+		cur->index++;
+		cursorInit(cur->part, shards->parts[cur->index], cur->part->path);
+	}
+	return true;
+}
+
+/*
+* Moves a cursor of a sharded multiset to the previous element, going back to
+* the end of the previous shard whenever it runs off the start of one.
+*/
+static bool shardsCursorPrev(MsetCursor cur) {
+	struct shards *shards = cur->s->shards;
+	while (!MsetCursorPrev(cur->part)) {
+		if (cur->index == 0) {
+			return false;
+		}
+		cur->index--;
+		cursorInit(cur->part, shards->parts[cur->index], cur->part->path);
+		cur->part->atEnd = true;
+	}
+	return true;
+}
+
+/*
+* Moves a cursor of a sharded multiset to the first element that is not
+* smaller than the item, or that is greater than it if after is true. The
+* element is in the item's shard or is the first element of a later shard.
+*/
+static bool shardsCursorSeek(MsetCursor cur, int item, bool after) {
+	struct shards *shards = cur->s->shards;
+	cur->index = shardIndex(shards, item);
+	cursorInit(cur->part, shards->parts[cur->index], cur->part->path);
+	bool found = after ? MsetCursorSeekAfter(cur->part, item)
+	: MsetCursorSeek(cur->part, item);
+	if (found || cur->index == shards->n - 1) {
+		return found;
+	}
+	cur->index++;
+	cursorInit(cur->part, shards->parts[cur->index], cur->part->path);
+	return shardsCursorNext(cur);
+}
+
+////////////////////////////////////////////////////////////////////////
+// Write Combining
+// After MsetSetWriteCombining, each thread that inserts into the multiset gets
+// its own buffer, a small open-addressing table from element to amount. An
+// insert of an element that is already buffered only adds to its amount, and
+// once threshold distinct elements are buffered they are sorted and inserted
+// as one batch under a single lock. Every thread caches the buffer it used
+// last, tagged with the id of its combiner, so an insert usually only takes
+// the buffer's own lock, which no other thread holds unless it is flushing.
+// A multiset that is neither concurrent nor sharded has no lock of its own,
+// so its flushes take the combiner's flush lock, which is always taken last.
+
+// Id given to the next combiner, so that a thread's cached buffer is never
+// mistaken for a buffer of a combiner made later at the same address.
+static unsigned long nextCombinerId = 1;
+
+// The buffer the thread inserted into last and the id of its combiner.
+static __thread struct combineBuffer *cachedBuffer;
+static __thread unsigned long cachedCombinerId;
+
+/*
+* Creates a combiner with no buffers.
+*/
+static struct combiner *combinerNew(int threshold, bool flushOnRead) {
+	struct combiner *combiner = malloc(sizeof(struct combiner));
+	if (combiner == NULL) {
+		printNullError();
+	}
+	pthread_mutex_init(&combiner->lock, NULL);
+	pthread_mutex_init(&combiner->flushLock, NULL);
+	combiner->id = __atomic_fetch_add(&nextCombinerId, 1, __ATOMIC_RELAXED);
+	combiner->threshold = threshold;
+	combiner->flushOnRead = flushOnRead;
+	combiner->pending = 0;
+	combiner->buffers = NULL;
+	return combiner;
+}
+
+/*
+* Frees a combiner and its buffers, dropping any inserts still buffered.
+*/
+static void combinerFree(struct combiner *combiner) {
+	struct combineBuffer *buffer = combiner->buffers;
+	while (buffer != NULL) {
+		struct combineBuffer *next = buffer->next;
+		pthread_mutex_destroy(&buffer->lock);
+		free(buffer->slots);
+		free(buffer->batch);
+		free(buffer);
+		buffer = next;
+	}
+	pthread_mutex_destroy(&combiner->lock);
+	pthread_mutex_destroy(&combiner->flushLock);
+	free(combiner);
+}
+
+/*
+* Returns the calling thread's buffer for the multiset, creating it on the
+* thread's first insert.
+*/
+static struct combineBuffer *combineBufferFor(Mset s) {
+	struct combiner *combiner = s->combiner;
+	if (cachedBuffer != NULL && cachedCombinerId == combiner->id) {
+		return cachedBuffer;
+	}
+
+	pthread_mutex_lock(&combiner->lock);
+	pthread_t self = pthread_self();
+	struct combineBuffer *buffer = combiner->buffers;
+	while (buffer != NULL && !pthread_equal(buffer->owner, self)) {
+		buffer = buffer->next;
+	}
+	if (buffer == NULL) {
+		buffer = malloc(sizeof(struct combineBuffer));
+		if (buffer == NULL) {
+			printNullError();
+		}
+		//the table is kept at most half full.
+		int capacity = 16;
+		while (capacity < 2 * combiner->threshold) {
+			capacity *= 2;
+		}
+		buffer->slots = malloc(capacity * sizeof(struct item));
+		buffer->batch = malloc(combiner->threshold * sizeof(struct item));
+		if (buffer->slots == NULL || buffer->batch == NULL) {
+			printNullError();
+		}
+		for (int i = 0; i < capacity; i++) {
+			buffer->slots[i].elem = UNDEFINED;
+		}
+		pthread_mutex_init(&buffer->lock, NULL);
+		buffer->owner = self;
+		buffer->capacity = capacity;
+		buffer->used = 0;
+		buffer->next = combiner->buffers;
+		combiner->buffers = buffer;
+	}
+	pthread_mutex_unlock(&combiner->lock);
+
+	cachedBuffer = buffer;
+	cachedCombinerId = combiner->id;
+	return buffer;
+}
+
+/*
+* Adds an insert to the calling thread's buffer, and inserts the buffered
+* elements into the multiset if the buffer has reached the threshold.
+*/
+static void combineInsert(Mset s, int item, int amount) {
+	struct combineBuffer *buffer = combineBufferFor(s);
+	pthread_mutex_lock(&buffer->lock);
+	unsigned mask = buffer->capacity - 1;
+	unsigned i = ((uint32_t)item * 0x9e3779b9u) & mask;
+	while (buffer->slots[i].elem != UNDEFINED &&
+		buffer->slots[i].elem != item) {
+		i = (i + 1) & mask;
+	}
+
+	if (buffer->slots[i].elem == item) {
+		buffer->slots[i].count += amount;
+	} else {
+		buffer->slots[i] = (struct item){item, amount};
+		buffer->used++;
+		__atomic_fetch_add(&s->combiner->pending, 1, __ATOMIC_RELAXED);
+		if (buffer->used >= s->combiner->threshold) {
+			combineFlushBuffer(s, buffer);
+		}
+	}
+	pthread_mutex_unlock(&buffer->lock);
+}
+
+/*
+* Inserts the elements of a locked buffer into the multiset as one batch and
+* empties the buffer.
+*/
+static void combineFlushBuffer(Mset s, struct combineBuffer *buffer) {
+	if (buffer->used == 0) {
+		return;
+	}
+
+	int n = 0;
+	for (int i = 0; i < buffer->capacity; i++) {
+		if (buffer->slots[i].elem != UNDEFINED) {
+			buffer->batch[n++] = buffer->slots[i];
+			buffer->slots[i].elem = UNDEFINED;
+		}
+	}
+	buffer->used = 0;
+	//the batches of different threads must not be inserted at once.
+	bool locked = s->sync == NULL && s->kind != KIND_SHARDED;
+	if (locked) {
+		pthread_mutex_lock(&s->combiner->flushLock);
+	}
+	insertItems(s, buffer->batch, n);
+	if (locked) {
+		pthread_mutex_unlock(&s->combiner->flushLock);
+	}
+	__atomic_fetch_sub(&s->combiner->pending, n, __ATOMIC_RELAXED);
+}
+
+/*
+* Flushes every buffer of the multiset before a read if the multiset was set
+* to flush on reads and anything is buffered.
+*/
+static void combineBeforeRead(Mset s) {
+	if (s->combiner != NULL && s->combiner->flushOnRead &&
+		__atomic_load_n(&s->combiner->pending, __ATOMIC_RELAXED) > 0) {
+		MsetFlush(s);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////
+// Parallel Set Operations
+// With MsetSetParallelism above 1, the set operations that return a new
+// multiset and MsetIncluded use join-based algorithms on two large AVL
+// multisets instead of a merge of the lists.
+// Both trees are copied into the result, then the first tree's root splits
+// the second tree into the elements below and above it, the two halves are
+// merged independently, and the results are joined back with the root as the
+// pivot. The independent halves run in other threads while there are threads
+// to spare, so the work spreads over the threads as the recursion unfolds.
+
+// Number of threads the set operations may use, set by MsetSetParallelism.
+static int parallelism = 1;
+
+// Number of threads that can still be started, out of parallelism - 1.
+static int spareThreads = 0;
+
+// The arguments and result of a joinCopy run in another thread.
+struct copyArgs {
+	struct node *tree;
+	struct node *block;
+	struct node *copy;
+};
+
+// The arguments and result of a joinMerge run in another thread.
+struct mergeArgs {
+	struct node *tree1;
+	struct node *tree2;
+	int op;
+	bool pooled;
+	struct node *result;
+};
+
+// The arguments and result of a joinFinish run in another thread.
+struct finishArgs {
+	struct node *tree;
+	struct node *first;
+	struct node *last;
+	uint64_t hash;
+};
+
+// The arguments of a joinIncluded run in another thread.
+struct includedArgs {
+	struct node *tree1;
+	struct node *tree2;
+	long long lo;
+	long long hi;
+	bool *failed;
+};
+
+/**
+ * Sets the number of threads that MsetIncluded and the set operations
+ * that return a new multiset may use, which is 1 to begin with. With
+ * more than one thread, those operations on two AVL multisets with
+ * 65536 or more elements between them split the work by element range:
+ * the root of one tree splits the other in O(log n) time, the two sides
+ * are worked out in different threads, and the results are joined back
+ * into one balanced tree. Must not be called while those operations are
+ * running.
+ */
+void MsetSetParallelism(int threads) {
+	parallelism = threads > 1 ? threads : 1;
+	spareThreads = parallelism - 1;
+}
+
+/*
+* Starts run(arg) in a new thread if there is a thread to spare. Returns false,
+* leaving the caller to do the work itself, otherwise.
+*/
+static bool spawnTask(pthread_t *thread, void *(*run)(void *), void *arg) {
+	int spare = __atomic_load_n(&spareThreads, __ATOMIC_RELAXED);
+	while (spare > 0) {
+		if (__atomic_compare_exchange_n(&spareThreads, &spare, spare - 1, false,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			if (pthread_create(thread, NULL, run, arg) == 0) {
+				return true;
+			}
+			__atomic_fetch_add(&spareThreads, 1, __ATOMIC_RELAXED);
+			return false;
+		}
+	}
+	return false;
+}
+
+/*
+* Waits for a thread started by spawnTask and gives it back.
+*/
+static void joinTask(pthread_t thread) {
+	pthread_join(thread, NULL);
+	__atomic_fetch_add(&spareThreads, 1, __ATOMIC_RELAXED);
+}
+
+/*
+* Checks if the union or intersection of two multisets should use the
+* join-based algorithms.
+*/
+static bool joinApplies(Mset s1, Mset s2) {
+	//the join only reads the two trees, so snapshots can be split too.
+	return parallelism > 1 &&
+	(s1->kind == KIND_AVL || s1->kind == KIND_SNAPSHOT) &&
+	(s2->kind == KIND_AVL || s2->kind == KIND_SNAPSHOT) &&
+	(long long)s1->size + s2->size >= PARALLEL_MIN;
+}
+
+/*
+* Stores into an empty result the merge of two AVL multisets worked out by
+* joinMerge, with the given op.
+*/
+static void joinMergeSets(Mset result, Mset s1, Mset s2, int op) {
+	//with a pool, the copies are made in one block of the pool so that the
+	//threads do not share the pool's free list. Nodes dropped by the merge are
+	//marked and given to the free list afterwards.
+	struct node *block = NULL;
+	bool pooled = result->pool != NULL;
+	if (pooled) {
+		block = poolReserve(result->pool, s1->size + s2->size);
+	}
+
+	struct copyArgs copy1 = {s1->tree, block, NULL};
+	pthread_t thread;
+	bool spawned = s1->size >= PARALLEL_GRAIN &&
+	spawnTask(&thread, joinCopyTask, &copy1);
+	if (!spawned) {
+		joinCopyTask(&copy1);
+	}
+	struct node *copy2 = joinCopy(s2->tree,
+	pooled ? block + s1->size : NULL);
+	if (spawned) {
+		joinTask(thread);
+	}
+
+	result->tree = joinMerge(copy1.copy, copy2, op, pooled);
+	if (pooled) {
+		for (int i = 0; i < s1->size + s2->size; i++) {
+			if (block[i].height < 0) {
+				freeNode(result, &block[i]);
+			}
+		}
+	}
+
+	struct finishArgs finish = {result->tree, NULL, NULL, 0};
+	joinFinishTask(&finish);
+	result->listBegin = finish.first;
+	result->listEnd = finish.last;
+	result->hash = finish.hash;
+	result->size = treeSize(result->tree);
+	result->totalCount = treeCount(result->tree);
+	if (result->flags & MSET_COUNT_INDEX) {
+		for (struct node *curr = result->listBegin; curr != NULL;
+			curr = curr->next) {
+			countIndexUpdate(result, curr->elem, 0, curr->count);
+		}
+	}
+	if (result->flags & MSET_NO_LIST) {
+		result->listBegin = NULL;
+		result->listEnd = NULL;
+	}
+}
+
+/*
+* Takes a block of n nodes out of a pool in one go, as a slab of its own.
+*/
+static struct node *poolReserve(struct nodePool *pool, int n) {
+	struct nodeSlab *slab = malloc(sizeof(struct nodeSlab) +
+	n * sizeof(struct node));
+	if (slab == NULL) {
+		printNullError();
+	}
+	slab->capacity = n;
+	slab->used = n;
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+	return slab->nodes;
+}
+
+/*
+* Runs joinCopy with the arguments in a struct copyArgs.
+*/
+static void *joinCopyTask(void *arg) {
+	struct copyArgs *args = arg;
+	args->copy = joinCopy(args->tree, args->block);
+	return NULL;
+}
+
+/*
+* Returns a copy of a tree without its list links. If block is not NULL, the
+* copy of the node with in-order position i is block[i], otherwise every node
+* is allocated on its own.
+*/
+static struct node *joinCopy(struct node *tree, struct node *block) {
+	if (tree == NULL) {
+		return NULL;
+	}
+
+	int leftSize = treeSize(tree->left);
+	struct node *copy;
+	if (block != NULL) {
+		copy = &block[leftSize];
+	} else {
+		copy = malloc(sizeof(struct node));
+		if (copy == NULL) {
+			printNullError();
+		}
+	}
+	*copy = *tree;
+	copy->refs = 1;
+
+	struct copyArgs left = {tree->left, block, NULL};
+	pthread_t thread;
+	bool spawned = leftSize >= PARALLEL_GRAIN &&
+	spawnTask(&thread, joinCopyTask, &left);
+	if (!spawned) {
+		joinCopyTask(&left);
+	}
+	copy->right = joinCopy(tree->right,
+	block != NULL ? block + leftSize + 1 : NULL);
+	if (spawned) {
+		joinTask(thread);
+	}
+	copy->left = left.copy;
+	return copy;
+}
+
+/*
+* Runs joinMerge with the arguments in a struct mergeArgs.
+*/
+static void *joinMergeTask(void *arg) {
+	struct mergeArgs *args = arg;
+	args->result = joinMerge(args->tree1, args->tree2, args->op, args->pooled);
+	return NULL;
+}
+
+/*
+* Merges two trees with the given op, reusing their nodes, and returns the
+* result. The root of tree1 splits tree2, each side is merged on its own, and
+* the sides are joined with the root in between if the op keeps its element.
+*/
+static struct node *joinMerge(struct node *tree1, struct node *tree2, int op,
+bool pooled) {
+	if (tree1 == NULL || tree2 == NULL) {
+		//what is left of one tree is kept if the op keeps the elements that
+		//are only in that tree.
+		if (tree1 == NULL && mergeCount(op, 0, 1) > 0) {
+			return tree2;
+		}
+		if (tree2 == NULL && mergeCount(op, 1, 0) > 0) {
+			return tree1;
+		}
+		joinDiscardTree(tree1 != NULL ? tree1 : tree2, pooled);
+		return NULL;
+	}
+
+	struct node *left2;
+	struct node *right2;
+	struct node *match = joinSplit(tree2, tree1->elem, &left2, &right2);
+	int count = mergeCount(op, tree1->count, match != NULL ? match->count : 0);
+	if (match != NULL) {
+		joinDiscard(match, pooled);
+	}
+
+	struct mergeArgs left = {tree1->left, left2, op, pooled, NULL};
+	pthread_t thread;
+	bool spawned = treeSize(tree1->left) + treeSize(left2) >= PARALLEL_GRAIN &&
+	spawnTask(&thread, joinMergeTask, &left);
+	if (!spawned) {
+		joinMergeTask(&left);
+	}
+	struct node *right = joinMerge(tree1->right, right2, op, pooled);
+	if (spawned) {
+		joinTask(thread);
+	}
+
+	if (count > 0) {
+		tree1->count = count;
+		return join(left.result, tree1, right);
+	}
+	joinDiscard(tree1, pooled);
+	return joinPair(left.result, right);
+}
+
+/*
+* Drops a node that is not part of the result, by freeing it or, if it is in a
+* pool's block, marking it with a negative height.
+*/
+static void joinDiscard(struct node *node, bool pooled) {
+	if (pooled) {
+		node->height = -1;
+	} else {
+		free(node);
+	}
+}
+
+/*
+* Drops every node of a tree.
+*/
+static void joinDiscardTree(struct node *tree, bool pooled) {
+	if (!pooled) {
+		freeTree(tree);
+		return;
+	}
+	if (tree != NULL) {
+		joinDiscardTree(tree->left, pooled);
+		joinDiscardTree(tree->right, pooled);
+		tree->height = -1;
+	}
+}
+
+/*
+* Returns the height of a tree, which is -1 for an empty tree.
+*/
+static int joinHeight(struct node *tree) {
+	return tree == NULL ? -1 : tree->height;
+}
+
+/*
+* Splits a tree into the elements smaller than the item, stored into left, and
+* those greater than it, stored into right. Returns the node of the item, or
+* NULL if it is not in the tree. Takes O(log n) time.
+*/
+static struct node *joinSplit(struct node *tree, int item, struct node **left,
+struct node **right) {
+	if (tree == NULL) {
+		*left = NULL;
+		*right = NULL;
+		return NULL;
+	}
+	if (item == tree->elem) {
+		*left = tree->left;
+		*right = tree->right;
+		return tree;
+	}
+
+	struct node *found;
+	if (item < tree->elem) {
+		found = joinSplit(tree->left, item, left, right);
+		*right = join(*right, tree, tree->right);
+	} else {
+		found = joinSplit(tree->right, item, left, right);
+		*left = join(tree->left, tree, *left);
+	}
+	return found;
+}
+
+/*
+* Joins two trees, where every element of left is smaller than the pivot and
+* every element of right is greater, into one balanced tree. Takes time
+* proportional to the difference of their heights.
+*/
+static struct node *join(struct node *left, struct node *pivot,
+struct node *right) {
+	if (joinHeight(left) > joinHeight(right) + 1) {
+		return joinRight(left, pivot, right);
+	}
+	if (joinHeight(right) > joinHeight(left) + 1) {
+		return joinLeft(left, pivot, right);
+	}
+	pivot->left = left;
+	pivot->right = right;
+	updateNode(pivot);
+	return pivot;
+}
+
+/*
+* Joins a right tree onto the right spine of a taller left tree, at the first
+* node that is at most one taller than it, and rebalances on the way back up.
+*/
+static struct node *joinRight(struct node *left, struct node *pivot,
+struct node *right) {
+	struct node *inner = left->right;
+	if (joinHeight(inner) <= joinHeight(right) + 1) {
+		pivot->left = inner;
+		pivot->right = right;
+		updateNode(pivot);
+		if (pivot->height <= joinHeight(left->left) + 1) {
+			left->right = pivot;
+			updateNode(left);
+			return left;
+		}
+		left->right = rotateRight(pivot);
+		updateNode(left);
+		return rotateLeft(left);
+	}
+
+	left->right = joinRight(inner, pivot, right);
+	updateNode(left);
+	if (left->right->height <= joinHeight(left->left) + 1) {
+		return left;
+	}
+	return rotateLeft(left);
+}
+
+/*
+* Joins a left tree onto the left spine of a taller right tree.
+*/
+static struct node *joinLeft(struct node *left, struct node *pivot,
+struct node *right) {
+	struct node *inner = right->left;
+	if (joinHeight(inner) <= joinHeight(left) + 1) {
+		pivot->left = left;
+		pivot->right = inner;
+		updateNode(pivot);
+		if (pivot->height <= joinHeight(right->right) + 1) {
+			right->left = pivot;
+			updateNode(right);
+			return right;
+		}
+		right->left = rotateLeft(pivot);
+		updateNode(right);
+		return rotateRight(right);
+	}
+
+	right->left = joinLeft(left, pivot, inner);
+	updateNode(right);
+	if (right->left->height <= joinHeight(right->right) + 1) {
+		return right;
+	}
+	return rotateRight(right);
+}
+
+/*
+* Joins two trees, where every element of left is smaller than every element of
+* right, using the greatest element of left as the pivot.
+*/
+static struct node *joinPair(struct node *left, struct node *right) {
+	if (left == NULL) {
+		return right;
+	}
+	struct node *rest;
+	struct node *last = joinSplitLast(left, &rest);
+	return join(rest, last, right);
+}
+
+/*
+* Removes the greatest element from a tree, storing the rest of the tree into
+* rest, and returns its node.
+*/
+static struct node *joinSplitLast(struct node *tree, struct node **rest) {
+	if (tree->right == NULL) {
+		*rest = tree->left;
+		return tree;
+	}
+	struct node *last = joinSplitLast(tree->right, rest);
+	*rest = join(tree->left, tree, *rest);
+	return last;
+}
+
+/*
+* Links the nodes of a tree into a list in order and adds up the hashes of its
+* elements, storing its first and last nodes and the hash into the struct
+* finishArgs.
+*/
+static void *joinFinishTask(void *arg) {
+	struct finishArgs *args = arg;
+	struct node *tree = args->tree;
+	if (tree == NULL) {
+		return NULL;
+	}
+
+	struct finishArgs left = {tree->left, NULL, NULL, 0};
+	pthread_t thread;
+	bool spawned = treeSize(tree->left) >= PARALLEL_GRAIN &&
+	spawnTask(&thread, joinFinishTask, &left);
+	if (!spawned) {
+		joinFinishTask(&left);
+	}
+	struct finishArgs right = {tree->right, NULL, NULL, 0};
+	joinFinishTask(&right);
+	if (spawned) {
+		joinTask(thread);
+	}
+
+	tree->prev = left.last;
+	if (left.last != NULL) {
+		left.last->next = tree;
+	}
+	tree->next = right.first;
+	if (right.first != NULL) {
+		right.first->prev = tree;
+	}
+	args->first = left.first != NULL ? left.first : tree;
+	args->last = right.last != NULL ? right.last : tree;
+	args->hash = left.hash + right.hash + itemHash(tree->elem, tree->count);
+	return NULL;
+}
+
+/*
+* Checks if s2 includes s1, where both are large AVL multisets, by looking up
+* the elements of s1 in s2 from several threads.
+*/
+static bool joinIncludedSets(Mset s1, Mset s2) {
+	bool failed = false;
+	struct includedArgs args = {s1->tree, s2->tree, (long long)INT_MIN - 1,
+	(long long)INT_MAX + 1, &failed};
+	joinIncludedTask(&args);
+	return !failed;
+}
+
+/*
+* Looks up the elements of tree1, which are all between lo and hi exclusive,
+* in tree2, setting failed if one is missing or has a smaller count. Each
+* lookup starts from the smallest subtree of tree2 that holds every element
+* between lo and hi, so the halves of tree1 search disjoint parts of tree2.
+*/
+static void *joinIncludedTask(void *arg) {
+	struct includedArgs *args = arg;
+	struct node *tree1 = args->tree1;
+	struct node *tree2 = args->tree2;
+	if (tree1 == NULL || __atomic_load_n(args->failed, __ATOMIC_RELAXED)) {
+		return NULL;
+	}
+
+	while (tree2 != NULL &&
+		(tree2->elem <= args->lo || tree2->elem >= args->hi)) {
+		tree2 = tree2->elem <= args->lo ? tree2->right : tree2->left;
+	}
+	struct node *match = bstFind(tree2, tree1->elem);
+	if (match == NULL || match->count < tree1->count) {
+		__atomic_store_n(args->failed, true, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	struct includedArgs left = {tree1->left, tree2, args->lo, tree1->elem,
+	args->failed};
+	pthread_t thread;
+	bool spawned = treeSize(tree1->left) >= PARALLEL_GRAIN &&
+	spawnTask(&thread, joinIncludedTask, &left);
+	if (!spawned) {
+		joinIncludedTask(&left);
+	}
+	struct includedArgs right = {tree1->right, tree2, tree1->elem, args->hi,
+	args->failed};
+	joinIncludedTask(&right);
+	if (spawned) {
+		joinTask(thread);
+	}
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Snapshots
+// A snapshot of an AVL multiset links to the multiset's root, so the two share
+// the whole tree to begin with. Every node counts the links to it, and the
+// multiset copies a node that something else also links to before it changes
+// it. Changes start at the root, so only the path down to the change and the
+// nodes rotated on the way back up are copied, and the snapshot keeps the old
+// nodes. The list cannot be shared, since a copy has to be linked in where the
+// old node was, so a snapshot leaves it alone and its cursors keep their path
+// down the tree instead, like those of a multiset without a list. Nodes are
+// freed by whichever of the multiset and its snapshots drops the last link to
+// them.
+
+/**
+ * Returns a read-only snapshot of the multiset as it is now, which
+ * later changes to the multiset do not affect. The snapshot of an AVL
+ * multiset shares its tree, so it is taken in O(1) time, and each later
+ * change to the multiset copies the O(log n) nodes it changes that the
+ * snapshot still links to. Snapshots of the other representations are
+ * copies. Inserts and deletes do nothing on a snapshot, and its cursors
+ * walk the tree like those of an MSET_NO_LIST multiset. A snapshot may
+ * be read by other threads while the multiset changes, and is freed
+ * with MsetFree, before or after the multiset.
+ */
+Mset MsetSnapshot(Mset s) {
+	combineBeforeRead(s);
+	if (s->kind == KIND_SHARDED) {
+		return shardsSnapshot(s);
+	}
+	readLock(s);
+	Mset snapshot = doMsetSnapshot(s);
+	readUnlock(s);
+	return snapshot;
+}
+
+/*
+* Returns a snapshot of a multiset that is locked for reading.
+*/
+static Mset doMsetSnapshot(Mset s) {
+	Mset snapshot = MsetNew();
+	if (s->kind == KIND_AVL || s->kind == KIND_SNAPSHOT) {
+		nodeRetain(s->tree);
+		snapshot->tree = s->tree;
+		snapshot->pool = s->pool;
+		if (s->pool != NULL) {
+			__atomic_add_fetch(&s->pool->users, 1, __ATOMIC_RELAXED);
+		}
+		snapshot->size = s->size;
+		snapshot->totalCount = s->totalCount;
+		snapshot->hash = s->hash;
+		//the multiset must copy shared nodes from now on.
+		__atomic_store_n(&s->shared, true, __ATOMIC_RELAXED);
+	} else {
+		struct item *items = malloc((s->size + 1) * sizeof(struct item));
+		if (items == NULL) {
+			printNullError();
+		}
+		int n = 0;
+		struct cursor cur;
+		struct node *path[MAX_HEIGHT];
+		cursorInit(&cur, s, path);
+		while (cursorNext(&cur)) {
+			items[n++] = cursorGet(&cur);
+		}
+		loadItems(snapshot, items, n);
+		free(items);
+	}
+
+	//the indexes are only kept up to date by changes, and the tree needs no
+	//lock since it never changes.
+	snapshot->flags = s->flags &
+	~(MSET_COUNT_INDEX | MSET_LOOKUP_INDEX | MSET_CONCURRENT);
+	snapshot->kind = KIND_SNAPSHOT;
+	snapshot->shared = true;
+	return snapshot;
+}
+
+/*
+* Makes sure that nothing but the multiset links to the node at *link before the
+* multiset changes it, where the link is in the multiset's tree and in no
+* snapshot. Returns the node now at *link. Multisets that no snapshot was ever
+* taken of skip the check, which is on the path of every change.
+*/
+static struct node *ownLink(Mset s, struct node **link) {
+	struct node *node = *link;
+	if (!s->shared || node == NULL ||
+		__atomic_load_n(&node->refs, __ATOMIC_ACQUIRE) == 1) {
+		return node;
+	}
+	return ownCopy(s, link);
+}
+
+/*
+* Replaces the shared node at *link by a copy that links to the same children
+* and takes the node's place in the list, and returns the copy.
+*/
+static struct node *ownCopy(Mset s, struct node **link) {
+	struct node *node = *link;
+	struct node *copy = newNode(s, node->elem, node->count);
+	copy->left = node->left;
+	copy->right = node->right;
+	copy->height = node->height;
+	copy->subTreeSize = node->subTreeSize;
+	copy->subTreeCount = node->subTreeCount;
+	nodeRetain(copy->left);
+	nodeRetain(copy->right);
+	linkNode(s, copy, node->prev, node->next);
+	*link = copy;
+	nodeRelease(s->pool, node);
+	return copy;
+}
+
+/*
+* Copies the nodes that avlRebalance is about to rotate under tree, which are
+* not on the path of the change when it is a delete, if they are shared.
+*/
+static void ownRotated(Mset s, struct node *tree) {
+	if (!s->shared) {
+		return;
+	}
+
+	int bal = balance(tree);
+	if (bal > 1) {
+		struct node *left = ownLink(s, &tree->left);
+		if (balance(left) < 0) {
+			ownLink(s, &left->right);
+		}
+	} else if (bal < -1) {
+		struct node *right = ownLink(s, &tree->right);
+		if (balance(right) > 0) {
+			ownLink(s, &right->left);
+		}
+	}
+}
+
+/*
+* Copies every shared node of the subtree at *link, before a change that relinks
+* the whole tree. A copy shares the children of the node it replaces, so the
+* whole subtree below a shared node ends up copied.
+*/
+static void ownTree(Mset s, struct node **link) {
+	struct node *node = ownLink(s, link);
+	if (node != NULL) {
+		ownTree(s, &node->left);
+		ownTree(s, &node->right);
+	}
+}
+
+/*
+* Counts a new link to a node.
+*/
+static void nodeRetain(struct node *node) {
+	if (node != NULL) {
+		__atomic_add_fetch(&node->refs, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+* Drops a link to a node, freeing the node and dropping its links to its
+* children if it was the last one. Nodes of a pool are pushed onto the pool's
+* returned list, since the pool's free list belongs to the thread changing the
+* multiset.
+*/
+static void nodeRelease(struct nodePool *pool, struct node *node) {
+	while (node != NULL &&
+		__atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		struct node *right = node->right;
+		nodeRelease(pool, node->left);
+		if (pool == NULL) {
+			free(node);
+		} else {
+			node->left = __atomic_load_n(&pool->returned, __ATOMIC_RELAXED);
+			while (!__atomic_compare_exchange_n(&pool->returned, &node->left,
+				node, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+			}
+		}
+		node = right;
+	}
+}
+
+/*
+* Drops a multiset's or a snapshot's use of a pool, freeing the pool after the
+* last one.
+*/
+static void poolRelease(struct nodePool *pool) {
+	if (__atomic_sub_fetch(&pool->users, 1, __ATOMIC_ACQ_REL) == 0) {
+		freePool(pool);
+	}
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// Saved Multisets
+// MsetSave writes the elements in blocks of SAVED_BLOCK. A table with the
+// first element, the greatest count and the sum of the counts before each
+// block comes first, and then the blocks, each holding the differences
+// between its consecutive elements and then its counts as varints of 7 bits a
+// byte. MsetOpenMapped maps the file into memory and reads it in place: a
+// lookup is a binary search of the table followed by a walk through one
+// block, so opening the file reads nothing but the header.
+
+/**
+ * Writes the multiset to the given file descriptor in a compact binary
+ * format that MsetOpenMapped can read. Returns true if the whole
+ * multiset was written, and false if a write failed. Files are read on
+ * machines with the same byte order as the one that wrote them.
+ */
+bool MsetSave(Mset s, int fd) {
+	combineBeforeRead(s);
+	if (s->kind == KIND_SHARDED) {
+		Mset flat = shardsFlatten(s);
+		bool saved = MsetSave(flat, fd);
+		MsetFree(flat);
+		return saved;
+	}
+	readLock(s);
+	bool saved = doMsetSave(s, fd);
+	readUnlock(s);
+	return saved;
+}
+
+/*
+* Saves a multiset that is locked for reading. The block table is worked out in
+* a first walk through the multiset, since it is written before the blocks.
+*/
+static bool doMsetSave(Mset s, int fd) {
+	int blocks = (s->size + SAVED_BLOCK - 1) / SAVED_BLOCK;
+	struct savedBlock *table = calloc(blocks + 1, sizeof(struct savedBlock));
+	struct saveBuffer *buffer = malloc(sizeof(struct saveBuffer) + SAVE_BUFFER);
+	if (table == NULL || buffer == NULL) {
+		printNullError();
+	}
+	buffer->fd = fd;
+	buffer->failed = false;
+	buffer->used = 0;
+
+	struct cursor cur;
+	struct node *path[MAX_HEIGHT];
+	cursorInit(&cur, s, path);
+	uint64_t dataSize = 0;
+	int totalCount = 0;
+	int prev = 0;
+	for (int i = 0; cursorNext(&cur); i++) {
+		struct item item = cursorGet(&cur);
+		struct savedBlock *block = &table[i / SAVED_BLOCK];
+		if (i % SAVED_BLOCK == 0) {
+			*block = (struct savedBlock){item.elem, 0, totalCount, 0, dataSize};
+		} else {
+			int length = varintLength((uint32_t)item.elem - (uint32_t)prev);
+			block->countsAt += length;
+			dataSize += length;
+		}
+		if (item.count > block->maxCount) {
+			block->maxCount = item.count;
+		}
+		dataSize += varintLength(item.count);
+		totalCount += item.count;
+		prev = item.elem;
+	}
+
+	struct savedHeader header = {SAVED_MAGIC, s->size, s->totalCount, s->hash,
+	blocks, SAVED_BLOCK, dataSize};
+	saveBytes(buffer, &header, sizeof(header));
+	saveBytes(buffer, table, blocks * sizeof(struct savedBlock));
+
+	//each block is put together with its elements and its counts apart, and
+	//then written out.
+	uint8_t elems[SAVED_BLOCK * 5];
+	uint8_t counts[SAVED_BLOCK * 5];
+	int elemBytes = 0;
+	int countBytes = 0;
+	cursorInit(&cur, s, path);
+	for (int i = 0; cursorNext(&cur); i++) {
+		struct item item = cursorGet(&cur);
+		if (i % SAVED_BLOCK != 0) {
+			elemBytes += varintWrite(elems + elemBytes,
+			(uint32_t)item.elem - (uint32_t)prev);
+		}
+		countBytes += varintWrite(counts + countBytes, item.count);
+		prev = item.elem;
+
+		if (i % SAVED_BLOCK == SAVED_BLOCK - 1 || i == s->size - 1) {
+			saveBytes(buffer, elems, elemBytes);
+			saveBytes(buffer, counts, countBytes);
+			elemBytes = 0;
+			countBytes = 0;
+		}
+	}
+	saveFlush(buffer);
+
+	bool saved = !buffer->failed;
+	free(buffer);
+	free(table);
+	return saved;
+}
+
+/*
+* Adds bytes to the ones waiting to be written, writing them out whenever the
+* buffer fills up.
+*/
+static void saveBytes(struct saveBuffer *buffer, const void *bytes, size_t n) {
+	const uint8_t *from = bytes;
+	while (n > 0) {
+		if (buffer->used == SAVE_BUFFER) {
+			saveFlush(buffer);
+		}
+		size_t chunk = SAVE_BUFFER - buffer->used;
+		if (chunk > n) {
+			chunk = n;
+		}
+		memcpy(buffer->bytes + buffer->used, from, chunk);
+		buffer->used += chunk;
+		from += chunk;
+		n -= chunk;
+	}
+}
+
+/*
+* Writes out the bytes in the buffer, which write may take a part at a time.
+* After a failed write the rest of the bytes are dropped.
+*/
+static void saveFlush(struct saveBuffer *buffer) {
+	size_t done = 0;
+	while (done < buffer->used && !buffer->failed) {
+		ssize_t written = write(buffer->fd, buffer->bytes + done,
+		buffer->used - done);
+		if (written > 0) {
+			done += written;
+		} else if (written < 0 && errno != EINTR) {
+			buffer->failed = true;
+		}
+	}
+	buffer->used = 0;
+}
+
+/*
+* Returns the number of bytes the value takes as a varint.
+*/
+static int varintLength(uint32_t value) {
+	int length = 1;
+	while (value >= 0x80) {
+		value >>= 7;
+		length++;
+	}
+	return length;
+}
+
+/*
+* Stores the value as a varint, 7 bits a byte starting from the lowest, with
+* the top bit set in every byte but the last. Returns the number of bytes used.
+*/
+static int varintWrite(uint8_t *bytes, uint32_t value) {
+	int length = 0;
+	while (value >= 0x80) {
+		bytes[length++] = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	bytes[length++] = (uint8_t)value;
+	return length;
+}
+
+/*
+* Reads a varint into value and returns a pointer to the byte after it. The
+* varint is cut off at end and after 5 bytes, so a damaged file is never read
+* past the block the varint is in.
+*/
+static const uint8_t *varintRead(const uint8_t *bytes, const uint8_t *end,
+uint32_t *value) {
+	uint32_t result = 0;
+	for (int shift = 0; bytes < end && shift < 35; shift += 7) {
+		uint8_t byte = *bytes++;
+		result |= (uint32_t)(byte & 0x7f) << shift;
+		if (byte < 0x80) {
+			break;
+		}
+	}
+	*value = result;
+	return bytes;
+}
+
+/**
+ * Opens a multiset written by MsetSave by mapping the file at the given
+ * path into memory. The elements are not read, but the table of one
+ * entry per 64 elements is checked, so opening takes O(n / 64) time.
+ * The multiset is read-only: inserts and deletes do nothing on it.
+ * Lookups, cursor seeks and the order statistics take O(log n) time.
+ * Cursors move forwards in O(1) time, but MsetCursorPrev walks through
+ * up to 64 elements.
+ * Returns NULL if the file cannot be opened or was not written by
+ * MsetSave. The file must not change while the multiset is open.
+ */
+Mset MsetOpenMapped(const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct stat info;
+	if (fstat(fd, &info) < 0 ||
+		(size_t)info.st_size < sizeof(struct savedHeader)) {
+		close(fd);
+		return NULL;
+	}
+	size_t length = info.st_size;
+	void *base = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+	//the mapping keeps the file open on its own.
+	close(fd);
+	if (base == MAP_FAILED) {
+		return NULL;
+	}
+
+	const struct savedHeader *header = base;
+	if (!mappedValid(header, length)) {
+		munmap(base, length);
+		return NULL;
+	}
+
+	struct mapped *mapped = malloc(sizeof(struct mapped));
+	if (mapped == NULL) {
+		printNullError();
+	}
+	mapped->base = base;
+	mapped->length = length;
+	mapped->blocks = (const struct savedBlock *)(header + 1);
+	mapped->data = (const uint8_t *)(mapped->blocks + header->blocks);
+	mapped->nBlocks = header->blocks;
+
+	Mset s = MsetNew();
+	s->kind = KIND_MAPPED;
+	s->mapped = mapped;
+	s->size = header->size;
+	s->totalCount = header->totalCount;
+	s->hash = header->hash;
+	return s;
+}
+
+/*
+* Checks that a file of the given length starts with the header of a saved
+* multiset whose table and blocks fill the rest of the file exactly, and that
+* every entry of the table agrees with the ones around it: the blocks follow
+* each other in the data with room for their counts, their first elements
+* increase, and the counts before them grow by at least one and at most the
+* greatest count for each element in between.
+*/
+static bool mappedValid(const struct savedHeader *header, size_t length) {
+	if (memcmp(header->magic, SAVED_MAGIC, sizeof(header->magic)) != 0 ||
+		header->size < 0 || header->totalCount < 0 ||
+		header->blockSize != SAVED_BLOCK ||
+		header->blocks != (header->size + SAVED_BLOCK - 1) / SAVED_BLOCK) {
+		return false;
+	}
+	size_t tableSize = (size_t)header->blocks * sizeof(struct savedBlock);
+	if (length - sizeof(struct savedHeader) < tableSize ||
+		length - sizeof(struct savedHeader) - tableSize != header->dataSize) {
+		return false;
+	}
+
+	const struct savedBlock *blocks = (const struct savedBlock *)(header + 1);
+	for (int b = 0; b < header->blocks; b++) {
+		const struct savedBlock *block = &blocks[b];
+		uint64_t end = header->dataSize;
+		long long countAfter = header->totalCount;
+		if (b + 1 < header->blocks) {
+			end = blocks[b + 1].offset;
+			countAfter = blocks[b + 1].countBefore;
+			if (blocks[b + 1].first <= block->first) {
+				return false;
+			}
+		}
+		//the last block may be short.
+		long long elems = b + 1 < header->blocks ? SAVED_BLOCK :
+		header->size - (long long)b * SAVED_BLOCK;
+		if ((b == 0 ? block->offset != 0 || block->countBefore != 0 :
+			block->offset < blocks[b - 1].offset) ||
+			block->offset > end || block->countsAt >= end - block->offset ||
+			block->maxCount < 1 || block->countBefore < 0 ||
+			countAfter - block->countBefore < elems ||
+			countAfter - block->countBefore > elems * block->maxCount) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+* Unmaps a mapped multiset's file.
+*/
+static void mappedFree(struct mapped *mapped) {
+	munmap(mapped->base, mapped->length);
+	free(mapped);
+}
+
+/*
+* Returns a pointer to the byte after the last count of a block of a mapped
+* multiset.
+*/
+static const uint8_t *mappedBlockEnd(struct mapped *mapped, int b) {
+	if (b + 1 < mapped->nBlocks) {
+		return mapped->data + mapped->blocks[b + 1].offset;
+	}
+	return (const uint8_t *)mapped->base + mapped->length;
+}
+
+/*
+* Returns the index of the last block whose first element is smaller than the
+* item, or smaller or equal if inclusive is true, or -1 if there is none.
+*/
+static int mappedBlockOf(struct mapped *mapped, int item, bool inclusive) {
+	int lo = 0;
+	int hi = mapped->nBlocks;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		int first = mapped->blocks[mid].first;
+		if (first < item || (inclusive && first == item)) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo - 1;
+}
+
+/*
+* Returns the count of an item in a mapped multiset, walking the differences of
+* its block up to the item and then skipping the counts before it.
+*/
+static int mappedGetCount(struct mapped *mapped, int item) {
+	int b = mappedBlockOf(mapped, item, true);
+	if (b < 0) {
+		return 0;
+	}
+	const uint8_t *bytes = mapped->data + mapped->blocks[b].offset;
+	const uint8_t *counts = bytes + mapped->blocks[b].countsAt;
+	const uint8_t *end = mappedBlockEnd(mapped, b);
+	int elem = mapped->blocks[b].first;
+	int before = 0;
+	while (elem < item && bytes < counts) {
+		uint32_t delta;
+		bytes = varintRead(bytes, counts, &delta);
+		elem = (int)((uint32_t)elem + delta);
+		before++;
+	}
+	if (elem != item) {
+		return 0;
+	}
+
+	//only the last byte of a varint has its top bit clear.
+	while (before > 0 && counts < end) {
+		if (*counts++ < 0x80) {
+			before--;
+		}
+	}
+	uint32_t count;
+	varintRead(counts, end, &count);
+	return (int)count;
+}
+
+/*
+* Moves a cursor over a mapped multiset to the first element of a block.
+*/
+static void mappedCursorStart(MsetCursor cur, int b) {
+	const struct savedBlock *block = &cur->s->mapped->blocks[b];
+	uint32_t count;
+	cur->index = b * SAVED_BLOCK;
+	cur->elemAt = cur->s->mapped->data + block->offset;
+	cur->countAt = varintRead(cur->elemAt + block->countsAt,
+	mappedBlockEnd(cur->s->mapped, b), &count);
+	cur->item = (struct item){block->first, (int)count};
+}
+
+/*
+* Moves a cursor over a mapped multiset to the next element in the same block.
+*/
+static void mappedCursorStep(MsetCursor cur) {
+	int b = cur->index / SAVED_BLOCK;
+	const struct savedBlock *block = &cur->s->mapped->blocks[b];
+	const uint8_t *counts = cur->s->mapped->data + block->offset +
+	block->countsAt;
+	uint32_t delta;
+	uint32_t count;
+	cur->elemAt = varintRead(cur->elemAt, counts, &delta);
+	cur->countAt = varintRead(cur->countAt, mappedBlockEnd(cur->s->mapped, b),
+	&count);
+	cur->index++;
+	cur->item = (struct item){(int)((uint32_t)cur->item.elem + delta),
+	(int)count};
+}
+
+/*
+* Moves a cursor over a mapped multiset to the next element, or to the end.
+*/
+static bool mappedCursorNext(MsetCursor cur) {
+	if (cur->index < 0 && cur->atEnd) {
+		return false;
+	}
+
+	int next = cur->index + 1;
+	if (next == cur->s->size) {
+		cur->index = -1;
+		cur->atEnd = true;
+		return false;
+	}
+	if (next % SAVED_BLOCK == 0) {
+		mappedCursorStart(cur, next / SAVED_BLOCK);
+	} else {
+		mappedCursorStep(cur);
+	}
+	return true;
+}
+
+/*
+* Moves a cursor over a mapped multiset forward by up to n elements, n being at
+* least 1. The cursor moves onto the first element of each block in the usual
+* way, and the rest of the block is read straight from its varints. Returns the
+* number of elements stored.
+*/
+static int mappedCursorNextN(MsetCursor cur, int n, struct item items[]) {
+	struct mapped *mapped = cur->s->mapped;
+	int stored = 0;
+	while (stored < n && mappedCursorNext(cur)) {
+		items[stored++] = cur->item;
+
+		int b = cur->index / SAVED_BLOCK;
+		int run = (b + 1) * SAVED_BLOCK;
+		if (run > cur->s->size) {
+			run = cur->s->size;
+		}
+		run -= cur->index + 1;
+		if (run > n - stored) {
+			run = n - stored;
+		}
+		if (run == 0) {
+			continue;
+		}
+
+		const uint8_t *counts = mapped->data + mapped->blocks[b].offset +
+		mapped->blocks[b].countsAt;
+		const uint8_t *end = mappedBlockEnd(mapped, b);
+		const uint8_t *elemAt = cur->elemAt;
+		const uint8_t *countAt = cur->countAt;
+		uint32_t elem = (uint32_t)cur->item.elem;
+		for (int i = 0; i < run; i++) {
+			uint32_t delta;
+			uint32_t count;
+			elemAt = varintRead(elemAt, counts, &delta);
+			countAt = varintRead(countAt, end, &count);
+			elem += delta;
+			items[stored++] = (struct item){(int)elem, (int)count};
+		}
+		cur->elemAt = elemAt;
+		cur->countAt = countAt;
+		cur->index += run;
+		cur->item = items[stored - 1];
+	}
+	return stored;
+}
+
+/*
+* Moves a cursor over a mapped multiset to the previous element, or to the
+* start. The varints can only be read forwards, so the cursor walks up to the
+* previous element from the start of its block.
+*/
+static bool mappedCursorPrev(MsetCursor cur) {
+	int prev;
+	if (cur->index >= 0) {
+		prev = cur->index - 1;
+	} else {
+		//at the end the cursor moves to the last element, and at the start
+		//it stays there.
+		prev = cur->atEnd ? cur->s->size - 1 : -1;
+	}
+
+	if (prev < 0) {
+		cur->index = -1;
+		cur->atEnd = false;
+		return false;
+	}
+	mappedCursorStart(cur, prev / SAVED_BLOCK);
+	while (cur->index < prev) {
+		mappedCursorStep(cur);
+	}
+	return true;
+}
+
+/*
+* Moves a cursor over a mapped multiset to the first element that is not
+* smaller than the item, or that is greater than the item if after is true.
+*/
+static bool mappedCursorSeek(MsetCursor cur, int item, bool after) {
+	if (cur->s->size == 0) {
+		cur->index = -1;
+		cur->atEnd = true;
+		return false;
+	}
+	int b = mappedBlockOf(cur->s->mapped, item, after);
+
+	//the element is in block b or is the first element of the next block.
+	mappedCursorStart(cur, b < 0 ? 0 : b);
+	while (cur->item.elem < item || (after && cur->item.elem == item)) {
+		if (!mappedCursorNext(cur)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+* Returns the sum of the counts of the elements of a mapped multiset that are
+* smaller than the item, or smaller or equal if inclusive is true.
+*/
+static int mappedCountBelow(Mset s, int item, bool inclusive) {
+	struct cursor cur;
+	cursorInit(&cur, s, NULL);
+	if (!mappedCursorSeek(&cur, item, inclusive)) {
+		return s->totalCount;
+	}
+
+	//adds up the counts from the start of the block to the cursor.
+	int end = cur.index;
+	int b = end / SAVED_BLOCK;
+	int total = s->mapped->blocks[b].countBefore;
+	for (mappedCursorStart(&cur, b); cur.index < end; mappedCursorStep(&cur)) {
+		total += cur.item.count;
+	}
+	return total;
+}
+
+/*
+* Returns the element at the given index of a mapped multiset, which must be
+* between 0 and the size of the multiset - 1.
+*/
+static struct item mappedSelect(Mset s, int index) {
+	struct cursor cur;
+	cursorInit(&cur, s, NULL);
+	mappedCursorStart(&cur, index / SAVED_BLOCK);
+	while (cur.index < index) {
+		mappedCursorStep(&cur);
+	}
+	return cur.item;
+}
+
+/*
+* Returns the element at the given position of a mapped multiset, which must be
+* between 0 and the total count of the multiset - 1, found through the sums of
+* the counts before each block.
+*/
+static struct item mappedSelectByCount(Mset s, int position) {
+	int lo = 0;
+	int hi = s->mapped->nBlocks;
+	while (hi - lo > 1) {
+		int mid = lo + (hi - lo) / 2;
+		if (s->mapped->blocks[mid].countBefore <= position) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+
+	struct cursor cur;
+	cursorInit(&cur, s, NULL);
+	mappedCursorStart(&cur, lo);
+	int total = s->mapped->blocks[lo].countBefore;
+	while (total + cur.item.count <= position) {
+		total += cur.item.count;
+		mappedCursorStep(&cur);
+	}
+	return cur.item;
+}
+
+/*
+* Stores the k most common elements of a mapped multiset into items and
+* returns the number stored. Once the heap is full, blocks whose greatest count
+* is not above the least common element of the heap are skipped without being
+* read, since their elements all come after it in order too.
+*/
+static int mappedMostCommon(Mset s, int k, struct item items[]) {
+	int n = 0;
+	struct cursor cur;
+	cursorInit(&cur, s, NULL);
+	for (int b = 0; b < s->mapped->nBlocks; b++) {
+		if (n == k && s->mapped->blocks[b].maxCount <= items[0].count) {
+			continue;
+		}
+
+		int end = b * SAVED_BLOCK + SAVED_BLOCK;
+		if (end > s->size) {
+			end = s->size;
+		}
+		mappedCursorStart(&cur, b);
+		while (true) {
+			if (n < k) {
+				items[n] = cur.item;
+				heapSiftUp(items, n);
+				n++;
+			} else if (moreCommon(cur.item, items[0])) {
+				items[0] = cur.item;
+				heapSiftDown(items, 0, n);
+			}
+			if (cur.index == end - 1) {
+				break;
+			}
+			mappedCursorStep(&cur);
+		}
+	}
+
+	heapSort(items, n);
+	return n;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Statistics
+// Built with MSET_STATS, each multiset keeps counters of what its operations
+// do and a histogram of the latencies of its calls. The counters are updated
+// with relaxed atomic adds, since concurrent readers share them. Without
+// MSET_STATS the hooks at the top of the file expand to nothing and only
+// MsetGetStats remains.
+
+/**
+ * Stores the statistics of the multiset into stats and returns true if
+ * the library was built with MSET_STATS. Otherwise stores zeros and
+ * returns false. The counters are kept per multiset from its creation,
+ * and those of a sharded multiset only cover calls made on it, which
+ * its shards keep counters of their own for.
+ */
+bool MsetGetStats(Mset s, struct msetStats *stats) {
+#ifdef MSET_STATS
+	readLock(s);
+	*stats = s->stats;
+	stats->bytesInUse = statsBytes(s);
+	readUnlock(s);
+	return true;
+#else
+	(void)s;
+	memset(stats, 0, sizeof(struct msetStats));
+	return false;
+#endif
+}
+
+#ifdef MSET_STATS
+/*
+* Returns the current time in nanoseconds.
+*/
+static uint64_t statsNow(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+* Adds a call that started at the given time to the histogram of its kind of
+* call, in the bucket of the highest bit of its latency.
+*/
+static void statsCall(Mset s, int call, uint64_t start) {
+	uint64_t elapsed = statsNow() - start;
+	int bucket = 63 - __builtin_clzll(elapsed | 1);
+	if (bucket >= MSET_STATS_BUCKETS) {
+		bucket = MSET_STATS_BUCKETS - 1;
+	}
+	STATS_ADD(s, latency[call][bucket], 1);
+}
+
+/*
+* Counts the rotation that avlRebalance is about to make at tree, if any, by
+* the same tests that it makes.
+*/
+static void statsRotation(Mset s, struct node *tree) {
+	int bal = balance(tree);
+	if (bal > 1) {
+		if (balance(tree->left) < 0) {
+			STATS_ADD(s, doubleRotations, 1);
+		} else {
+			STATS_ADD(s, singleRotations, 1);
+		}
+	} else if (bal < -1) {
+		if (balance(tree->right) > 0) {
+			STATS_ADD(s, doubleRotations, 1);
+		} else {
+			STATS_ADD(s, singleRotations, 1);
+		}
+	}
+}
+
+/*
+* Keeps the greatest height of the multiset's tree up to date after a change,
+* where a single node has height 1. Only called by the writer.
+*/
+static void statsHeight(Mset s) {
+	int height = s->kind == KIND_BTREE ? s->btree->height + 1 : 0;
+	if (s->kind == KIND_COMPACT) {
+		height = compactHeight(&s->compact->nodes[s->compact->root]);
+	} else if (s->tree != NULL) {
+		height = s->tree->height + 1;
+	}
+	if (height > s->stats.peakHeight) {
+		s->stats.peakHeight = height;
+	}
+}
+
+/*
+* Returns the number of bytes held by a multiset that is locked for reading,
+* counting its nodes, arrays and indexes but not the allocator's overheads.
+*/
+static size_t statsBytes(Mset s) {
+	size_t bytes = sizeof(struct mset);
+	if (s->pool != NULL) {
+		for (struct nodeSlab *slab = s->pool->slabs; slab != NULL;
+			slab = slab->next) {
+			bytes += sizeof(struct nodeSlab) +
+			slab->capacity * sizeof(struct node);
+		}
+	} else if (s->kind == KIND_AVL || s->kind == KIND_SNAPSHOT) {
+		bytes += (size_t)s->size * sizeof(struct node);
+		if (s->flags & MSET_COUNT_INDEX) {
+			bytes += (size_t)s->size * sizeof(struct node);
+		}
+	}
+
+	if (s->kind == KIND_BTREE && s->btree->root != NULL) {
+		bytes += statsBtreeBytes(s->btree->root, s->btree->height);
+	} else if (s->kind == KIND_DENSE) {
+		int range = denseRange(s->dense);
+		bytes += range * sizeof(int) + (range + 63) / 64 * sizeof(uint64_t);
+	} else if (s->kind == KIND_MAPPED) {
+		bytes += sizeof(struct mapped) + s->mapped->length;
+	} else if (s->kind == KIND_COMPACT) {
+		bytes += sizeof(struct compact) +
+		(size_t)s->compact->capacity * sizeof(struct cnode);
+		if (s->flags & MSET_COUNT_INDEX) {
+			bytes += (size_t)s->size * sizeof(struct node);
+		}
+	} else if (s->kind == KIND_SHARDED) {
+		for (int i = 0; i < s->shards->n; i++) {
+			Mset part = s->shards->parts[i];
+			readLock(part);
+			bytes += statsBytes(part);
+			readUnlock(part);
+		}
+	}
+	if (s->lookup != NULL) {
+		bytes += 2 * (size_t)s->lookup->capacity * LOOKUP_BLOCK * sizeof(int);
+	}
+	return bytes;
+}
+
+/*
+* Returns the number of bytes taken by the nodes of a B+ tree below the given
+* node, which has the given number of inner levels below it.
+*/
+static size_t statsBtreeBytes(void *node, int height) {
+	if (height == 0) {
+		return sizeof(struct bleaf);
+	}
+	struct binner *inner = node;
+	size_t bytes = sizeof(struct binner);
+	for (int i = 0; i <= inner->size; i++) {
+		bytes += statsBtreeBytes(inner->children[i], height - 1);
+	}
+	return bytes;
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////
+// Compact Multisets
+// A multiset made with MSET_COMPACT keeps an AVL tree whose nodes live in one
+// array that doubles when it is full. Nodes link to their children by 32-bit
+// indexes into the array, where 0 is a node that is always empty and stands in
+// for a missing child, and the size and height of each subtree share one word.
+// There is no list of the nodes, so cursors search the tree for the element
+// next to theirs. Since the array may move when a node is allocated, nothing
+// holds a pointer to a node across an allocation.
+
+/*
+* Creates the empty node array of a compact multiset.
+*/
+static struct compact *compactNew(void) {
+	struct compact *compact = malloc(sizeof(struct compact));
+	if (compact == NULL) {
+		printNullError();
+	}
+	compact->nodes = NULL;
+	compact->capacity = 0;
+	compactReserve(compact, COMPACT_MIN_NODES);
+	memset(&compact->nodes[0], 0, sizeof(struct cnode));
+	compact->used = 1;
+	compact->root = 0;
+	compact->freeList = 0;
+	return compact;
+}
+
+/*
+* Frees the node array of a compact multiset.
+*/
+static void compactFree(struct compact *compact) {
+	free(compact->nodes);
+	free(compact);
+}
+
+/*
+* Makes room for at least n nodes, including the empty node, by at least
+* doubling the array.
+*/
+static void compactReserve(struct compact *compact, uint32_t n) {
+	if (n <= compact->capacity) {
+		return;
+	}
+	uint32_t capacity = compact->capacity * 2;
+	if (capacity < n) {
+		capacity = n;
+	}
+
+	struct cnode *nodes = realloc(compact->nodes,
+	(size_t)capacity * sizeof(struct cnode));
+	if (nodes == NULL) {
+		printNullError();
+	}
+	compact->nodes = nodes;
+	compact->capacity = capacity;
+}
+
+/*
+* Returns the index of a new leaf with the given item and amount, reusing a
+* freed node if there is one. The array may move.
+*/
+static uint32_t compactAlloc(Mset s, int item, int amount) {
+	struct compact *compact = s->compact;
+	uint32_t i = compact->freeList;
+	if (i != 0) {
+		compact->freeList = compact->nodes[i].left;
+	} else {
+		compactReserve(compact, compact->used + 1);
+		i = compact->used++;
+	}
+
+	struct cnode *node = &compact->nodes[i];
+	node->elem = item;
+	node->count = amount;
+	node->left = 0;
+	node->right = 0;
+	node->subTreeCount = amount;
+	node->shape = 1 << COMPACT_HEIGHT_BITS | 1;
+	STATS_ADD(s, nodeAllocs, 1);
+	return i;
+}
+
+/*
+* Puts a node on the free list. Its count is set to 0, which tells it apart
+* from the nodes in the tree when the array is scanned.
+*/
+static void compactRelease(Mset s, uint32_t i) {
+	struct cnode *node = &s->compact->nodes[i];
+	node->count = 0;
+	node->left = s->compact->freeList;
+	s->compact->freeList = i;
+	STATS_ADD(s, nodeFrees, 1);
+}
+
+/*
+* Returns the number of nodes in the subtree rooted at the node, which is 0 for
+* the empty node.
+*/
+static int compactSize(const struct cnode *node) {
+	return node->shape >> COMPACT_HEIGHT_BITS;
+}
+
+/*
+* Returns the height of the subtree rooted at the node, where a leaf has height
+* 1 and the empty node height 0.
+*/
+static int compactHeight(const struct cnode *node) {
+	return node->shape & ((1 << COMPACT_HEIGHT_BITS) - 1);
+}
+
+/*
+* Recomputes the size, height and count of the subtree rooted at node i from
+* its children.
+*/
+static void compactUpdate(struct cnode *nodes, uint32_t i) {
+	struct cnode *node = &nodes[i];
+	const struct cnode *left = &nodes[node->left];
+	const struct cnode *right = &nodes[node->right];
+	int height = compactHeight(left) > compactHeight(right) ?
+	compactHeight(left) : compactHeight(right);
+	uint32_t size = compactSize(left) + compactSize(right) + 1;
+	node->shape = size << COMPACT_HEIGHT_BITS | (height + 1);
+	node->subTreeCount = left->subTreeCount + node->count +
+	right->subTreeCount;
+}
+
+/*
+* Recomputes the size and count of the subtree rooted at node i from its
+* children, keeping its height.
+*/
+static void compactUpdateTotals(struct cnode *nodes, uint32_t i) {
+	struct cnode *node = &nodes[i];
+	const struct cnode *left = &nodes[node->left];
+	const struct cnode *right = &nodes[node->right];
+	uint32_t size = compactSize(left) + compactSize(right) + 1;
+	node->shape = size << COMPACT_HEIGHT_BITS | compactHeight(node);
+	node->subTreeCount = left->subTreeCount + node->count +
+	right->subTreeCount;
+}
+
+/*
+* Rotates the subtree rooted at node i to the right and returns its new root.
+*/
+static uint32_t compactRotateRight(struct cnode *nodes, uint32_t i) {
+	uint32_t left = nodes[i].left;
+	nodes[i].left = nodes[left].right;
+	nodes[left].right = i;
+	compactUpdate(nodes, i);
+	compactUpdate(nodes, left);
+	return left;
+}
+
+/*
+* Rotates the subtree rooted at node i to the left and returns its new root.
+*/
+static uint32_t compactRotateLeft(struct cnode *nodes, uint32_t i) {
+	uint32_t right = nodes[i].right;
+	nodes[i].right = nodes[right].left;
+	nodes[right].left = i;
+	compactUpdate(nodes, i);
+	compactUpdate(nodes, right);
+	return right;
+}
+
+/*
+* Updates node i after a change below it and rebalances its subtree the same
+* way as avlRebalance. Returns the new root of the subtree.
+*/
+static uint32_t compactRebalance(Mset s, uint32_t i) {
+	struct cnode *nodes = s->compact->nodes;
+	compactUpdate(nodes, i);
+	struct cnode *node = &nodes[i];
+	int balance = compactHeight(&nodes[node->left]) -
+	compactHeight(&nodes[node->right]);
+
+	if (balance > 1) {
+		struct cnode *left = &nodes[node->left];
+		if (compactHeight(&nodes[left->left]) <
+			compactHeight(&nodes[left->right])) {
+			node->left = compactRotateLeft(nodes, node->left);
+			STATS_ADD(s, doubleRotations, 1);
+		} else {
+			STATS_ADD(s, singleRotations, 1);
+		}
+		return compactRotateRight(nodes, i);
+	} else if (balance < -1) {
+		struct cnode *right = &nodes[node->right];
+		if (compactHeight(&nodes[right->right]) <
+			compactHeight(&nodes[right->left])) {
+			node->right = compactRotateRight(nodes, node->right);
+			STATS_ADD(s, doubleRotations, 1);
+		} else {
+			STATS_ADD(s, singleRotations, 1);
+		}
+		return compactRotateLeft(nodes, i);
+	}
+	return i;
+}
+
+/*
+* Rebalances the nodes on a path from the root bottom-up, in the same way as
+* rebalancePath, hanging each new subtree root from the node above it. Once a
+* subtree keeps its height, the nodes above it only need their sizes and
+* counts updated.
+*/
+static void compactRebalancePath(Mset s, uint32_t path[], int depth) {
+	struct cnode *nodes = s->compact->nodes;
+	bool balanced = false;
+	while (depth > 0) {
+		uint32_t i = path[--depth];
+		if (balanced) {
+			compactUpdateTotals(nodes, i);
+			continue;
+		}
+
+		int oldHeight = compactHeight(&nodes[i]);
+		uint32_t root = compactRebalance(s, i);
+		if (root != i) {
+			compactReplaceChild(s, path, depth, i, root);
+		}
+		balanced = compactHeight(&nodes[root]) == oldHeight;
+	}
+}
+
+/*
+* Makes the last node on the path, or the root if the path is empty, link to
+* node new instead of node old.
+*/
+static void compactReplaceChild(Mset s, uint32_t path[], int depth,
+uint32_t old, uint32_t new) {
+	if (depth == 0) {
+		s->compact->root = new;
+		return;
+	}
+	struct cnode *parent = &s->compact->nodes[path[depth - 1]];
+	if (parent->left == old) {
+		parent->left = new;
+	} else {
+		parent->right = new;
+	}
+}
+
+/*
+* Inserts a positive amount of an item into the compact multiset. totalCount is
+* kept by the caller.
+* It walks down the tree to the item's position, remembering the nodes it
+* passed, and either adds the amount to the item's node or hangs a new leaf
+* there. The path is then rebalanced bottom-up.
+*/
+static void compactInsert(Mset s, int item, int amount) {
+	uint32_t path[MAX_HEIGHT];
+	int depth = 0;
+	uint32_t i = s->compact->root;
+	while (i != 0) {
+		struct cnode *node = &s->compact->nodes[i];
+		if (item == node->elem) {
+			countChanged(s, item, node->count, node->count + amount);
+			node->count += amount;
+			path[depth++] = i;
+			compactRebalancePath(s, path, depth);
+			return;
+		}
+
+		path[depth++] = i;
+		i = item < node->elem ? node->left : node->right;
+	}
+
+	//the new leaf may move the array, so it is hung from its parent
+	//afterwards.
+	uint32_t new = compactAlloc(s, item, amount);
+	s->size++;
+	countChanged(s, item, 0, amount);
+	if (depth == 0) {
+		s->compact->root = new;
+	} else if (item < s->compact->nodes[path[depth - 1]].elem) {
+		s->compact->nodes[path[depth - 1]].left = new;
+	} else {
+		s->compact->nodes[path[depth - 1]].right = new;
+	}
+	compactRebalancePath(s, path, depth);
+}
+
+/*
+* Deletes a positive amount of an item from the compact multiset, removing its
+* node if the amount is at least its count.
+* It walks down the tree to the item's node, remembering the nodes it passed,
+* then subtracts the amount or takes the node out, and rebalances the path
+* bottom-up.
+*/
+static void compactDelete(Mset s, int item, int amount) {
+	struct cnode *nodes = s->compact->nodes;
+	uint32_t path[MAX_HEIGHT];
+	int depth = 0;
+	uint32_t i = s->compact->root;
+	while (i != 0 && nodes[i].elem != item) {
+		path[depth++] = i;
+		i = item < nodes[i].elem ? nodes[i].left : nodes[i].right;
+	}
+	if (i == 0) {
+		return;
+	}
+
+	struct cnode *node = &nodes[i];
+	if (node->count > amount) {
+		countChanged(s, item, node->count, node->count - amount);
+		node->count -= amount;
+		s->totalCount -= amount;
+		path[depth++] = i;
+		compactRebalancePath(s, path, depth);
+		return;
+	}
+
+	countChanged(s, item, node->count, 0);
+	s->totalCount -= node->count;
+	s->size--;
+	depth = compactDetach(s, path, depth, i);
+	compactRelease(s, i);
+	compactRebalancePath(s, path, depth);
+}
+
+/*
+* Takes node i out of the tree, where path holds the depth nodes above it, in
+* the same way as detachNode: a node with two children is replaced by its
+* successor, the leftmost node of its right subtree, and the path is extended
+* down to the successor's old position. Returns the depth of the path that
+* needs to be rebalanced.
+*/
+static int compactDetach(Mset s, uint32_t path[], int depth, uint32_t i) {
+	struct cnode *nodes = s->compact->nodes;
+	uint32_t left = nodes[i].left;
+	uint32_t right = nodes[i].right;
+	if (left == 0 || right == 0) {
+		compactReplaceChild(s, path, depth, i, left == 0 ? right : left);
+		return depth;
+	}
+
+	//the successor's old position is below the removed node's position,
+	//which will hold the successor itself.
+	int succDepth = depth++;
+	uint32_t succ = right;
+	while (nodes[succ].left != 0) {
+		path[depth++] = succ;
+		succ = nodes[succ].left;
+	}
+
+	if (succ != right) {
+		nodes[path[depth - 1]].left = nodes[succ].right;
+		nodes[succ].right = right;
+	}
+	nodes[succ].left = left;
+	nodes[succ].shape = nodes[i].shape;
+	path[succDepth] = succ;
+	compactReplaceChild(s, path, succDepth, i, succ);
+	return depth;
+}
+
+/*
+* Returns the count of an item in the compact multiset, or 0 if it is not in
+* it.
+*/
+static int compactGetCount(Mset s, int item) {
+	const struct cnode *nodes = s->compact->nodes;
+	uint32_t i = s->compact->root;
+	int depth = 0;
+	while (i != 0 && nodes[i].elem != item) {
+		i = item < nodes[i].elem ? nodes[i].left : nodes[i].right;
+		depth++;
+	}
+	STATS_ADD(s, lookups, 1);
+	STATS_ADD(s, lookupDepth, depth);
+
+	//the empty node has a count of 0.
+	return nodes[i].count;
+}
+
+/*
+* Replaces the nodes of a compact multiset by a height-balanced tree of n items
+* with positive counts in strictly increasing order of element, in O(n) time.
+* size, totalCount and the hash are kept by the caller.
+*/
+static void compactLoad(struct compact *compact, struct item *items, int n) {
+	compactReserve(compact, n + 1);
+	compact->used = n + 1;
+	compact->freeList = 0;
+	compact->root = compactBuild(compact->nodes, items, 0, n);
+}
+
+/*
+* Builds a height-balanced tree out of items lo to hi - 1, storing item j at
+* index j + 1, and returns the index of its root.
+*/
+static uint32_t compactBuild(struct cnode *nodes, struct item *items, int lo,
+int hi) {
+	if (lo >= hi) {
+		return 0;
+	}
+
+	int mid = lo + (hi - lo) / 2;
+	uint32_t i = mid + 1;
+	nodes[i].elem = items[mid].elem;
+	nodes[i].count = items[mid].count;
+	nodes[i].left = compactBuild(nodes, items, lo, mid);
+	nodes[i].right = compactBuild(nodes, items, mid + 1, hi);
+	compactUpdate(nodes, i);
+	return i;
+}
+
+/*
+* Stores the items of the subtree rooted at node i into items in increasing
+* order of element, starting at items[n], and returns the number of items
+* stored so far.
+*/
+static int compactCollect(const struct cnode *nodes, uint32_t i,
+struct item *items, int n) {
+	while (i != 0) {
+		n = compactCollect(nodes, nodes[i].left, items, n);
+		items[n++] = (struct item){nodes[i].elem, nodes[i].count};
+		i = nodes[i].right;
+	}
+	return n;
+}
+
+/*
+* Merges a sorted batch of distinct items into the compact multiset and
+* rebuilds the tree from the merged items, so the whole batch takes
+* O(size + n) time and no rotations.
+*/
+static void compactInsertBatch(Mset s, struct item *batch, int n) {
+	struct item *old = malloc((s->size + 1) * sizeof(struct item));
+	struct item *merged = malloc((s->size + n + 1) * sizeof(struct item));
+	if (old == NULL || merged == NULL) {
+		printNullError();
+	}
+	int size = compactCollect(s->compact->nodes, s->compact->root, old, 0);
+
+	int m = 0;
+	int i = 0;
+	int j = 0;
+	while (i < size || j < n) {
+		if (j < n && (i == size || batch[j].elem < old[i].elem)) {
+			merged[m++] = batch[j];
+			s->size++;
+			countChanged(s, batch[j].elem, 0, batch[j].count);
+			j++;
+		} else {
+			merged[m] = old[i++];
+			if (j < n && batch[j].elem == merged[m].elem) {
+				countChanged(s, merged[m].elem, merged[m].count,
+				merged[m].count + batch[j].count);
+				merged[m].count += batch[j].count;
+				j++;
+			}
+			m++;
+		}
+	}
+
+	for (j = 0; j < n; j++) {
+		s->totalCount += batch[j].count;
+	}
+	compactLoad(s->compact, merged, m);
+	free(merged);
+	free(old);
+}
+
+/*
+* Moves the elements of a compact multiset into an ordinary AVL tree, which
+* happens when it would grow past COMPACT_MAX_SIZE elements.
+*/
+static void compactToTree(Mset s) {
+	struct item *items = malloc((s->size + 1) * sizeof(struct item));
+	if (items == NULL) {
+		printNullError();
+	}
+	int n = compactCollect(s->compact->nodes, s->compact->root, items, 0);
+
+	//the items are loaded into the multiset as if it were new, which adds
+	//them to the count index again.
+	compactFree(s->compact);
+	s->compact = NULL;
+	s->kind = KIND_AVL;
+	freeTree(s->countTree);
+	s->countTree = NULL;
+	s->size = 0;
+	s->totalCount = 0;
+	s->hash = 0;
+	loadItems(s, items, n);
+	free(items);
+}
+
+/*
+* Returns the index of the node with the smallest element that is greater than
+* or equal to the item, or strictly greater if after is true, or 0 if there is
+* none.
+*/
+static uint32_t compactLowerBound(struct compact *compact, int item,
+bool after) {
+	const struct cnode *nodes = compact->nodes;
+	uint32_t found = 0;
+	uint32_t i = compact->root;
+	while (i != 0) {
+		if (nodes[i].elem > item || (!after && nodes[i].elem == item)) {
+			found = i;
+			i = nodes[i].left;
+		} else {
+			i = nodes[i].right;
+		}
+	}
+	return found;
+}
+
+/*
+* Returns the index of the node with the greatest element that is smaller than
+* or equal to the item, or strictly smaller if before is true, or 0 if there is
+* none.
+*/
+static uint32_t compactUpperBound(struct compact *compact, int item,
+bool before) {
+	const struct cnode *nodes = compact->nodes;
+	uint32_t found = 0;
+	uint32_t i = compact->root;
+	while (i != 0) {
+		if (nodes[i].elem < item || (!before && nodes[i].elem == item)) {
+			found = i;
+			i = nodes[i].right;
+		} else {
+			i = nodes[i].left;
+		}
+	}
+	return found;
+}
+
+/*
+* Moves a cursor of a compact multiset to the next element, or the previous one
+* if forward is false, by searching the tree for the nearest element on that
+* side of the cursor's element.
+*/
+static bool compactCursorMove(MsetCursor cur, bool forward) {
+	struct compact *compact = cur->s->compact;
+	uint32_t found = 0;
+	if (cur->index >= 0) {
+		int elem = compact->nodes[cur->index].elem;
+		found = forward ? compactLowerBound(compact, elem, true)
+		: compactUpperBound(compact, elem, true);
+	} else if (forward != cur->atEnd) {
+		//the cursor is at the start moving forward, or at the end moving back.
+		found = forward ? compactLowerBound(compact, INT_MIN, false)
+		: compactUpperBound(compact, INT_MAX, false);
+	}
+
+	if (found == 0) {
+		cur->index = -1;
+		cur->atEnd = forward;
+		return false;
+	}
+	cur->index = found;
+	return true;
+}
+
+/*
+* Moves a cursor of a compact multiset to the first element that is not smaller
+* than the item, or the first element that is greater if after is true.
+*/
+static bool compactCursorSeek(MsetCursor cur, int item, bool after) {
+	uint32_t found = compactLowerBound(cur->s->compact, item, after);
+	cur->index = found != 0 ? (int)found : -1;
+	cur->atEnd = found == 0;
+	return found != 0;
+}
+
+/*
+* Returns the number of distinct elements of the compact multiset that are
+* smaller than the item.
+*/
+static int compactRank(struct compact *compact, int item) {
+	const struct cnode *nodes = compact->nodes;
+	int rank = 0;
+	uint32_t i = compact->root;
+	while (i != 0) {
+		if (nodes[i].elem < item) {
+			rank += compactSize(&nodes[nodes[i].left]) + 1;
+			i = nodes[i].right;
+		} else {
+			i = nodes[i].left;
+		}
+	}
+	return rank;
+}
+
+/*
+* Returns the element with the given index, which is between 0 and size - 1,
+* of the compact multiset.
+*/
+static struct item compactSelect(struct compact *compact, int index) {
+	const struct cnode *nodes = compact->nodes;
+	uint32_t i = compact->root;
+	while (index != compactSize(&nodes[nodes[i].left])) {
+		int leftSize = compactSize(&nodes[nodes[i].left]);
+		if (index < leftSize) {
+			i = nodes[i].left;
+		} else {
+			index -= leftSize + 1;
+			i = nodes[i].right;
+		}
+	}
+	return (struct item){nodes[i].elem, nodes[i].count};
+}
+
+/*
+* Returns the element at the given position, which is between 0 and
+* totalCount - 1, of the compact multiset.
+*/
+static struct item compactSelectByCount(struct compact *compact,
+int position) {
+	const struct cnode *nodes = compact->nodes;
+	uint32_t i = compact->root;
+	while (true) {
+		int leftCount = nodes[nodes[i].left].subTreeCount;
+		if (position < leftCount) {
+			i = nodes[i].left;
+		} else if (position < leftCount + nodes[i].count) {
+			return (struct item){nodes[i].elem, nodes[i].count};
+		} else {
+			position -= leftCount + nodes[i].count;
+			i = nodes[i].right;
+		}
+	}
+}
+
+/*
+* Returns the sum of the counts of the elements of the compact multiset that
+* are smaller than the item, or smaller or equal if inclusive is true.
+*/
+static int compactCountBelow(struct compact *compact, int item,
+bool inclusive) {
+	const struct cnode *nodes = compact->nodes;
+	int total = 0;
+	uint32_t i = compact->root;
+	while (i != 0) {
+		if (nodes[i].elem < item || (inclusive && nodes[i].elem == item)) {
+			total += nodes[nodes[i].left].subTreeCount + nodes[i].count;
+			i = nodes[i].right;
+		} else {
+			i = nodes[i].left;
+		}
+	}
+	return total;
+}
+
+/*
+* Stores the k most common elements of a compact multiset into items by
+* scanning its node array in order of index rather than of element, skipping
+* the freed nodes.
+*/
+static int compactMostCommon(Mset s, int k, struct item items[]) {
+	const struct cnode *nodes = s->compact->nodes;
+	int n = 0;
+	for (uint32_t i = 1; i < s->compact->used; i++) {
+		if (nodes[i].count == 0) {
+			continue;
+		}
+		struct item newItem = {nodes[i].elem, nodes[i].count};
+		if (n < k) {
+			items[n] = newItem;
+			heapSiftUp(items, n);
+			n++;
+		} else if (moreCommon(newItem, items[0])) {
+			items[0] = newItem;
+			heapSiftDown(items, 0, n);
+		}
+	}
+
+	heapSort(items, n);
+	return n;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Multisets Without a List
+// A multiset made with MSET_NO_LIST does not keep the next and prev links of
+// its nodes, which saves every insert and delete from writing to the nodes on
+// either side of the change. Its cursors, and those of snapshots, keep the
+// path from the root down to their node instead, so the next element is the
+// leftmost node of the right subtree or the nearest ancestor the path went
+// left at. A walk over the whole multiset still takes O(1) time per move on
+// average, though a single move may take O(log n). The operations that walk
+// the list build it from the tree first, which they can afford since they take
+// O(n) time anyway.
+
+/*
+* Checks if the cursors of the multiset keep their path down the tree, which
+* those of snapshots and of AVL multisets without a list do.
+*/
+static bool keepsPath(Mset s) {
+	return s->kind == KIND_SNAPSHOT ||
+	(s->kind == KIND_AVL && (s->flags & MSET_NO_LIST));
+}
+
+/*
+* Makes room for the path of a cursor made by MsetCursorNew the first time it
+* needs one, so that the other cursors do not carry it. Only the start or end
+* of the multiset or a seek can put a cursor on a node without a path.
+*/
+static void treeCursorReserve(MsetCursor cur) {
+	if (cur->path == NULL) {
+		cur->path = malloc(MAX_HEIGHT * sizeof(struct node *));
+		if (cur->path == NULL) {
+			printNullError();
+		}
+	}
+}
+
+/*
+* Moves a cursor that keeps its path to the next element, or the previous one if
+* forward is false.
+*/
+static bool treeCursorMove(MsetCursor cur, bool forward) {
+	if (cur->curr == NULL) {
+		if (forward == cur->atEnd) {
+			//the cursor is at the end moving forward, or at the start moving
+			//back.
+			return false;
+		}
+		treeCursorReserve(cur);
+		cur->depth = 0;
+		treeCursorDescend(cur, cur->s->tree, forward);
+	} else {
+		struct node *child = forward ? cur->curr->right : cur->curr->left;
+		if (child != NULL) {
+			treeCursorDescend(cur, child, forward);
+		} else {
+			//climbs until the path comes up to a node from its near side.
+			do {
+				child = cur->path[--cur->depth];
+			} while (cur->depth > 0 && child == (forward
+			? cur->path[cur->depth - 1]->right
+			: cur->path[cur->depth - 1]->left));
+		}
+	}
+
+	cur->curr = cur->depth > 0 ? cur->path[cur->depth - 1] : NULL;
+	if (cur->curr == NULL) {
+		cur->atEnd = forward;
+		return false;
+	}
+	return true;
+}
+
+/*
+* Adds the nodes from tree down to its leftmost node to the cursor's path, or
+* down to its rightmost node if forward is false.
+*/
+static void treeCursorDescend(MsetCursor cur, struct node *tree,
+bool forward) {
+	while (tree != NULL) {
+		cur->path[cur->depth++] = tree;
+		tree = forward ? tree->left : tree->right;
+	}
+}
+
+/*
+* Moves a cursor that keeps its path to the first element that is not smaller
+* than the item, or the first element that is greater if after is true, keeping
+* the path to the node bstLowerBound would find.
+*/
+static bool treeCursorSeek(MsetCursor cur, int item, bool after) {
+	treeCursorReserve(cur);
+	int found = 0;
+	cur->depth = 0;
+	struct node *tree = cur->s->tree;
+	while (tree != NULL) {
+		cur->path[cur->depth++] = tree;
+		if (tree->elem > item || (!after && tree->elem == item)) {
+			found = cur->depth;
+			tree = tree->left;
+		} else {
+			tree = tree->right;
+		}
+	}
+
+	cur->depth = found;
+	cur->curr = found > 0 ? cur->path[found - 1] : NULL;
+	cur->atEnd = cur->curr == NULL;
+	return cur->curr != NULL;
+}
+
+/*
+* Links the nodes of a multiset without a list into a list in order with an
+* in-order walk, for the operations that walk the list. finishList drops the
+* list again.
+*/
+static void threadList(Mset s) {
+	struct node *stack[MAX_HEIGHT];
+	int depth = 0;
+	struct node *prev = NULL;
+	struct node *curr = s->tree;
+	s->listBegin = NULL;
+
+	while (curr != NULL || depth > 0) {
+		if (curr != NULL) {
+			stack[depth++] = curr;
+			curr = curr->left;
+		} else {
+			curr = stack[--depth];
+			curr->prev = prev;
+			if (prev != NULL) {
+				prev->next = curr;
+			} else {
+				s->listBegin = curr;
+			}
+			prev = curr;
+			curr = curr->right;
+		}
+	}
+	if (prev != NULL) {
+		prev->next = NULL;
+	}
+	s->listEnd = prev;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Stale Cursors
+// Every change to a multiset moves its epoch on, and a cursor keeps the epoch
+// it last moved at together with a copy of the element it is on. Comparing the
+// two tells in O(1) time whether the cursor's node may have been freed or
+// moved, in which case the cursor finds its element again with a seek before
+// it moves, and moves from where the element was if it has been deleted. This
+// is the rule cursors of concurrent multisets follow with their version, and
+// it lets a long scan run over a multiset that is changing, at the cost of a
+// seek after each change.
+
+/*
+* Checks if the multiset has changed since the cursor last moved.
+*/
+static bool cursorStale(MsetCursor cur) {
+	return cur->epoch != cur->s->epoch;
+}
+
+/*
+* Keeps a copy of the element at the cursor and the epoch of the multiset after
+* the cursor moves.
+*/
+static void cursorKeep(MsetCursor cur) {
+	cur->item = cursorGet(cur);
+	cur->epoch = cur->s->epoch;
+}
+
+/*
+* Puts a stale cursor back on the element it was on, or if the element has been
+* deleted, just before the element that followed it when forward is true and
+* just after the element that preceded it otherwise, so that the next move in
+* that direction lands on the right element.
+*/
+static void cursorRecover(MsetCursor cur, bool forward) {
+	struct item item = cur->item;
+	bool atEnd = cur->atEnd;
+	//the representation may have changed too, so the cursor starts afresh.
+	cursorInit(cur, cur->s, cur->path);
+	if (item.elem == UNDEFINED) {
+		//the start and the end stay where they are.
+		cur->atEnd = atEnd;
+	} else if (cursorSeek(cur, item.elem, false) &&
+		cursorGet(cur).elem == item.elem) {
+		return;
+	} else if (forward) {
+		//the seek went to the element after, so the cursor steps back.
+		cursorPrev(cur);
+	}
+}
+
+/*
+* Returns the element a stale cursor is on with its count now, or as it was
+* when the cursor reached it if it has been deleted.
+*/
+static struct item staleCursorGet(MsetCursor cur) {
+	if (cur->item.elem == UNDEFINED) {
+		return cur->item;
+	}
+	int count = doMsetGetCount(cur->s, cur->item.elem);
+	if (count == 0) {
+		return cur->item;
+	}
+	return (struct item){cur->item.elem, count};
 }
 
 ////////////////////////////////////////////////////////////////////////
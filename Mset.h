@@ -1,16 +1,25 @@
 // COMP2521 24T3 - Assignment 1
 // Interface to the Multiset ADT
 
-// !!! DO NOT MODIFY THIS FILE !!!
-
 #ifndef MSET_H
 #define MSET_H
 
 #include <limits.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
 
 #define UNDEFINED INT_MIN
 
+// Options for MsetNewWithFlags
+#define MSET_NODE_POOL 0x1   // allocate nodes from per-multiset slabs
+#define MSET_COUNT_INDEX 0x2 // keep elements ordered by count as well
+#define MSET_BTREE 0x4       // store the elements in a B+ tree
+#define MSET_LOOKUP_INDEX 0x8 // keep a read-optimised copy for lookups
+#define MSET_CONCURRENT 0x10  // allow use from several threads at once
+#define MSET_COMPACT 0x20     // link nodes by 32-bit indexes into one array
+#define MSET_NO_LIST 0x40     // do not keep the nodes in an in-order list
+
 typedef struct mset *Mset;
 
 // Used by MsetMostCommon and MsetCursorGet
@@ -27,6 +36,106 @@ struct item {
  */
 Mset MsetNew(void);
 
+/**
+ * Creates a new empty multiset with the given options, which are
+ * MSET_* flags combined with bitwise or. Multisets returned by set
+ * operations such as MsetUnion have the same options as the first
+ * multiset given.
+ *
+ * MSET_NODE_POOL: nodes are carved out of large slabs owned by the
+ * multiset and freed nodes are reused, so inserting rarely calls
+ * malloc and MsetFree only frees the slabs.
+ *
+ * MSET_COUNT_INDEX: a second tree ordered by decreasing count is kept
+ * up to date on every insert and delete, so MsetMostCommon takes
+ * O(k + log n) time instead of O(n log k). Every change of a count
+ * costs an extra O(log n) and each element needs a second node.
+ *
+ * MSET_BTREE: the elements are stored in a B+ tree with up to 64
+ * sorted elements per leaf instead of an AVL tree. A lookup reads a few
+ * contiguous arrays rather than one node per level, and each element
+ * takes about 12 bytes instead of 56, so large multisets are searched
+ * with far fewer cache misses. MSET_NODE_POOL has no effect with it.
+ *
+ * MSET_LOOKUP_INDEX: MsetGetCount, and the lookups made by
+ * MsetIncluded and MsetIntersection when one multiset is much smaller,
+ * search a copy of the elements laid out in cache-line blocks that are
+ * compared with SIMD instructions. The copy is rebuilt in O(n) time
+ * once MsetGetCount has been called size / 8 times since the last
+ * change, so it suits multisets that are read far more than written.
+ * Since MsetGetCount counts its calls and may rebuild the copy, it
+ * changes the multiset even though it only reads it, so threads must
+ * not call it, MsetIncluded or MsetIntersection on the same multiset at
+ * once, unlike other reads of an unchanging multiset. MSET_CONCURRENT
+ * ignores this flag, and snapshots do not keep the copy.
+ *
+ * MSET_CONCURRENT: the multiset may be used by several threads at once.
+ * Any number of threads can read at once while no thread is changing
+ * the multiset. Reads in different threads do not contend with each
+ * other, up to 32 threads, while a change waits for every read under
+ * way and makes new reads wait until it ends. MsetSize and
+ * MsetTotalCount never wait. A cursor that moves after the multiset
+ * has changed continues from the element it was on, or from where that
+ * element was if it has been deleted. MSET_BTREE, MSET_LOOKUP_INDEX,
+ * MSET_COMPACT and MSET_NO_LIST are ignored.
+ *
+ * MSET_COMPACT: the AVL tree's nodes are kept in one growable array and
+ * link to each other by 32-bit indexes, with the height packed in with
+ * the subtree size, so each element takes 24 bytes instead of 56. There
+ * is no list through the nodes, so each cursor move searches the tree
+ * in O(log n) time. A multiset that grows past 2^26 - 1 distinct
+ * elements moves to an ordinary tree. MSET_NODE_POOL has no effect with
+ * it, and MSET_BTREE takes precedence over it.
+ *
+ * MSET_NO_LIST: the AVL tree's nodes are not linked into a list in
+ * order, so inserts and deletes do not touch the nodes next to the
+ * change. Cursors keep the path from the root to their element instead,
+ * which takes O(1) time per move on average but up to O(log n) for one
+ * move, where the list takes O(1) for every move. Operations on whole
+ * multisets are not affected. It has no effect with MSET_BTREE or
+ * MSET_COMPACT, which keep no list anyway.
+ */
+Mset MsetNewWithFlags(int flags);
+
+/**
+ * Creates a new empty multiset for elements from lo to hi inclusive,
+ * which keeps a count for every element in that range in a flat array
+ * with a bitmap of the elements that are present. Inserts, deletes and
+ * MsetGetCount take O(1) time, and the union and intersection of two
+ * such multisets over the same range are worked out slot by slot. The
+ * order statistics take time proportional to hi - lo. Inserting an
+ * element outside the range moves the elements into an ordinary
+ * multiset. If lo is greater than hi or hi - lo does not fit in an int,
+ * an ordinary multiset is returned.
+ */
+Mset MsetNewDense(int lo, int hi);
+
+/**
+ * Creates a new empty multiset that is split into nShards concurrent
+ * multisets (see MSET_CONCURRENT) by element range. The elements from
+ * lo to hi are cut into nShards equal ranges, elements below lo go to
+ * the first shard and elements above hi to the last. Each shard has its
+ * own lock and counters, so threads changing elements of different
+ * shards do not wait on each other. Cursors and the order statistics
+ * go through the shards in order. The union, intersection, inclusion
+ * and equality of two multisets split the same way are worked out shard
+ * by shard, and the union and intersection are split the same way too;
+ * otherwise they work on a copy of the elements. If nShards is less
+ * than 1 or lo is greater than hi, a single shard is used, and at most
+ * 1024 shards are used.
+ */
+Mset MsetNewSharded(int nShards, int lo, int hi);
+
+/**
+ * Creates a new multiset holding the given n items, which should be in
+ * strictly increasing order of element. Items equal to UNDEFINED or
+ * with a count of 0 or less are skipped. Sorted items are loaded in a
+ * single O(n) pass that builds a perfectly balanced tree; items that
+ * turn out not to be sorted are inserted as with MsetInsertBatch. The
+ * new multiset has the MSET_NODE_POOL option.
+ */
+Mset MsetFromSortedItems(const struct item *items, size_t n);
+
 /**
  * Frees all memory allocated to the multiset.
  */
@@ -44,6 +153,15 @@ void MsetInsert(Mset s, int item);
  */
 void MsetInsertMany(Mset s, int item, int amount);
 
+/**
+ * Inserts amounts[i] of items[i] into the multiset for each i from 0 to
+ * n - 1, or one of each item if amounts is NULL. Items equal to
+ * UNDEFINED and amounts of 0 or less are skipped. The items do not need
+ * to be sorted or distinct: the batch is sorted and merged into the
+ * multiset in a single pass when it is large compared to the multiset.
+ */
+void MsetInsertBatch(Mset s, const int *items, const int *amounts, size_t n);
+
 /**
  * Deletes one of an item from the multiset.
  */
@@ -54,6 +172,30 @@ void MsetDelete(Mset s, int item);
  */
 void MsetDeleteMany(Mset s, int item, int amount);
 
+/**
+ * Turns on write combining for the multiset, for streams of inserts
+ * that repeat the same elements often. Each thread's inserts are added
+ * up per element in a small buffer of its own, and once threshold
+ * distinct elements are buffered they are inserted as one sorted batch,
+ * taking the multiset's lock once. The threshold should be about the
+ * number of distinct elements that are inserted often. If flushOnRead
+ * is true, every read and every new cursor flushes the buffers first;
+ * otherwise reads are eventually consistent and only see buffered
+ * inserts once MsetFlush is called or the buffer fills up. Deletes
+ * always flush first. A threshold of 0 or less turns write combining
+ * off after flushing. Must not be called while other threads are using
+ * the multiset. If the multiset is neither MSET_CONCURRENT nor sharded,
+ * the batches of different threads are inserted one at a time, but the
+ * multiset must still not be read while other threads insert into it.
+ */
+void MsetSetWriteCombining(Mset s, int threshold, bool flushOnRead);
+
+/**
+ * Inserts the buffered inserts of every thread into the multiset. Does
+ * nothing if write combining is off.
+ */
+void MsetFlush(Mset s);
+
 /**
  * Returns the number of distinct elements in the multiset.
  */
@@ -94,6 +236,59 @@ Mset MsetUnion(Mset s1, Mset s2);
  */
 Mset MsetIntersection(Mset s1, Mset s2);
 
+/**
+ * Returns a new multiset representing the sum of the two given
+ * multisets, in which the count of each element is the sum of its
+ * counts in the two multisets.
+ */
+Mset MsetSum(Mset s1, Mset s2);
+
+/**
+ * Returns a new multiset representing the difference of the two given
+ * multisets, in which the count of each element is its count in s1
+ * minus its count in s2. Elements whose count would be 0 or less are
+ * left out.
+ */
+Mset MsetDifference(Mset s1, Mset s2);
+
+/**
+ * Returns a new multiset representing the symmetric difference of the
+ * two given multisets, in which the count of each element is the
+ * absolute difference of its counts in the two multisets.
+ */
+Mset MsetSymmetricDifference(Mset s1, Mset s2);
+
+/**
+ * Changes dst into the union of dst and src, without making a new
+ * multiset. An AVL multiset is merged with src in one pass over both
+ * lists, reusing the nodes of the elements it keeps. When src is much
+ * smaller than dst, only the elements of src are looked up and
+ * changed. The same holds for the other functions below, except that
+ * the intersection always walks both. dst and src may be the same
+ * multiset.
+ */
+void MsetUnionInto(Mset dst, Mset src);
+
+/**
+ * Changes dst into the intersection of dst and src.
+ */
+void MsetIntersectionInto(Mset dst, Mset src);
+
+/**
+ * Changes dst into the sum of dst and src.
+ */
+void MsetSumInto(Mset dst, Mset src);
+
+/**
+ * Changes dst into the difference of dst and src.
+ */
+void MsetDifferenceInto(Mset dst, Mset src);
+
+/**
+ * Changes dst into the symmetric difference of dst and src.
+ */
+void MsetSymmetricDifferenceInto(Mset dst, Mset src);
+
 /**
  * Returns true if the multiset s1 is included in the multiset s2, and
  * false otherwise.
@@ -106,6 +301,18 @@ bool MsetIncluded(Mset s1, Mset s2);
  */
 bool MsetEquals(Mset s1, Mset s2);
 
+/**
+ * Sets the number of threads that MsetIncluded and the set operations
+ * that return a new multiset may use, which is 1 to begin with. With
+ * more than one thread, those operations on two AVL multisets with
+ * 65536 or more elements between them split the work by element range:
+ * the root of one tree splits the other in O(log n) time, the two sides
+ * are worked out in different threads, and the results are joined back
+ * into one balanced tree. Must not be called while those operations are
+ * running.
+ */
+void MsetSetParallelism(int threads);
+
 /**
  * Stores the k most common elements in the multiset into the given
  * items array in decreasing order of count and returns the number of
@@ -114,8 +321,45 @@ bool MsetEquals(Mset s1, Mset s2);
  */
 int MsetMostCommon(Mset s, int k, struct item items[]);
 
+////////////////////////////////////////////////////////////////////////
+// Order Statistics
+// These take O(log n) time.
+
+/**
+ * Returns the number of distinct elements in the multiset that are
+ * smaller than the given item.
+ */
+int MsetRank(Mset s, int item);
+
+/**
+ * Returns the element with the given index in increasing order of the
+ * distinct elements, starting from 0, and its count, or {UNDEFINED, 0}
+ * if the index is not between 0 and MsetSize - 1.
+ */
+struct item MsetSelect(Mset s, int index);
+
+/**
+ * Returns the element at the given position, starting from 0, of the
+ * multiset written out in increasing order with each element repeated
+ * as many times as its count, and its count, or {UNDEFINED, 0} if the
+ * position is not between 0 and MsetTotalCount - 1. This is the
+ * weighted quantile: position MsetTotalCount / 2 holds the median and
+ * position MsetTotalCount * 99 / 100 the 99th percentile.
+ */
+struct item MsetSelectByCount(Mset s, int position);
+
+/**
+ * Returns the sum of the counts of the elements of the multiset that
+ * are between lo and hi inclusive.
+ */
+int MsetCountRange(Mset s, int lo, int hi);
+
 ////////////////////////////////////////////////////////////////////////
 // Cursor Operations
+// A cursor may be used while its multiset changes. A move after a change
+// continues from the element the cursor was on, or from where that element
+// was if it has been deleted, and MsetCursorGet returns that element with
+// its count now, or as it was if it has been deleted.
 
 typedef struct cursor *MsetCursor;
 
@@ -153,6 +397,115 @@ bool MsetCursorNext(MsetCursor cur);
  */
 bool MsetCursorPrev(MsetCursor cur);
 
+/**
+ * Moves the cursor to the smallest element that is greater than or
+ * equal to the given item, or to the end of the multiset if there is no
+ * such element. Returns false if the cursor is at the end after this
+ * operation, and true otherwise. Takes O(log n) time.
+ */
+bool MsetCursorSeek(MsetCursor cur, int item);
+
+/**
+ * Moves the cursor to the smallest element that is greater than the
+ * given item, or to the end of the multiset if there is no such
+ * element. Returns false if the cursor is at the end after this
+ * operation, and true otherwise. Takes O(log n) time.
+ */
+bool MsetCursorSeekAfter(MsetCursor cur, int item);
+
+/**
+ * Moves the cursor forward by up to n elements as if by calling
+ * MsetCursorNext n times, storing each element the cursor moves onto
+ * and its count into the given items array, which must have size n.
+ * Stops early at the end of the multiset. Returns the number of
+ * elements stored.
+ */
+int MsetCursorNextN(MsetCursor cur, int n, struct item items[]);
+
+////////////////////////////////////////////////////////////////////////
+// Snapshots
+
+/**
+ * Returns a read-only snapshot of the multiset as it is now, which
+ * later changes to the multiset do not affect. The snapshot of an AVL
+ * multiset shares its tree, so it is taken in O(1) time, and each later
+ * change to the multiset copies the O(log n) nodes it changes that the
+ * snapshot still links to. Snapshots of the other representations are
+ * copies. Inserts and deletes do nothing on a snapshot, and its cursors
+ * walk the tree like those of an MSET_NO_LIST multiset. A snapshot may
+ * be read by other threads while the multiset changes, and is freed
+ * with MsetFree, before or after the multiset.
+ */
+Mset MsetSnapshot(Mset s);
+
+////////////////////////////////////////////////////////////////////////
+// Saved Multisets
+
+/**
+ * Writes the multiset to the given file descriptor in a compact binary
+ * format that MsetOpenMapped can read. Returns true if the whole
+ * multiset was written, and false if a write failed. Files are read on
+ * machines with the same byte order as the one that wrote them.
+ */
+bool MsetSave(Mset s, int fd);
+
+/**
+ * Opens a multiset written by MsetSave by mapping the file at the given
+ * path into memory. The elements are not read, but the table of one
+ * entry per 64 elements is checked, so opening takes O(n / 64) time.
+ * The multiset is read-only: inserts and deletes do nothing on it.
+ * Lookups, cursor seeks and the order statistics take O(log n) time.
+ * Cursors move forwards in O(1) time, but MsetCursorPrev walks through
+ * up to 64 elements.
+ * Returns NULL if the file cannot be opened or was not written by
+ * MsetSave. The file must not change while the multiset is open.
+ */
+Mset MsetOpenMapped(const char *path);
+
+////////////////////////////////////////////////////////////////////////
+// Statistics
+// Kept only when the library is built with MSET_STATS defined (make
+// STATS=1), and otherwise compiled out entirely.
+
+// Number of buckets in each latency histogram of struct msetStats. Bucket
+// i counts the calls that took from 2^i to 2^(i + 1) - 1 nanoseconds,
+// and the last bucket also counts every longer call.
+#define MSET_STATS_BUCKETS 32
+
+// The calls whose latencies are kept
+enum msetCall {
+	MSET_CALL_INSERT,      // MsetInsert, MsetInsertMany, MsetInsertBatch
+	MSET_CALL_DELETE,      // MsetDelete, MsetDeleteMany
+	MSET_CALL_GET_COUNT,   // MsetGetCount
+	MSET_CALL_MOST_COMMON, // MsetMostCommon
+	MSET_CALL_SET_OP,      // set operations, on their first multiset
+	MSET_CALLS,
+};
+
+// Used by MsetGetStats
+struct msetStats {
+	long long inserts;         // elements passed to the insert calls
+	long long deletes;         // calls to MsetDelete and MsetDeleteMany
+	long long singleRotations; // made by inserts and deletes
+	long long doubleRotations;
+	long long nodeAllocs;      // tree nodes allocated and freed one at a
+	long long nodeFrees;       // time
+	long long lookups;         // tree searches made by MsetGetCount
+	long long lookupDepth;     // nodes passed by those searches in total
+	int peakHeight;            // greatest height the tree has had
+	size_t bytesInUse;         // memory held by the multiset now
+	long long latency[MSET_CALLS][MSET_STATS_BUCKETS];
+};
+
+/**
+ * Stores the statistics of the multiset into stats and returns true if
+ * the library was built with MSET_STATS. Otherwise stores zeros and
+ * returns false. The counters are kept per multiset from its creation,
+ * and those of a sharded multiset only cover calls made on it, which
+ * its shards keep counters of their own for.
+ */
+bool MsetGetStats(Mset s, struct msetStats *stats);
+
 ////////////////////////////////////////////////////////////////////////
 
 #endif
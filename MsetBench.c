@@ -0,0 +1,488 @@
+// Benchmarks for the Multiset ADT
+// Usage: ./MsetBench [number of distinct keys]
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Mset.h"
+
+#define DEFAULT_N 1000000
+#define BATCH_SIZE 65536
+#define TOP_K 10
+#define TOP_K_RUNS 10
+#define LOOKUPS 1000000
+#define DENSE_RANGE 65536
+#define THREADS 4
+#define MAX_THREADS 32
+#define SKEWED_RANGE 1024
+#define COMBINE_THRESHOLD 4096
+
+static unsigned long long rngState = 0x9e3779b97f4a7c15ULL;
+
+/*
+* Returns the next value of a xorshift64 generator.
+*/
+static unsigned int nextRandom(void) {
+	rngState ^= rngState << 13;
+	rngState ^= rngState >> 7;
+	rngState ^= rngState << 17;
+	return (unsigned int)(rngState >> 32);
+}
+
+/*
+* Returns the current time in nanoseconds.
+*/
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+* Prints the average time per operation of a timed loop.
+*/
+static void report(const char *name, double start, int ops) {
+	printf("%-24s %10.1f ns/op\n", name, (now() - start) / ops);
+}
+
+/*
+* Times lookups of present keys in a multiset of the first size keys, created
+* with the given flags. The lookups made before the timed loop give a lookup
+* index enough reads to be built.
+*/
+static long long benchLookups(const char *name, int flags, const int *keys,
+int size) {
+	Mset s = MsetNewWithFlags(flags);
+	for (int i = 0; i < size; i++) {
+		MsetInsert(s, keys[i]);
+	}
+
+	long long found = 0;
+	for (int i = 0; i <= size / 8; i++) {
+		found += MsetGetCount(s, keys[i]);
+	}
+
+	char label[64];
+	snprintf(label, sizeof(label), "%s %d", name, size);
+	double start = now();
+	for (int i = 0; i < LOOKUPS; i++) {
+		found += MsetGetCount(s, keys[(i * 7919LL) % size]);
+	}
+	report(label, start, LOOKUPS);
+	MsetFree(s);
+	return found;
+}
+
+// The multiset and keys shared by the threads of benchConcurrent and
+// benchInserts.
+struct lookupJob {
+	Mset s;
+	const int *keys;
+	int size;
+	int first;
+	long long found;
+};
+
+/*
+* Looks up LOOKUPS present keys, starting from a different key in each thread.
+*/
+static void *lookupThread(void *arg) {
+	struct lookupJob *job = arg;
+	for (int i = 0; i < LOOKUPS; i++) {
+		job->found += MsetGetCount(job->s,
+		job->keys[(job->first + i * 7919LL) % job->size]);
+	}
+	return NULL;
+}
+
+/*
+* Walks a cursor over the whole multiset.
+*/
+static void *scanThread(void *arg) {
+	struct lookupJob *job = arg;
+	MsetCursor cur = MsetCursorNew(job->s);
+	while (MsetCursorNext(cur)) {
+		job->found += MsetCursorGet(cur).count;
+	}
+	MsetCursorFree(cur);
+	return NULL;
+}
+
+/*
+* Runs lookups or cursor scans of a concurrent multiset of size keys in each
+* of the given number of threads at once, and prints the lookups or cursor
+* moves made per microsecond across all of the threads, which grows with the
+* threads as long as they have cores to run on.
+*/
+static long long benchConcurrent(const char *name, Mset s, int threads,
+const int *keys, int size, bool scan) {
+	pthread_t ids[MAX_THREADS];
+	struct lookupJob jobs[MAX_THREADS];
+	double start = now();
+	for (int i = 0; i < threads; i++) {
+		jobs[i] = (struct lookupJob){s, keys, size, i * (size / threads), 0};
+		pthread_create(&ids[i], NULL, scan ? scanThread : lookupThread,
+		&jobs[i]);
+	}
+	long long found = 0;
+	for (int i = 0; i < threads; i++) {
+		pthread_join(ids[i], NULL);
+		found += jobs[i].found;
+	}
+	double ops = (double)threads * (scan ? size : LOOKUPS);
+	printf("%-24s %10.1f ops/us  (%d threads)\n", name,
+	ops * 1e3 / (now() - start), threads);
+	return found;
+}
+
+/*
+* Inserts size / THREADS keys from the first one given to the thread.
+*/
+static void *insertThread(void *arg) {
+	struct lookupJob *job = arg;
+	for (int i = 0; i < job->size / THREADS; i++) {
+		MsetInsert(job->s, job->keys[job->first + i]);
+	}
+	return NULL;
+}
+
+/*
+* Times inserts of the first size keys into the given multiset, split between
+* the given number of threads, per insert. Frees the multiset.
+*/
+static void benchInserts(const char *name, Mset s, int threads,
+const int *keys, int size) {
+	pthread_t ids[THREADS];
+	struct lookupJob jobs[THREADS];
+	double start = now();
+	for (int i = 0; i < threads; i++) {
+		jobs[i] = (struct lookupJob){s, keys, size, i * (size / THREADS), 0};
+		pthread_create(&ids[i], NULL, insertThread, &jobs[i]);
+	}
+	for (int i = 0; i < threads; i++) {
+		pthread_join(ids[i], NULL);
+	}
+	report(name, start, threads * (size / THREADS));
+	MsetFree(s);
+}
+
+int main(int argc, char *argv[]) {
+	int n = DEFAULT_N;
+	if (argc > 1) {
+		n = atoi(argv[1]);
+	}
+
+	int *keys = malloc(n * sizeof(int));
+	if (keys == NULL) {
+		fprintf(stderr, "Error: out of memory.\n");
+		return EXIT_FAILURE;
+	}
+	for (int i = 0; i < n; i++) {
+		keys[i] = (int)(nextRandom() & 0x7fffffff);
+	}
+
+	Mset s = MsetNew();
+	double start = now();
+	for (int i = 0; i < n; i++) {
+		MsetInsert(s, keys[i]);
+	}
+	report("insert random", start, n);
+
+	long long found = 0;
+	start = now();
+	for (int i = 0; i < n; i++) {
+		found += MsetGetCount(s, keys[(i * 7919LL) % n]);
+	}
+	report("get count hit", start, n);
+
+	start = now();
+	for (int i = 0; i < n; i++) {
+		found += MsetGetCount(s, -1 - i);
+	}
+	report("get count miss", start, n);
+
+	struct item top[TOP_K];
+	start = now();
+	for (int i = 0; i < TOP_K_RUNS; i++) {
+		found += MsetMostCommon(s, TOP_K, top);
+	}
+	report("most common k=10", start, TOP_K_RUNS);
+
+	MsetCursor cur = MsetCursorNew(s);
+	start = now();
+	while (MsetCursorNext(cur)) {
+		found += MsetCursorGet(cur).count;
+	}
+	report("cursor scan", start, n);
+	MsetCursorFree(cur);
+
+	start = now();
+	for (int i = 0; i < n; i++) {
+		MsetDelete(s, keys[i]);
+	}
+	report("delete random", start, n);
+	MsetFree(s);
+
+	s = MsetNew();
+	start = now();
+	for (int i = 0; i < n; i++) {
+		MsetInsert(s, i);
+	}
+	report("insert ascending", start, n);
+	MsetFree(s);
+
+	s = MsetNew();
+	start = now();
+	for (int i = 0; i < n; i += BATCH_SIZE) {
+		int size = n - i < BATCH_SIZE ? n - i : BATCH_SIZE;
+		MsetInsertBatch(s, keys + i, NULL, size);
+	}
+	report("insert batch random", start, n);
+	MsetFree(s);
+
+	s = MsetNewWithFlags(MSET_COUNT_INDEX);
+	start = now();
+	for (int i = 0; i < n; i++) {
+		MsetInsert(s, keys[i] % (n / 4 + 1));
+	}
+	report("insert count index", start, n);
+
+	start = now();
+	for (int i = 0; i < TOP_K_RUNS; i++) {
+		found += MsetMostCommon(s, TOP_K, top);
+	}
+	report("most common indexed", start, TOP_K_RUNS);
+	MsetFree(s);
+
+	struct item *sorted = malloc(n * sizeof(struct item));
+	if (sorted == NULL) {
+		fprintf(stderr, "Error: out of memory.\n");
+		return EXIT_FAILURE;
+	}
+	for (int i = 0; i < n; i++) {
+		sorted[i] = (struct item){i * 2, 1 + i % 5};
+	}
+	start = now();
+	s = MsetFromSortedItems(sorted, n);
+	report("load sorted items", start, n);
+	MsetFree(s);
+	free(sorted);
+
+	s = MsetNewWithFlags(MSET_BTREE);
+	start = now();
+	for (int i = 0; i < n; i++) {
+		MsetInsert(s, keys[i]);
+	}
+	report("btree insert random", start, n);
+
+	start = now();
+	for (int i = 0; i < n; i++) {
+		found += MsetGetCount(s, keys[(i * 7919LL) % n]);
+	}
+	report("btree get count hit", start, n);
+
+	start = now();
+	for (int i = 0; i < n; i++) {
+		found += MsetGetCount(s, -1 - i);
+	}
+	report("btree get count miss", start, n);
+
+	start = now();
+	for (int i = 0; i < n; i++) {
+		MsetDelete(s, keys[i]);
+	}
+	report("btree delete random", start, n);
+	MsetFree(s);
+
+	s = MsetNewWithFlags(MSET_COMPACT);
+	start = now();
+	for (int i = 0; i < n; i++) {
+		MsetInsert(s, keys[i]);
+	}
+	report("compact insert random", start, n);
+
+	start = now();
+	for (int i = 0; i < n; i++) {
+		found += MsetGetCount(s, keys[(i * 7919LL) % n]);
+	}
+	report("compact get count hit", start, n);
+
+	cur = MsetCursorNew(s);
+	start = now();
+	while (MsetCursorNext(cur)) {
+		found += MsetCursorGet(cur).count;
+	}
+	report("compact cursor scan", start, n);
+	MsetCursorFree(cur);
+
+	start = now();
+	for (int i = 0; i < n; i++) {
+		MsetDelete(s, keys[i]);
+	}
+	report("compact delete random", start, n);
+	MsetFree(s);
+
+	s = MsetNewWithFlags(MSET_NO_LIST);
+	start = now();
+	for (int i = 0; i < n; i++) {
+		MsetInsert(s, keys[i]);
+	}
+	report("no list insert random", start, n);
+
+	cur = MsetCursorNew(s);
+	start = now();
+	while (MsetCursorNext(cur)) {
+		found += MsetCursorGet(cur).count;
+	}
+	report("no list cursor scan", start, n);
+	MsetCursorFree(cur);
+
+	start = now();
+	for (int i = 0; i < n; i++) {
+		MsetDelete(s, keys[i]);
+	}
+	report("no list delete random", start, n);
+	MsetFree(s);
+
+	//a stream that repeats a few elements often, with and without write
+	//combining.
+	s = MsetNewWithFlags(MSET_CONCURRENT);
+	start = now();
+	for (int i = 0; i < n; i++) {
+		MsetInsert(s, keys[i] % SKEWED_RANGE);
+	}
+	report("insert skewed", start, n);
+	MsetFree(s);
+
+	s = MsetNewWithFlags(MSET_CONCURRENT);
+	MsetSetWriteCombining(s, COMBINE_THRESHOLD, false);
+	start = now();
+	for (int i = 0; i < n; i++) {
+		MsetInsert(s, keys[i] % SKEWED_RANGE);
+	}
+	MsetFlush(s);
+	report("insert skewed combined", start, n);
+	MsetFree(s);
+
+	s = MsetNewDense(0, DENSE_RANGE - 1);
+	start = now();
+	for (int i = 0; i < n; i++) {
+		MsetInsert(s, keys[i] % DENSE_RANGE);
+	}
+	report("dense insert", start, n);
+
+	start = now();
+	for (int i = 0; i < n; i++) {
+		found += MsetGetCount(s, keys[(i * 7919LL) % n] % DENSE_RANGE);
+	}
+	report("dense get count", start, n);
+
+	Mset other = MsetNewDense(0, DENSE_RANGE - 1);
+	for (int i = 0; i < DENSE_RANGE; i += 3) {
+		MsetInsert(other, i);
+	}
+	start = now();
+	Mset dense = MsetUnion(s, other);
+	report("dense union", start, DENSE_RANGE);
+	MsetFree(dense);
+	MsetFree(other);
+	MsetFree(s);
+
+	//lookups with and without the lookup index at each size up to n.
+	int lookupSizes[] = {1000, 1000000, 100000000};
+	for (int i = 0; i < 3 && lookupSizes[i] <= n; i++) {
+		int size = lookupSizes[i];
+		found += benchLookups("lookup avl", 0, keys, size);
+		found += benchLookups("lookup avl index", MSET_LOOKUP_INDEX, keys,
+		size);
+		found += benchLookups("lookup btree", MSET_BTREE, keys, size);
+		found += benchLookups("lookup btree index",
+		MSET_BTREE | MSET_LOOKUP_INDEX, keys, size);
+	}
+
+	//union of two multisets of n random keys, merged or split and joined.
+	Mset left = MsetNew();
+	Mset right = MsetNew();
+	for (int i = 0; i < n; i++) {
+		MsetInsert(left, keys[i]);
+		MsetInsert(right, keys[i] ^ (i & 1));
+	}
+	for (int threads = 1; threads <= THREADS; threads *= THREADS) {
+		char label[64];
+		snprintf(label, sizeof(label), "union parallelism %d", threads);
+		MsetSetParallelism(threads);
+		start = now();
+		Mset both = MsetUnion(left, right);
+		report(label, start, n);
+		MsetFree(both);
+	}
+	MsetSetParallelism(1);
+
+	//the sum as a new multiset, and merged into one of the two in place.
+	start = now();
+	Mset sum = MsetSum(left, right);
+	report("sum", start, n);
+	MsetFree(sum);
+	start = now();
+	MsetSumInto(left, right);
+	report("sum into", start, n);
+	MsetFree(left);
+	MsetFree(right);
+
+	//the random keys saved to a file, which is then mapped back in.
+	s = MsetNew();
+	for (int i = 0; i < n; i++) {
+		MsetInsert(s, keys[i]);
+	}
+	char path[] = "/tmp/MsetBenchXXXXXX";
+	int fd = mkstemp(path);
+	if (fd >= 0) {
+		start = now();
+		MsetSave(s, fd);
+		report("save", start, n);
+		close(fd);
+
+		start = now();
+		Mset mapped = MsetOpenMapped(path);
+		report("open mapped", start, 1);
+		if (mapped != NULL) {
+			start = now();
+			for (int i = 0; i < n; i++) {
+				found += MsetGetCount(mapped, keys[(i * 7919LL) % n]);
+			}
+			report("mapped get count hit", start, n);
+			MsetFree(mapped);
+		}
+		unlink(path);
+	}
+	MsetFree(s);
+
+	//reads of one concurrent multiset from more and more threads.
+	s = MsetNewWithFlags(MSET_CONCURRENT);
+	for (int i = 0; i < n; i++) {
+		MsetInsert(s, keys[i]);
+	}
+	int threadCounts[] = {1, 4, 16, MAX_THREADS};
+	for (int i = 0; i < 4; i++) {
+		int threads = threadCounts[i];
+		found += benchConcurrent("concurrent get count", s, threads, keys, n,
+		false);
+		found += benchConcurrent("concurrent cursor scan", s, threads, keys,
+		n, true);
+	}
+	MsetFree(s);
+	benchInserts("locked insert 4 threads", MsetNewWithFlags(MSET_CONCURRENT),
+	THREADS, keys, n);
+	benchInserts("sharded insert 4 threads", MsetNewSharded(16, 0, 0x7fffffff),
+	THREADS, keys, n);
+
+	//keeps the lookups from being optimised away.
+	if (found < 0) {
+		printf("%lld\n", found);
+	}
+	free(keys);
+	return EXIT_SUCCESS;
+}
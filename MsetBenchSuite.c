@@ -0,0 +1,358 @@
+// Benchmark suite for the Multiset ADT, which prints its results as JSON
+// Usage: ./MsetBenchSuite [largest size]
+// Every operation is measured for each key distribution at sizes of 1000,
+// 10000 and so on up to the largest size, which is 1000000 by default and at
+// most 100000000.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "Mset.h"
+
+#define DEFAULT_MAX_SIZE 1000000
+#define MIN_SIZE 1000
+#define MAX_SIZE 100000000
+
+// Most latencies kept per result. Operations on single elements time every
+// stride-th call on its own so that at most this many are timed.
+#define MAX_SAMPLES 65536
+
+// Number of elements the whole-multiset operations are run over in total per
+// result, within the bounds on the number of runs.
+#define WHOLE_BUDGET 10000000
+#define MIN_WHOLE_RUNS 3
+#define MAX_WHOLE_RUNS 200
+
+#define ZIPF_THETA 0.99
+#define TOP_K 10
+
+/*
+* The ways the keys of a benchmark are drawn.
+*/
+enum distribution {
+	DIST_UNIFORM,
+	DIST_ZIPF,
+	DIST_SEQUENTIAL,
+	DIST_ADVERSARIAL,
+	DISTRIBUTIONS,
+};
+
+static const char *distNames[DISTRIBUTIONS] = {
+	"uniform", "zipf", "sequential", "adversarial",
+};
+
+// The latencies of one benchmark.
+struct timing {
+	int runs;
+	double total;
+	int nSamples;
+	double samples[MAX_SAMPLES];
+};
+
+static struct timing timing;
+static unsigned long long rngState = 0x9e3779b97f4a7c15ULL;
+static bool firstResult = true;
+
+// Results of the operations, which keeps them from being optimised away.
+static long long sink = 0;
+
+/*
+* Returns the next value of a xorshift64 generator.
+*/
+static unsigned int nextRandom(void) {
+	rngState ^= rngState << 13;
+	rngState ^= rngState >> 7;
+	rngState ^= rngState << 17;
+	return (unsigned int)(rngState >> 32);
+}
+
+/*
+* Returns the current time in nanoseconds.
+*/
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+* Spreads a rank of the Zipf distribution over the positive ints, so that the
+* most common keys are not next to each other in the multiset.
+*/
+static int scramble(unsigned int rank) {
+	unsigned long long x = rank * 0x9e3779b97f4a7c15ULL;
+	x ^= x >> 29;
+	return (int)(x & 0x7fffffff);
+}
+
+/*
+* Fills keys with n keys of the given distribution:
+* - uniform keys are random positive ints
+* - zipf keys are drawn from n ranks, the ith most common with probability
+*   proportional to 1 / i^ZIPF_THETA, by the method of Gray et al.
+* - sequential keys count up from 0, so that every insert goes to the right
+*   end of the tree
+* - adversarial keys come alternately from both ends of 0 to n - 1, so that
+*   each insert lands between the last two and the rebalancing has to use
+*   double rotations
+*/
+static void makeKeys(int *keys, int n, int dist) {
+	if (dist == DIST_UNIFORM) {
+		for (int i = 0; i < n; i++) {
+			keys[i] = (int)(nextRandom() & 0x7fffffff);
+		}
+	} else if (dist == DIST_ZIPF) {
+		double zetan = 0;
+		for (int i = 1; i <= n; i++) {
+			zetan += 1 / pow(i, ZIPF_THETA);
+		}
+		double zeta2 = 1 + 1 / pow(2, ZIPF_THETA);
+		double alpha = 1 / (1 - ZIPF_THETA);
+		double eta = (1 - pow(2.0 / n, 1 - ZIPF_THETA)) / (1 - zeta2 / zetan);
+		for (int i = 0; i < n; i++) {
+			double u = nextRandom() / 4294967296.0;
+			double uz = u * zetan;
+			unsigned int rank;
+			if (uz < 1) {
+				rank = 0;
+			} else if (uz < zeta2) {
+				rank = 1;
+			} else {
+				rank = (unsigned int)(n * pow(eta * u - eta + 1, alpha));
+				if (rank >= (unsigned int)n) {
+					rank = n - 1;
+				}
+			}
+			keys[i] = scramble(rank);
+		}
+	} else if (dist == DIST_SEQUENTIAL) {
+		for (int i = 0; i < n; i++) {
+			keys[i] = i;
+		}
+	} else {
+		for (int i = 0; i < n; i++) {
+			keys[i] = i % 2 == 0 ? i / 2 : n - 1 - i / 2;
+		}
+	}
+}
+
+/*
+* Orders latencies for qsort.
+*/
+static int compareDoubles(const void *a, const void *b) {
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/*
+* Returns the latency below which the given fraction of the samples fall.
+*/
+static double percentile(double fraction) {
+	if (timing.nSamples == 0) {
+		return 0;
+	}
+	return timing.samples[(int)(fraction * (timing.nSamples - 1))];
+}
+
+/*
+* Prints the result of the last benchmark as an element of the results array.
+*/
+static void report(const char *op, int dist, int size) {
+	qsort(timing.samples, timing.nSamples, sizeof(double), compareDoubles);
+	double perOp = timing.total / timing.runs;
+	printf("%s\n    {\"op\": \"%s\", \"distribution\": \"%s\", \"size\": %d, "
+	"\"runs\": %d, \"ns_per_op\": %.1f, \"ops_per_sec\": %.0f, "
+	"\"p50_ns\": %.1f, \"p99_ns\": %.1f}", firstResult ? "" : ",", op,
+	distNames[dist], size, timing.runs, perOp, 1e9 / perOp, percentile(0.5),
+	percentile(0.99));
+	firstResult = false;
+	fflush(stdout);
+}
+
+/*
+* The operations on single elements timed by benchEach, each on the ith key.
+*/
+static void opInsert(Mset s, const int *keys, int i) {
+	MsetInsert(s, keys[i]);
+}
+
+static void opInsertMany(Mset s, const int *keys, int i) {
+	MsetInsertMany(s, keys[i], 1 + i % 7);
+}
+
+static void opDelete(Mset s, const int *keys, int i) {
+	MsetDelete(s, keys[i]);
+}
+
+static void opGetCount(Mset s, const int *keys, int i) {
+	sink += MsetGetCount(s, keys[i]);
+}
+
+/*
+* Times op on each of the n keys in turn. The throughput comes from the whole
+* loop, and the latencies from every stride-th call, which is timed on its own.
+*/
+static void benchEach(const char *name, int dist, Mset s, const int *keys,
+int n, void (*op)(Mset, const int *, int)) {
+	int stride = (n + MAX_SAMPLES - 1) / MAX_SAMPLES;
+	timing.runs = n;
+	timing.nSamples = 0;
+	double start = now();
+	for (int i = 0; i < n; i++) {
+		if (i % stride == 0) {
+			double opStart = now();
+			op(s, keys, i);
+			timing.samples[timing.nSamples++] = now() - opStart;
+		} else {
+			op(s, keys, i);
+		}
+	}
+	timing.total = now() - start;
+	report(name, dist, n);
+}
+
+/*
+* The operations on whole multisets timed by benchWhole.
+*/
+static void runUnion(Mset s1, Mset s2) {
+	Mset result = MsetUnion(s1, s2);
+	sink += MsetSize(result);
+	MsetFree(result);
+}
+
+static void runIntersection(Mset s1, Mset s2) {
+	Mset result = MsetIntersection(s1, s2);
+	sink += MsetSize(result);
+	MsetFree(result);
+}
+
+static void runIncluded(Mset s1, Mset s2) {
+	sink += MsetIncluded(s1, s2);
+}
+
+static void runEquals(Mset s1, Mset s2) {
+	sink += MsetEquals(s1, s2);
+}
+
+static void runMostCommon(Mset s1, Mset s2) {
+	(void)s2;
+	struct item items[TOP_K];
+	sink += MsetMostCommon(s1, TOP_K, items);
+}
+
+static void runScan(Mset s1, Mset s2) {
+	(void)s2;
+	MsetCursor cur = MsetCursorNew(s1);
+	while (MsetCursorNext(cur)) {
+		sink += MsetCursorGet(cur).count;
+	}
+	MsetCursorFree(cur);
+}
+
+/*
+* Times op on the whole of s1 and s2 a number of times that keeps the total
+* work near WHOLE_BUDGET elements, timing every run.
+*/
+static void benchWhole(const char *name, int dist, int size, Mset s1, Mset s2,
+void (*op)(Mset, Mset)) {
+	int runs = WHOLE_BUDGET / size;
+	if (runs < MIN_WHOLE_RUNS) {
+		runs = MIN_WHOLE_RUNS;
+	} else if (runs > MAX_WHOLE_RUNS) {
+		runs = MAX_WHOLE_RUNS;
+	}
+
+	timing.runs = runs;
+	timing.nSamples = 0;
+	timing.total = 0;
+	for (int i = 0; i < runs; i++) {
+		double start = now();
+		op(s1, s2);
+		double elapsed = now() - start;
+		timing.samples[timing.nSamples++] = elapsed;
+		timing.total += elapsed;
+	}
+	report(name, dist, size);
+}
+
+/*
+* Runs every benchmark for n keys of the given distribution.
+*/
+static void benchSize(int *keys, int *others, int *probes, int n, int dist) {
+	makeKeys(keys, n, dist);
+	for (int i = 0; i < n; i++) {
+		probes[i] = keys[(i * 7919LL) % n];
+	}
+
+	Mset s = MsetNew();
+	benchEach("insert", dist, s, keys, n, opInsert);
+	Mset many = MsetNew();
+	benchEach("insert_many", dist, many, keys, n, opInsertMany);
+	MsetFree(many);
+	benchEach("get_count", dist, s, probes, n, opGetCount);
+
+	//the other multiset overlaps with s in about half of its elements.
+	for (int i = 0; i < n; i++) {
+		others[i] = i % 2 == 0 ? keys[i] : keys[i] ^ 1;
+	}
+	Mset other = MsetNew();
+	Mset copy = MsetNew();
+	for (int i = 0; i < n; i++) {
+		MsetInsert(other, others[i]);
+		MsetInsert(copy, keys[i]);
+	}
+	Mset both = MsetUnion(s, other);
+
+	benchWhole("union", dist, n, s, other, runUnion);
+	benchWhole("intersection", dist, n, s, other, runIntersection);
+	benchWhole("included", dist, n, s, both, runIncluded);
+	benchWhole("equals", dist, n, s, copy, runEquals);
+	benchWhole("most_common", dist, n, s, NULL, runMostCommon);
+	benchWhole("cursor_scan", dist, n, s, NULL, runScan);
+	MsetFree(both);
+	MsetFree(copy);
+	MsetFree(other);
+
+	benchEach("delete", dist, s, keys, n, opDelete);
+	MsetFree(s);
+}
+
+int main(int argc, char *argv[]) {
+	int maxSize = DEFAULT_MAX_SIZE;
+	if (argc > 1) {
+		maxSize = atoi(argv[1]);
+	}
+	if (maxSize < MIN_SIZE || maxSize > MAX_SIZE) {
+		fprintf(stderr, "Usage: %s [largest size from %d to %d]\n", argv[0],
+		MIN_SIZE, MAX_SIZE);
+		return EXIT_FAILURE;
+	}
+
+	int *keys = malloc(maxSize * sizeof(int));
+	int *others = malloc(maxSize * sizeof(int));
+	int *probes = malloc(maxSize * sizeof(int));
+	if (keys == NULL || others == NULL || probes == NULL) {
+		fprintf(stderr, "Error: out of memory.\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("{\n  \"benchmark\": \"MsetBenchSuite\",\n  \"results\": [");
+	for (int dist = 0; dist < DISTRIBUTIONS; dist++) {
+		for (int n = MIN_SIZE; n <= maxSize; n *= 10) {
+			benchSize(keys, others, probes, n, dist);
+		}
+	}
+	printf("\n  ]\n}\n");
+
+	//keeps the results from being optimised away.
+	if (sink == -1) {
+		fprintf(stderr, "%lld\n", sink);
+	}
+	free(probes);
+	free(others);
+	free(keys);
+	return EXIT_SUCCESS;
+}
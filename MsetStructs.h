@@ -3,20 +3,39 @@
 #ifndef MSET_STRUCTS_H
 #define MSET_STRUCTS_H
 
+#include <pthread.h>
+#include <stdint.h>
+
 // IMPORTANT: Only structs should be placed in this file.
 //            All other code should be placed in Mset.c.
+//            The one exception is BTREE_KEYS, which sizes the arrays of
+//            the B+ tree nodes below.
 
 // DO NOT MODIFY THE NAME OF THIS STRUCT
 struct mset {
 	struct node *tree;  // DO NOT MODIFY/REMOVE THIS FIELD
+	int flags;          // MSET_* flags given to MsetNewWithFlags
+	int kind;           // which representation holds the elements
+	struct nodePool *pool; // NULL unless the MSET_NODE_POOL flag is set
+	struct node *countTree; // count index, kept if MSET_COUNT_INDEX is set
 	int size;
 	int totalCount;
 	struct node *listBegin;
 	struct node *listEnd;
-	struct node *subTreeNext;
-	struct node *subTreePrev;
-	int smallest;
-	int biggest;
+	uint64_t hash;      // sum of the hashes of every (elem, count) pair
+	struct btree *btree; // used instead of tree if MSET_BTREE is set
+	struct lookupIndex *lookup; // NULL unless MSET_LOOKUP_INDEX is set
+	struct dense *dense; // used instead of tree by MsetNewDense multisets
+	struct msetSync *sync; // NULL unless MSET_CONCURRENT is set
+	struct shards *shards; // used instead of tree by MsetNewSharded multisets
+	struct combiner *combiner; // NULL unless write combining is on
+	bool shared;        // true if snapshots may share nodes with the tree
+	struct mapped *mapped; // used instead of tree by MsetOpenMapped multisets
+	struct compact *compact; // used instead of tree if MSET_COMPACT is set
+	unsigned long epoch; // moved on by every change, unless concurrent
+#ifdef MSET_STATS
+	struct msetStats stats; // what MsetGetStats reports, apart from bytesInUse
+#endif
 
 	// You may add more fields here if needed
 };
@@ -28,6 +47,10 @@ struct node {
 	struct node *left;  // DO NOT MODIFY/REMOVE THIS FIELD
 	struct node *right; // DO NOT MODIFY/REMOVE THIS FIELD
 	int height;
+	int subTreeSize;    // number of nodes in the subtree rooted here
+	int subTreeCount;   // sum of the counts of the subtree rooted here
+	int refs;           // number of links to the node from trees and
+	                    // snapshots
 	struct node *next;
 	struct node *prev;
 
@@ -36,17 +59,229 @@ struct node {
 
 // You may define more structs here if needed
 
+// A block of nodes handed out by a node pool.
+struct nodeSlab {
+	struct nodeSlab *next;
+	int capacity;
+	int used;
+	struct node nodes[];
+};
+
+// Allocates the nodes of one multiset out of slabs so that allocating is a
+// pointer bump and freeing the multiset only frees the slabs.
+struct nodePool {
+	struct nodeSlab *slabs;  // newest slab first
+	struct node *freeList;   // freed nodes, linked through their left field
+	struct node *returned;   // nodes freed by snapshots, which may be in
+	                         // other threads, linked the same way
+	int users;               // the multiset and its snapshots
+};
+
+////////////////////////////////////////////////////////////////////////
+// B+ Trees
+
+// Maximum number of elements in a leaf and of keys in an inner node.
+#define BTREE_KEYS 64
+
+// A leaf of a B+ tree. The elements are sorted and the counts are kept in a
+// separate array so that a search only reads the elements.
+struct bleaf {
+	int size;
+	int elems[BTREE_KEYS];
+	int counts[BTREE_KEYS];
+	struct bleaf *next;
+	struct bleaf *prev;
+};
+
+// An inner node of a B+ tree with size keys and size + 1 children. Every
+// element under children[i] is smaller than keys[i], and every element under
+// children[i + 1] is greater than or equal to it.
+struct binner {
+	int size;
+	int keys[BTREE_KEYS];
+	void *children[BTREE_KEYS + 1];
+	int childSizes[BTREE_KEYS + 1];  // number of elements under each child
+	int childCounts[BTREE_KEYS + 1]; // sum of the counts under each child
+};
+
+struct btree {
+	void *root;         // NULL when the tree is empty
+	int height;         // number of inner levels, 0 when the root is a leaf
+	struct bleaf *first;
+	struct bleaf *last;
+};
+
+////////////////////////////////////////////////////////////////////////
+// Lookup Index
+
+// A read-only copy of the elements and counts of a multiset in blocks of
+// sorted keys, rebuilt from the multiset when it is out of date.
+struct lookupIndex {
+	int *keys;          // padded with INT_MAX after the last element
+	int *counts;        // 0 for the padding
+	int blocks;
+	int capacity;       // number of blocks the arrays have room for
+	bool valid;         // false if the multiset has changed since the build
+	int pending;        // lookups since the multiset last changed
+};
+
+////////////////////////////////////////////////////////////////////////
+// Dense Multisets
+
+struct dense {
+	int lo;
+	int hi;
+	int *counts;        // count of lo + i at index i
+	uint64_t *bits;     // bit i is set if lo + i is in the multiset
+};
+
+////////////////////////////////////////////////////////////////////////
+// Concurrency
+
+// The number of threads reading a concurrent multiset under one slot, on a
+// cache line of its own so that threads of different slots share no line.
+struct syncSlot {
+	int readers;
+} __attribute__((aligned(64)));
+
+struct msetSync {
+	pthread_mutex_t lock;  // held by the thread changing the multiset
+	int writing;           // set while a change waits for readers or runs
+	unsigned long version; // moved on by every change
+	int size;              // copies of the multiset's size and total
+	int totalCount;        // count, stored atomically as each change ends
+	struct syncSlot slots[]; // each thread reads under one of them
+};
+
+////////////////////////////////////////////////////////////////////////
+// Sharded Multisets
+
+struct shards {
+	int n;
+	int lo;
+	int hi;
+	struct mset *parts[]; // concurrent multisets, in order of element range
+};
+
+////////////////////////////////////////////////////////////////////////
+// Write Combining
+
+// The inserts of one thread that have not been made yet, as an open-addressing
+// table from element to amount.
+struct combineBuffer {
+	pthread_mutex_t lock;
+	pthread_t owner;
+	struct item *slots;   // elem is UNDEFINED in empty slots
+	int capacity;         // a power of two
+	int used;             // number of slots in use
+	struct item *batch;   // room for a full buffer's items while flushing
+	struct combineBuffer *next;
+};
+
+struct combiner {
+	pthread_mutex_t lock; // guards the list of buffers
+	pthread_mutex_t flushLock; // taken by flushes into a multiset that has
+	                           // no lock of its own
+	unsigned long id;
+	int threshold;
+	bool flushOnRead;
+	int pending;          // number of elements buffered by all threads
+	struct combineBuffer *buffers;
+};
+
+////////////////////////////////////////////////////////////////////////
+// Saved Multisets
+
+// The start of a file written by MsetSave. It is followed by the block table
+// and then by the blocks.
+struct savedHeader {
+	char magic[8];      // SAVED_MAGIC, which includes the format version
+	int size;
+	int totalCount;
+	uint64_t hash;
+	int blocks;
+	int blockSize;      // number of elements in every block but the last
+	uint64_t dataSize;  // number of bytes taken by the blocks
+};
+
+// An entry of the block table. A block holds the differences between its
+// consecutive elements and then its counts, each as a varint.
+struct savedBlock {
+	int first;          // smallest element of the block
+	int maxCount;       // greatest count in the block
+	int countBefore;    // sum of the counts of the earlier blocks
+	uint32_t countsAt;  // offset of the counts from the start of the block
+	uint64_t offset;    // offset of the block from the start of the blocks
+};
+
+// A saved multiset that is read where it is mapped into memory.
+struct mapped {
+	void *base;
+	size_t length;
+	const struct savedBlock *blocks;
+	const uint8_t *data;
+	int nBlocks;
+};
+
+// Bytes of a saved multiset waiting to be written to its file.
+struct saveBuffer {
+	int fd;
+	bool failed;        // true once a write has failed
+	size_t used;
+	uint8_t bytes[];
+};
+
+////////////////////////////////////////////////////////////////////////
+// Compact Multisets
+
+// A node of a compact multiset, which takes 24 bytes instead of 56. Children
+// are indexes into the node array, where index 0 is an empty node with every
+// field 0 that stands for a missing child.
+struct cnode {
+	int elem;
+	int count;
+	uint32_t left;      // also links the freed nodes
+	uint32_t right;
+	int subTreeCount;   // sum of the counts of the subtree rooted here
+	uint32_t shape;     // number of nodes in the subtree rooted here, shifted
+	                    // left by COMPACT_HEIGHT_BITS, and its height
+};
+
+struct compact {
+	struct cnode *nodes;
+	uint32_t capacity;
+	uint32_t used;      // nodes below this index have been handed out
+	uint32_t root;
+	uint32_t freeList;  // freed nodes, which have a count of 0
+};
+
 ////////////////////////////////////////////////////////////////////////
 // Cursors
 
 struct cursor {
 	// You may add more fields here if needed
-	struct node *curr;
-	struct node *left;
-	struct node *right;
-	struct node *start;
-	struct node *end;
+	struct node *curr;  // NULL when the cursor is at the start or the end
+	struct bleaf *leaf; // used instead of curr for B+ trees
+	int index;          // position of the element in leaf, the slot of the
+	                    // element for dense multisets or its node for
+	                    // compact ones, -1 at either end, or the current
+	                    // shard for sharded multisets
+	bool atEnd;
 	Mset s;
+	struct item item;   // copy of the element at the cursor, which it is
+	                    // found again from after the multiset changes
+	unsigned long version; // version of a concurrent multiset when the
+	                       // cursor last moved
+	unsigned long epoch;   // epoch of the multiset when the cursor last
+	                       // moved
+	struct cursor *part; // cursor into the current shard of a sharded
+	                     // multiset
+	const uint8_t *elemAt;  // next difference and next count in the block
+	const uint8_t *countAt; // of a mapped multiset, with index as the
+	                        // position of the element
+	struct node **path; // nodes from the root down to curr, for snapshots
+	int depth;          // and multisets without a list, or NULL until a
+	                    // cursor of those needs it
 };
 
 ////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,1013 @@
+// Differential tests for the Multiset ADT
+// Usage: ./MsetTest [runs] [seed]
+// Every representation is put through the same random inserts, deletes and
+// batches as a plain array of counts, and after each round of changes its
+// contents, cursors, order statistics, set operations and saved copies are
+// checked against the array. Each representation gets runs runs, 8 by default.
+// Then the set operations of large multisets split between threads are checked
+// against the same operations run in one thread, and threads change and read
+// concurrent multisets at once. The first difference found is printed and the
+// program exits with status 1.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Mset.h"
+
+#define DEFAULT_RUNS 8
+#define DEFAULT_SEED 0x9e3779b97f4a7c15ULL
+
+// Elements are drawn from KEY_LO to KEY_HI, which the reference holds a
+// count for each of. Dense multisets cover DENSE_LO to DENSE_HI and sharded
+// ones split it into SHARDS ranges; every other run also draws elements
+// outside of it, which dense multisets have to fall back to a tree for.
+#define KEY_LO (-512)
+#define KEY_HI 511
+#define KEYS (KEY_HI - KEY_LO + 1)
+#define DENSE_LO (-256)
+#define DENSE_HI 255
+#define SHARDS 4
+
+#define ROUNDS 10
+#define CHANGES 300
+#define PROBES 64
+#define MAX_BATCH 32
+#define TOP_K 8
+
+// Inserts that write-combined multisets buffer per thread before a batch.
+#define COMBINE_THRESHOLD 16
+
+// Distinct elements of each multiset given to the parallel set operations,
+// which only split multisets with 65536 elements or more between them, and
+// the threads they may use.
+#define PARALLEL_SIZE 40000
+#define PARALLEL_THREADS 4
+
+// Threads that change and that read a multiset at once in checkThreads, and
+// the changes each of the changing threads makes.
+#define WRITERS 4
+#define READERS 2
+#define THREAD_CHANGES 4000
+
+/*
+* The representations under test, and AVL multisets with each of the options
+* that change how they are kept. Snapshots and mapped multisets are read-only,
+* so their changes are made to an AVL multiset and a snapshot or a saved and
+* mapped copy of it is checked.
+*/
+enum representation {
+	REP_AVL,
+	REP_BTREE,
+	REP_DENSE,
+	REP_SHARDED,
+	REP_SNAPSHOT,
+	REP_MAPPED,
+	REP_COMPACT,
+	REP_NO_LIST,
+	REP_NODE_POOL,
+	REP_COUNT_INDEX,
+	REP_LOOKUP_INDEX,
+	REP_CONCURRENT,
+	REP_COMBINED,
+	REPRESENTATIONS,
+};
+
+static const char *repNames[REPRESENTATIONS] = {
+	"avl", "btree", "dense", "sharded", "snapshot", "mapped", "compact",
+	"no list", "node pool", "count index", "lookup index", "concurrent",
+	"write combined",
+};
+
+/*
+* The set operations that return a new multiset, and their versions that
+* change the first multiset.
+*/
+enum setOp {
+	OP_UNION,
+	OP_INTERSECTION,
+	OP_SUM,
+	OP_DIFFERENCE,
+	OP_SYMMETRIC_DIFFERENCE,
+	SET_OPS,
+};
+
+static Mset (*setOps[SET_OPS])(Mset, Mset) = {
+	MsetUnion, MsetIntersection, MsetSum, MsetDifference,
+	MsetSymmetricDifference,
+};
+
+static void (*setOpsInto[SET_OPS])(Mset, Mset) = {
+	MsetUnionInto, MsetIntersectionInto, MsetSumInto, MsetDifferenceInto,
+	MsetSymmetricDifferenceInto,
+};
+
+// The multiset the tests check against: the count of KEY_LO + i at index i.
+struct reference {
+	int counts[KEYS];
+};
+
+static unsigned long long rngState;
+
+// Where the tests are, for the message of a failed check.
+static const char *testedRep;
+static int testedRun;
+static int testedRound;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fail(__LINE__, #cond); \
+		} \
+	} while (0)
+
+/*
+* Reports a failed check and exits.
+*/
+static void fail(int line, const char *cond) {
+	fprintf(stderr, "MsetTest.c:%d: check failed for %s multisets in run %d, "
+	"round %d: %s\n", line, testedRep, testedRun, testedRound, cond);
+	exit(1);
+}
+
+/*
+* Returns the next value of a xorshift64 generator with the given state.
+*/
+static unsigned int nextRandomFrom(unsigned long long *state) {
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return (unsigned int)(*state >> 32);
+}
+
+/*
+* Returns the next value of the generator of the main thread.
+*/
+static unsigned int nextRandom(void) {
+	return nextRandomFrom(&rngState);
+}
+
+/*
+* Returns a random element, from the whole range of the reference if wide is
+* true and from the range of dense multisets otherwise.
+*/
+static int randomKey(bool wide) {
+	if (wide) {
+		return KEY_LO + (int)(nextRandom() % KEYS);
+	}
+	return DENSE_LO + (int)(nextRandom() % (DENSE_HI - DENSE_LO + 1));
+}
+
+/*
+* Returns the count of an item in the reference.
+*/
+static int refCount(const struct reference *ref, int item) {
+	if (item < KEY_LO || item > KEY_HI) {
+		return 0;
+	}
+	return ref->counts[item - KEY_LO];
+}
+
+/*
+* Adds a positive amount of an item to the reference.
+*/
+static void refInsert(struct reference *ref, int item, int amount) {
+	ref->counts[item - KEY_LO] += amount;
+}
+
+/*
+* Takes a positive amount of an item out of the reference, down to 0.
+*/
+static void refDelete(struct reference *ref, int item, int amount) {
+	int *count = &ref->counts[item - KEY_LO];
+	*count = *count > amount ? *count - amount : 0;
+}
+
+/*
+* Stores the elements of the reference in increasing order into items, which
+* must have room for KEYS items, and returns the number stored.
+*/
+static int refItems(const struct reference *ref, struct item items[]) {
+	int n = 0;
+	for (int i = 0; i < KEYS; i++) {
+		if (ref->counts[i] > 0) {
+			items[n++] = (struct item){KEY_LO + i, ref->counts[i]};
+		}
+	}
+	return n;
+}
+
+/*
+* Returns the count of an element in the result of a set operation on two
+* multisets where it has the given counts.
+*/
+static int setOpCount(int op, int count1, int count2) {
+	switch (op) {
+	case OP_UNION:
+		return count1 > count2 ? count1 : count2;
+	case OP_INTERSECTION:
+		return count1 < count2 ? count1 : count2;
+	case OP_SUM:
+		return count1 + count2;
+	case OP_DIFFERENCE:
+		return count1 > count2 ? count1 - count2 : 0;
+	default:
+		return count1 > count2 ? count1 - count2 : count2 - count1;
+	}
+}
+
+/*
+* Stores the result of a set operation on two references into result.
+*/
+static void refSetOp(int op, const struct reference *ref1,
+const struct reference *ref2, struct reference *result) {
+	for (int i = 0; i < KEYS; i++) {
+		result->counts[i] = setOpCount(op, ref1->counts[i], ref2->counts[i]);
+	}
+}
+
+/*
+* Checks if the first reference is included in the second.
+*/
+static bool refIncluded(const struct reference *ref1,
+const struct reference *ref2) {
+	for (int i = 0; i < KEYS; i++) {
+		if (ref1->counts[i] > ref2->counts[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+* Checks if an item returned by the multiset is the expected one.
+*/
+static bool sameItem(struct item got, struct item expected) {
+	return got.elem == expected.elem && got.count == expected.count;
+}
+
+/*
+* Creates an empty multiset of the representation, or the AVL multiset whose
+* snapshots or saved copies are checked for the read-only ones.
+*/
+static Mset newMultiset(int rep) {
+	switch (rep) {
+	case REP_BTREE:
+		return MsetNewWithFlags(MSET_BTREE);
+	case REP_DENSE:
+		return MsetNewDense(DENSE_LO, DENSE_HI);
+	case REP_SHARDED:
+		return MsetNewSharded(SHARDS, DENSE_LO, DENSE_HI);
+	case REP_COMPACT:
+		return MsetNewWithFlags(MSET_COMPACT);
+	case REP_NO_LIST:
+		return MsetNewWithFlags(MSET_NO_LIST);
+	case REP_NODE_POOL:
+		return MsetNewWithFlags(MSET_NODE_POOL);
+	case REP_COUNT_INDEX:
+		return MsetNewWithFlags(MSET_COUNT_INDEX);
+	case REP_LOOKUP_INDEX:
+		return MsetNewWithFlags(MSET_LOOKUP_INDEX);
+	case REP_CONCURRENT:
+		return MsetNewWithFlags(MSET_CONCURRENT | MSET_COUNT_INDEX |
+		MSET_NODE_POOL);
+	case REP_COMBINED: {
+		//reads flush the buffers, so the checks see every insert.
+		Mset s = MsetNew();
+		MsetSetWriteCombining(s, COMBINE_THRESHOLD, true);
+		return s;
+	}
+	default:
+		return MsetNew();
+	}
+}
+
+/*
+* Saves the multiset to a temporary file and opens it again mapped.
+*/
+static Mset saveAndOpen(Mset s) {
+	char path[] = "/tmp/MsetTestXXXXXX";
+	int fd = mkstemp(path);
+	CHECK(fd >= 0);
+	CHECK(MsetSave(s, fd));
+	close(fd);
+	Mset mapped = MsetOpenMapped(path);
+	//the mapping keeps the file's contents after it is removed.
+	unlink(path);
+	CHECK(mapped != NULL);
+	return mapped;
+}
+
+/*
+* Returns the multiset to check for a multiset made by newMultiset, which is
+* the multiset itself unless the representation is read-only.
+*/
+static Mset viewOf(int rep, Mset s) {
+	if (rep == REP_SNAPSHOT) {
+		return MsetSnapshot(s);
+	}
+	if (rep == REP_MAPPED) {
+		return saveAndOpen(s);
+	}
+	return s;
+}
+
+/*
+* Makes n random changes to both the multiset and the reference: inserts and
+* deletes of single elements, batches, and deletes of whole elements.
+*/
+static void applyChanges(Mset s, struct reference *ref, int n, bool wide) {
+	for (int i = 0; i < n; i++) {
+		int kind = nextRandom() % 10;
+		int item = randomKey(wide);
+		int amount = 1 + nextRandom() % 5;
+		if (kind < 5) {
+			if (amount == 1) {
+				MsetInsert(s, item);
+			} else {
+				MsetInsertMany(s, item, amount);
+			}
+			refInsert(ref, item, amount);
+		} else if (kind < 8) {
+			if (amount == 1) {
+				MsetDelete(s, item);
+			} else {
+				MsetDeleteMany(s, item, amount);
+			}
+			refDelete(ref, item, amount);
+		} else if (kind == 8) {
+			//a batch may repeat items and holds amounts that are skipped.
+			int items[MAX_BATCH];
+			int amounts[MAX_BATCH];
+			int size = 1 + nextRandom() % MAX_BATCH;
+			bool ones = nextRandom() % 4 == 0;
+			for (int j = 0; j < size; j++) {
+				items[j] = randomKey(wide);
+				amounts[j] = (int)(nextRandom() % 6) - 1;
+				if (ones) {
+					refInsert(ref, items[j], 1);
+				} else if (amounts[j] > 0) {
+					refInsert(ref, items[j], amounts[j]);
+				}
+			}
+			MsetInsertBatch(s, items, ones ? NULL : amounts, size);
+		} else if (refCount(ref, item) > 0) {
+			MsetDeleteMany(s, item, refCount(ref, item));
+			refDelete(ref, item, refCount(ref, item));
+		}
+	}
+}
+
+/*
+* Checks the size, total count, counts and printed form of the multiset.
+*/
+static void checkContents(Mset s, const struct reference *ref) {
+	struct item items[KEYS];
+	int n = refItems(ref, items);
+	int total = 0;
+	for (int i = 0; i < n; i++) {
+		total += items[i].count;
+	}
+	CHECK(MsetSize(s) == n);
+	CHECK(MsetTotalCount(s) == total);
+	for (int item = KEY_LO - 1; item <= KEY_HI + 1; item++) {
+		CHECK(MsetGetCount(s, item) == refCount(ref, item));
+	}
+	CHECK(MsetGetCount(s, INT_MAX) == 0);
+	CHECK(MsetGetCount(s, UNDEFINED + 1) == 0);
+
+	char *printed;
+	size_t length;
+	FILE *file = open_memstream(&printed, &length);
+	CHECK(file != NULL);
+	MsetPrint(s, file);
+	fclose(file);
+	char *expected = malloc(n * 32 + 3);
+	CHECK(expected != NULL);
+	int used = sprintf(expected, "{");
+	for (int i = 0; i < n; i++) {
+		used += sprintf(expected + used, "%s(%d, %d)", i > 0 ? ", " : "",
+		items[i].elem, items[i].count);
+	}
+	sprintf(expected + used, "}");
+	CHECK(strcmp(printed, expected) == 0);
+	free(expected);
+	free(printed);
+}
+
+/*
+* Checks full walks of the multiset in both directions, walks in batches with
+* MsetCursorNextN, and seeks followed by a step back.
+*/
+static void checkCursors(Mset s, const struct reference *ref, bool wide) {
+	struct item items[KEYS];
+	int n = refItems(ref, items);
+
+	MsetCursor cur = MsetCursorNew(s);
+	CHECK(MsetCursorGet(cur).elem == UNDEFINED);
+	for (int i = 0; i < n; i++) {
+		CHECK(MsetCursorNext(cur));
+		CHECK(sameItem(MsetCursorGet(cur), items[i]));
+	}
+	CHECK(!MsetCursorNext(cur));
+	CHECK(MsetCursorGet(cur).elem == UNDEFINED);
+	CHECK(!MsetCursorNext(cur));
+	for (int i = n - 1; i >= 0; i--) {
+		CHECK(MsetCursorPrev(cur));
+		CHECK(sameItem(MsetCursorGet(cur), items[i]));
+	}
+	CHECK(!MsetCursorPrev(cur));
+	CHECK(MsetCursorGet(cur).elem == UNDEFINED);
+	MsetCursorFree(cur);
+
+	cur = MsetCursorNew(s);
+	struct item batch[MAX_BATCH];
+	int done = 0;
+	while (true) {
+		int want = 1 + nextRandom() % MAX_BATCH;
+		int got = MsetCursorNextN(cur, want, batch);
+		int left = n - done;
+		CHECK(got == (want < left ? want : left));
+		for (int i = 0; i < got; i++) {
+			CHECK(sameItem(batch[i], items[done + i]));
+		}
+		done += got;
+		if (got < want) {
+			break;
+		}
+		CHECK(sameItem(MsetCursorGet(cur), items[done - 1]));
+	}
+	CHECK(MsetCursorGet(cur).elem == UNDEFINED);
+	CHECK(MsetCursorNextN(cur, MAX_BATCH, batch) == 0);
+
+	for (int probe = 0; probe < PROBES; probe++) {
+		int item = randomKey(wide);
+		bool after = probe % 2 == 1;
+		int i = 0;
+		while (i < n && (items[i].elem < item ||
+			(after && items[i].elem == item))) {
+			i++;
+		}
+		bool found = after ? MsetCursorSeekAfter(cur, item)
+		: MsetCursorSeek(cur, item);
+		CHECK(found == (i < n));
+		if (i < n) {
+			CHECK(sameItem(MsetCursorGet(cur), items[i]));
+		} else {
+			CHECK(MsetCursorGet(cur).elem == UNDEFINED);
+		}
+		CHECK(MsetCursorPrev(cur) == (i > 0));
+		if (i > 0) {
+			CHECK(sameItem(MsetCursorGet(cur), items[i - 1]));
+		}
+	}
+	MsetCursorFree(cur);
+}
+
+/*
+* Checks the order statistics and the most common elements of the multiset.
+*/
+static void checkOrder(Mset s, const struct reference *ref, bool wide) {
+	struct item items[KEYS];
+	int n = refItems(ref, items);
+	int before[KEYS + 1];
+	before[0] = 0;
+	for (int i = 0; i < n; i++) {
+		before[i + 1] = before[i] + items[i].count;
+	}
+	int total = before[n];
+
+	for (int i = -1; i <= n; i++) {
+		struct item expected = {UNDEFINED, 0};
+		if (i >= 0 && i < n) {
+			expected = items[i];
+		}
+		CHECK(sameItem(MsetSelect(s, i), expected));
+	}
+	for (int probe = 0; probe < PROBES; probe++) {
+		int item = randomKey(wide);
+		int rank = 0;
+		while (rank < n && items[rank].elem < item) {
+			rank++;
+		}
+		CHECK(MsetRank(s, item) == rank);
+
+		int position = (int)(nextRandom() % (total + 2)) - 1;
+		struct item expected = {UNDEFINED, 0};
+		for (int i = 0; i < n && position >= 0; i++) {
+			if (position < before[i + 1]) {
+				expected = items[i];
+				break;
+			}
+		}
+		CHECK(sameItem(MsetSelectByCount(s, position), expected));
+
+		int lo = randomKey(wide);
+		int hi = lo + (int)(nextRandom() % 200) - 20;
+		int count = 0;
+		for (int i = 0; i < n; i++) {
+			if (items[i].elem >= lo && items[i].elem <= hi) {
+				count += items[i].count;
+			}
+		}
+		CHECK(MsetCountRange(s, lo, hi) == count);
+	}
+
+	//the most common elements by count and then by element, found by
+	//selecting the best of the rest each time.
+	struct item common[TOP_K];
+	struct item expected[TOP_K];
+	int k = n < TOP_K ? n : TOP_K;
+	bool taken[KEYS] = {false};
+	for (int j = 0; j < k; j++) {
+		int best = -1;
+		for (int i = 0; i < n; i++) {
+			if (!taken[i] && (best < 0 || items[i].count > items[best].count)) {
+				best = i;
+			}
+		}
+		taken[best] = true;
+		expected[j] = items[best];
+	}
+	for (int want = 1; want <= TOP_K; want++) {
+		int got = MsetMostCommon(s, want, common);
+		CHECK(got == (want < k ? want : k));
+		for (int j = 0; j < got; j++) {
+			CHECK(sameItem(common[j], expected[j]));
+		}
+	}
+}
+
+/*
+* Checks the set operations between the multiset and a random multiset of a
+* random representation, both ways round, and their versions that change a
+* copy of the multiset.
+*/
+static void checkSetOps(Mset s, const struct reference *ref, bool wide) {
+	int rep = nextRandom() % REPRESENTATIONS;
+	Mset other = newMultiset(rep);
+	struct reference otherRef = {{0}};
+	applyChanges(other, &otherRef, CHANGES, wide);
+	Mset otherView = viewOf(rep, other);
+
+	struct reference expected;
+	for (int op = 0; op < SET_OPS; op++) {
+		Mset result = setOps[op](s, otherView);
+		refSetOp(op, ref, &otherRef, &expected);
+		checkContents(result, &expected);
+		MsetFree(result);
+
+		result = setOps[op](otherView, s);
+		refSetOp(op, &otherRef, ref, &expected);
+		checkContents(result, &expected);
+		MsetFree(result);
+
+		//the copy starts out empty, so its sum with the multiset is a copy.
+		Mset copy = MsetNew();
+		MsetSumInto(copy, s);
+		setOpsInto[op](copy, otherView);
+		refSetOp(op, ref, &otherRef, &expected);
+		checkContents(copy, &expected);
+		setOpsInto[op](copy, copy);
+		refSetOp(op, &expected, &expected, &expected);
+		checkContents(copy, &expected);
+		MsetFree(copy);
+	}
+
+	CHECK(MsetIncluded(s, otherView) == refIncluded(ref, &otherRef));
+	CHECK(MsetIncluded(otherView, s) == refIncluded(&otherRef, ref));
+	CHECK(MsetEquals(s, otherView) ==
+	(refIncluded(ref, &otherRef) && refIncluded(&otherRef, ref)));
+	Mset same = MsetUnion(s, s);
+	CHECK(MsetEquals(s, same) && MsetEquals(same, s));
+	CHECK(MsetIncluded(s, same) && MsetIncluded(same, s));
+	MsetFree(same);
+
+	if (otherView != other) {
+		MsetFree(otherView);
+	}
+	MsetFree(other);
+}
+
+/*
+* Checks that a multiset saved and opened again, and one built from its sorted
+* items, hold the same elements.
+*/
+static void checkCopies(Mset s, const struct reference *ref) {
+	Mset mapped = saveAndOpen(s);
+	checkContents(mapped, ref);
+	MsetFree(mapped);
+
+	struct item items[KEYS];
+	int n = refItems(ref, items);
+	Mset built = MsetFromSortedItems(items, n);
+	checkContents(built, ref);
+	MsetFree(built);
+}
+
+/*
+* Returns the smallest element of the reference greater than the item, or the
+* greatest element smaller than it if forward is false, or UNDEFINED if there
+* is none. An item of UNDEFINED stands for the start or the end.
+*/
+static int refNext(const struct reference *ref, int item, bool forward) {
+	if (forward) {
+		int from = item == UNDEFINED ? KEY_LO : item + 1;
+		for (int i = from; i <= KEY_HI; i++) {
+			if (refCount(ref, i) > 0) {
+				return i;
+			}
+		}
+	} else {
+		int from = item == UNDEFINED ? KEY_HI : item - 1;
+		for (int i = from; i >= KEY_LO; i--) {
+			if (refCount(ref, i) > 0) {
+				return i;
+			}
+		}
+	}
+	return UNDEFINED;
+}
+
+/*
+* Walks a cursor over the multiset in each direction while changing the
+* multiset between moves, often deleting the element the cursor is on. Each
+* move must land on the element after the one the cursor was on as the
+* multiset is now.
+*/
+static void checkCursorsDuringChanges(Mset s, struct reference *ref,
+bool wide) {
+	for (int direction = 0; direction < 2; direction++) {
+		bool forward = direction == 0;
+		MsetCursor cur = MsetCursorNew(s);
+		if (!forward) {
+			while (MsetCursorNext(cur)) {
+			}
+		}
+
+		struct item last = {UNDEFINED, 0};
+		while (true) {
+			if (nextRandom() % 3 == 0) {
+				if (last.elem != UNDEFINED && nextRandom() % 2 == 0) {
+					MsetDeleteMany(s, last.elem, refCount(ref, last.elem));
+					refDelete(ref, last.elem, refCount(ref, last.elem));
+				} else {
+					applyChanges(s, ref, 1 + nextRandom() % 4, wide);
+				}
+				//a cursor move is not a read that flushes buffered inserts.
+				MsetFlush(s);
+				//the cursor still gives its element, with its count as it
+				//was if the element is gone.
+				struct item now = MsetCursorGet(cur);
+				CHECK(now.elem == last.elem);
+				if (last.elem != UNDEFINED && refCount(ref, last.elem) > 0) {
+					CHECK(now.count == refCount(ref, last.elem));
+				} else {
+					CHECK(now.count == last.count);
+				}
+			}
+
+			int next = refNext(ref, last.elem, forward);
+			if (forward && nextRandom() % 4 == 0) {
+				struct item batch[4];
+				int got = MsetCursorNextN(cur, 4, batch);
+				for (int i = 0; i < got; i++) {
+					CHECK(next != UNDEFINED);
+					CHECK(sameItem(batch[i],
+					(struct item){next, refCount(ref, next)}));
+					last = batch[i];
+					next = refNext(ref, next, true);
+				}
+				if (got < 4) {
+					CHECK(next == UNDEFINED);
+					break;
+				}
+				continue;
+			}
+
+			bool moved = forward ? MsetCursorNext(cur) : MsetCursorPrev(cur);
+			CHECK(moved == (next != UNDEFINED));
+			if (!moved) {
+				CHECK(MsetCursorGet(cur).elem == UNDEFINED);
+				break;
+			}
+			last = MsetCursorGet(cur);
+			CHECK(sameItem(last, (struct item){next, refCount(ref, next)}));
+		}
+		MsetCursorFree(cur);
+	}
+}
+
+/*
+* Checks that a snapshot keeps the elements it was taken with, and that a
+* cursor over it walks them, while the multiset goes on changing.
+*/
+static void checkSnapshotUnchanged(Mset s, Mset snapshot,
+struct reference *ref, bool wide) {
+	struct reference old = *ref;
+	struct item items[KEYS];
+	int n = refItems(&old, items);
+
+	MsetCursor cur = MsetCursorNew(snapshot);
+	int half = n / 2;
+	for (int i = 0; i < half; i++) {
+		CHECK(MsetCursorNext(cur));
+		CHECK(sameItem(MsetCursorGet(cur), items[i]));
+	}
+	applyChanges(s, ref, CHANGES, wide);
+	for (int i = half; i < n; i++) {
+		CHECK(MsetCursorNext(cur));
+		CHECK(sameItem(MsetCursorGet(cur), items[i]));
+	}
+	CHECK(!MsetCursorNext(cur));
+	MsetCursorFree(cur);
+
+	checkContents(snapshot, &old);
+	checkContents(s, ref);
+}
+
+/*
+* Runs the tests on one multiset of the representation over ROUNDS rounds of
+* changes.
+*/
+static void runTests(int rep, bool wide) {
+	Mset s = newMultiset(rep);
+	struct reference ref = {{0}};
+	for (testedRound = 0; testedRound < ROUNDS; testedRound++) {
+		applyChanges(s, &ref, CHANGES, wide);
+		Mset view = viewOf(rep, s);
+		checkContents(view, &ref);
+		checkCursors(view, &ref, wide);
+		checkOrder(view, &ref, wide);
+		checkSetOps(view, &ref, wide);
+		checkCopies(view, &ref);
+		if (rep == REP_SNAPSHOT) {
+			checkSnapshotUnchanged(s, view, &ref, wide);
+		}
+		if (view != s) {
+			MsetFree(view);
+		}
+
+		checkCursorsDuringChanges(s, &ref, wide);
+		checkContents(s, &ref);
+	}
+	MsetFree(s);
+}
+
+/*
+* Checks that two multisets hold the same elements with the same counts and
+* agree on their most common elements.
+*/
+static void checkSame(Mset s, Mset expected) {
+	CHECK(MsetSize(s) == MsetSize(expected));
+	CHECK(MsetTotalCount(s) == MsetTotalCount(expected));
+	MsetCursor cur = MsetCursorNew(s);
+	MsetCursor expectedCur = MsetCursorNew(expected);
+	bool more;
+	do {
+		more = MsetCursorNext(expectedCur);
+		CHECK(MsetCursorNext(cur) == more);
+		CHECK(sameItem(MsetCursorGet(cur), MsetCursorGet(expectedCur)));
+	} while (more);
+	MsetCursorFree(cur);
+	MsetCursorFree(expectedCur);
+
+	struct item common[TOP_K];
+	struct item expectedCommon[TOP_K];
+	int n = MsetMostCommon(expected, TOP_K, expectedCommon);
+	CHECK(MsetMostCommon(s, TOP_K, common) == n);
+	for (int i = 0; i < n; i++) {
+		CHECK(sameItem(common[i], expectedCommon[i]));
+	}
+}
+
+/*
+* Checks the set operations and inclusion of two AVL multisets big enough to be
+* split between PARALLEL_THREADS threads against the same operations run in
+* one thread. The first multiset has a node pool and a count index, which the
+* results of the operations keep, and the second is also given as a snapshot.
+*/
+static void checkParallel(void) {
+	Mset s1 = MsetNewWithFlags(MSET_NODE_POOL | MSET_COUNT_INDEX);
+	Mset s2 = MsetNew();
+	//every third element on average, so the two share about a third.
+	for (int i = 0; i < PARALLEL_SIZE; i++) {
+		MsetInsertMany(s1, i * 3 + nextRandom() % 3, 1 + nextRandom() % 4);
+		MsetInsertMany(s2, i * 3 + nextRandom() % 3, 1 + nextRandom() % 4);
+	}
+	Mset snapshot = MsetSnapshot(s2);
+	Mset pairs[][2] = {{s1, s2}, {s2, s1}, {s1, snapshot}, {snapshot, s1}};
+
+	for (int i = 0; i < 4; i++) {
+		Mset a = pairs[i][0];
+		Mset b = pairs[i][1];
+		for (int op = 0; op < SET_OPS; op++) {
+			MsetSetParallelism(1);
+			Mset serial = setOps[op](a, b);
+			MsetSetParallelism(PARALLEL_THREADS);
+			Mset parallel = setOps[op](a, b);
+			MsetSetParallelism(1);
+			checkSame(parallel, serial);
+			MsetFree(parallel);
+			MsetFree(serial);
+		}
+
+		Mset both = MsetIntersection(a, b);
+		Mset sum = MsetSum(a, b);
+		MsetSetParallelism(PARALLEL_THREADS);
+		CHECK(!MsetIncluded(a, b));
+		CHECK(MsetIncluded(both, a) && MsetIncluded(both, b));
+		CHECK(MsetIncluded(a, sum) && !MsetIncluded(sum, a));
+		MsetSetParallelism(1);
+		MsetFree(both);
+		MsetFree(sum);
+	}
+	MsetFree(snapshot);
+	MsetFree(s1);
+	MsetFree(s2);
+}
+
+// What one of the changing threads of checkThreads does to the shared
+// multiset: it changes only the elements first, first + WRITERS, and so on,
+// and keeps their counts, so it can check them while other threads change the
+// multiset.
+struct writerJob {
+	Mset s;
+	int first;
+	bool flush;
+	unsigned long long rng;
+	int counts[KEYS / WRITERS];
+};
+
+// What the reading threads of checkThreads share.
+struct readerJob {
+	Mset s;
+	int stop;
+};
+
+/*
+* Inserts and deletes elements of the thread's own, checking their counts now
+* and then.
+*/
+static void *writerThread(void *arg) {
+	struct writerJob *job = arg;
+	for (int i = 1; i <= THREAD_CHANGES; i++) {
+		int j = nextRandomFrom(&job->rng) % (KEYS / WRITERS);
+		int item = KEY_LO + job->first + j * WRITERS;
+		int amount = 1 + nextRandomFrom(&job->rng) % 3;
+		if (nextRandomFrom(&job->rng) % 3 != 0) {
+			MsetInsertMany(job->s, item, amount);
+			job->counts[j] += amount;
+		} else {
+			MsetDeleteMany(job->s, item, amount);
+			job->counts[j] = job->counts[j] > amount ? job->counts[j] - amount
+			: 0;
+		}
+
+		if (i % 64 == 0) {
+			if (job->flush) {
+				MsetFlush(job->s);
+			}
+			for (j = 0; j < KEYS / WRITERS; j += 17) {
+				item = KEY_LO + job->first + j * WRITERS;
+				CHECK(MsetGetCount(job->s, item) == job->counts[j]);
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+* Walks the shared multiset with cursors until the changing threads are done,
+* checking that the elements come in increasing order with positive counts.
+*/
+static void *readerThread(void *arg) {
+	struct readerJob *job = arg;
+	while (!__atomic_load_n(&job->stop, __ATOMIC_ACQUIRE)) {
+		MsetCursor cur = MsetCursorNew(job->s);
+		int prev = UNDEFINED;
+		while (MsetCursorNext(cur)) {
+			struct item item = MsetCursorGet(cur);
+			CHECK(item.elem > prev && item.elem <= KEY_HI && item.count > 0);
+			prev = item.elem;
+		}
+
+		struct item batch[MAX_BATCH];
+		MsetCursorSeek(cur, KEY_LO);
+		prev = UNDEFINED;
+		int got;
+		while ((got = MsetCursorNextN(cur, MAX_BATCH, batch)) > 0) {
+			for (int i = 0; i < got; i++) {
+				CHECK(batch[i].elem > prev && batch[i].count > 0);
+				prev = batch[i].elem;
+			}
+		}
+		MsetCursorFree(cur);
+
+		int size = MsetSize(job->s);
+		CHECK(size >= 0 && size <= KEYS);
+		CHECK(MsetTotalCount(job->s) >= 0);
+	}
+	return NULL;
+}
+
+/*
+* Has WRITERS threads change a concurrent or sharded multiset, with or without
+* write combining, while READERS threads walk it, then checks the multiset
+* against the counts the changing threads kept.
+*/
+static void checkThreads(bool sharded, bool combined, bool flushOnRead) {
+	Mset s = sharded ? MsetNewSharded(SHARDS, DENSE_LO, DENSE_HI)
+	: MsetNewWithFlags(MSET_CONCURRENT);
+	if (combined) {
+		MsetSetWriteCombining(s, COMBINE_THRESHOLD, flushOnRead);
+	}
+
+	struct writerJob writers[WRITERS];
+	struct readerJob reader = {s, 0};
+	pthread_t writerIds[WRITERS];
+	pthread_t readerIds[READERS];
+	for (int i = 0; i < READERS; i++) {
+		pthread_create(&readerIds[i], NULL, readerThread, &reader);
+	}
+	for (int i = 0; i < WRITERS; i++) {
+		writers[i] = (struct writerJob){s, i, !flushOnRead,
+		rngState ^ (i + 1) * DEFAULT_SEED, {0}};
+		pthread_create(&writerIds[i], NULL, writerThread, &writers[i]);
+	}
+	for (int i = 0; i < WRITERS; i++) {
+		pthread_join(writerIds[i], NULL);
+	}
+	__atomic_store_n(&reader.stop, 1, __ATOMIC_RELEASE);
+	for (int i = 0; i < READERS; i++) {
+		pthread_join(readerIds[i], NULL);
+	}
+
+	MsetFlush(s);
+	struct reference ref = {{0}};
+	for (int i = 0; i < WRITERS; i++) {
+		for (int j = 0; j < KEYS / WRITERS; j++) {
+			ref.counts[i + j * WRITERS] = writers[i].counts[j];
+		}
+	}
+	checkContents(s, &ref);
+	checkCursors(s, &ref, true);
+	MsetFree(s);
+}
+
+int main(int argc, char *argv[]) {
+	int runs = argc > 1 ? atoi(argv[1]) : DEFAULT_RUNS;
+	unsigned long long seed = argc > 2 ? strtoull(argv[2], NULL, 0)
+	: DEFAULT_SEED;
+
+	for (int rep = 0; rep < REPRESENTATIONS; rep++) {
+		testedRep = repNames[rep];
+		for (testedRun = 0; testedRun < runs; testedRun++) {
+			//the generator must not start at 0.
+			rngState = seed ^ ((unsigned long long)rep << 32 | testedRun) ^
+			DEFAULT_SEED;
+			if (rngState == 0) {
+				rngState = DEFAULT_SEED;
+			}
+			runTests(rep, testedRun % 2 == 1);
+		}
+		printf("%-24s ok\n", repNames[rep]);
+	}
+
+	//the checks below have no rounds.
+	testedRound = 0;
+	testedRep = "parallel";
+	for (testedRun = 0; testedRun < runs; testedRun++) {
+		rngState = seed ^ testedRun ^ DEFAULT_SEED;
+		if (rngState == 0) {
+			rngState = DEFAULT_SEED;
+		}
+		checkParallel();
+	}
+	printf("%-24s ok\n", "parallel set operations");
+
+	//each thread's elements are changed by that thread alone.
+	struct {
+		const char *name;
+		bool sharded;
+		bool combined;
+		bool flushOnRead;
+	} threaded[] = {
+		{"concurrent threads", false, false, false},
+		{"combined threads", false, true, true},
+		{"sharded threads", true, false, false},
+		{"sharded combined threads", true, true, false},
+	};
+	for (int i = 0; i < 4; i++) {
+		testedRep = threaded[i].name;
+		for (testedRun = 0; testedRun < runs; testedRun++) {
+			checkThreads(threaded[i].sharded, threaded[i].combined,
+			threaded[i].flushOnRead);
+		}
+		printf("%-24s ok\n", threaded[i].name);
+	}
+	printf("All tests passed\n");
+	return 0;
+}